@@ -0,0 +1,304 @@
+/* SPDX-License-Identifier: GPL-2.0 OR MIT */
+/* * Copyright (C) 2019 Abhishek Ghogare <abhishek.ghogare@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of
+ * this software and associated documentation files (the "Software"), to deal in
+ * the Software without restriction, including without limitation the rights to
+ * use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of
+ * the Software, and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+ * FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+ * COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+ * IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+
+
+/*
+ *	Microbenchmarks of the allocation wrappers
+ *
+ *	usage: bench_mmwl [-n iterations] [-t max_threads] [-s sample_rate] [-d stack_depth]
+ *	       bench_raw  [-n iterations] [-t max_threads]
+ *
+ *	The same source is built with mmwl.h (bench_mmwl) and without it (bench_raw, -DBENCH_RAW),
+ *	'make bench' runs both so that the overhead of mmwl_core.c can be compared.
+ *	Every benchmark reports ns per operation and throughput in millions of operations per second,
+ *	the size class benchmark also reports the mmwl metadata bytes per live allocation.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+#ifndef BENCH_RAW
+#include "mmwl.h"
+#endif
+
+
+#define BENCH_WINDOW		256		// Live blocks kept by every thread
+#define BENCH_QUEUE		1024		// Slots of the producer/consumer queue, power of two
+#define BENCH_MAX_THREADS	64
+#define BENCH_REALLOC_MAX	(1024*1024)	// Size reached by the realloc growth benchmark
+
+static unsigned long iterations = 1000000;		// Operations per benchmark and thread
+static unsigned int max_threads = 0;			// 0: number of online CPUs
+
+static const size_t size_classes[] = { 16, 64, 256, 1024, 4096, 65536 };
+
+
+
+
+/*
+ *	Monotonic time in ns
+ */
+static double now_ns (void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+
+
+
+static void report (	const	char *		name,				// Benchmark name
+				unsigned long	ops,				// Operations done
+				double		ns,				// Elapsed time
+				double		meta )				// Metadata bytes per live block, <0 if not measured
+{
+	printf("%-28s %10.1f ns/op %10.2f Mops/s", name, ns / ops, ops * 1e3 / ns);
+	if (meta >= 0)
+		printf(" %8.1f meta B/block", meta);
+	printf("\n");
+}
+
+
+
+
+/*
+ *	Metadata bytes added by mmwl to the blocks of a window
+ */
+static double window_overhead (void ** window, unsigned int count)
+{
+#ifdef BENCH_RAW
+	(void)window;
+	(void)count;
+	return 0;
+#else
+	size_t total = 0;
+	unsigned int i;
+
+	for (i = 0; i < count; i++)
+		total += mmwl_block_overhead(window[i]);
+	return (double)total / count;
+#endif
+}
+
+
+
+
+/*
+ *	malloc/free pairs of one size class, over a window of live blocks
+ */
+static void bench_size_class (size_t size)
+{
+	void * window[BENCH_WINDOW] = { NULL };
+	char name[64];
+	unsigned long i;
+	double start, meta;
+
+	for (i = 0; i < BENCH_WINDOW; i++)
+		window[i] = malloc(size);
+
+	start = now_ns();
+	for (i = 0; i < iterations; i++)
+	{
+		free(window[i % BENCH_WINDOW]);
+		window[i % BENCH_WINDOW] = malloc(size);
+	}
+	start = now_ns() - start;
+
+	meta = window_overhead(window, BENCH_WINDOW);
+	for (i = 0; i < BENCH_WINDOW; i++)
+		free(window[i]);
+
+	snprintf(name, sizeof(name), "malloc/free %zu", size);
+	report(name, iterations, start, meta);
+}
+
+
+
+
+/*
+ *	Blocks grown by realloc from 16 bytes up to BENCH_REALLOC_MAX, by 1.5x steps
+ */
+static void bench_realloc (void)
+{
+	unsigned long ops = 0;
+	void * ptr = NULL;
+	size_t size;
+	double start;
+
+	start = now_ns();
+	while (ops < iterations / 16)
+	{
+		ptr = NULL;
+		for (size = 16; size <= BENCH_REALLOC_MAX; size += size / 2, ops++)
+			ptr = realloc(ptr, size);
+		free(ptr);
+	}
+	report("realloc growth", ops, now_ns() - start, -1);
+}
+
+
+
+
+/*
+ *	Single producer, single consumer queue of blocks
+ */
+struct queue {
+	void *			slots[BENCH_QUEUE];
+	unsigned long		head __attribute__((aligned(64)));	// Written by the producer
+	unsigned long		tail __attribute__((aligned(64)));	// Written by the consumer
+};
+
+static void * consumer (void * arg)
+{
+	struct queue * q = arg;
+	unsigned long i, tail = 0;
+
+	for (i = 0; i < iterations; i++, tail++)
+	{
+		while (__atomic_load_n(&q->head, __ATOMIC_ACQUIRE) == tail)
+			sched_yield();
+		free(q->slots[tail % BENCH_QUEUE]);
+		__atomic_store_n(&q->tail, tail + 1, __ATOMIC_RELEASE);
+	}
+	return NULL;
+}
+
+/*
+ *	Blocks allocated by one thread and freed by another
+ */
+static void bench_producer_consumer (void)
+{
+	struct queue * q = calloc(1, sizeof(struct queue));
+	pthread_t thread;
+	unsigned long i;
+	double start;
+
+	start = now_ns();
+	pthread_create(&thread, NULL, consumer, q);
+	for (i = 0; i < iterations; i++)
+	{
+		while (i - __atomic_load_n(&q->tail, __ATOMIC_ACQUIRE) == BENCH_QUEUE)
+			sched_yield();
+		q->slots[i % BENCH_QUEUE] = malloc(size_classes[i % 4]);
+		__atomic_store_n(&q->head, i + 1, __ATOMIC_RELEASE);
+	}
+	pthread_join(thread, NULL);
+	report("producer/consumer free", iterations, now_ns() - start, -1);
+	free(q);
+}
+
+
+
+
+/*
+ *	malloc/free pairs of mixed sizes, run by every thread of the scaling benchmark
+ */
+static void * scaling_worker (void * arg)
+{
+	void * window[BENCH_WINDOW] = { NULL };
+	unsigned long i;
+
+	(void)arg;
+	for (i = 0; i < iterations; i++)
+	{
+		free(window[i % BENCH_WINDOW]);
+		window[i % BENCH_WINDOW] = malloc(size_classes[(i * 7) % 5]);
+	}
+	for (i = 0; i < BENCH_WINDOW; i++)
+		free(window[i]);
+	return NULL;
+}
+
+static void bench_scaling (void)
+{
+	pthread_t threads[BENCH_MAX_THREADS];
+	unsigned int nr, i;
+	char name[64];
+	double start;
+
+	// Thread counts are powers of two, always ending with max_threads
+	for (nr = 1; nr <= max_threads; nr = (nr < max_threads && nr * 2 > max_threads) ? max_threads : nr * 2)
+	{
+		start = now_ns();
+		for (i = 0; i < nr; i++)
+			pthread_create(&threads[i], NULL, scaling_worker, NULL);
+		for (i = 0; i < nr; i++)
+			pthread_join(threads[i], NULL);
+		snprintf(name, sizeof(name), "scaling %u threads", nr);
+		report(name, iterations * nr, now_ns() - start, -1);
+	}
+}
+
+
+
+
+int main (int argc, char ** argv)
+{
+	unsigned int i;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "n:t:s:d:")) != -1)
+	{
+		switch (opt)
+		{
+		case 'n':
+			iterations = strtoul(optarg, NULL, 0);
+			break;
+		case 't':
+			max_threads = strtoul(optarg, NULL, 0);
+			break;
+	#ifndef BENCH_RAW
+		case 's':
+			mmwl_set_sample_rate(strtoul(optarg, NULL, 0));
+			break;
+		case 'd':
+			mmwl_set_stack_depth(strtoul(optarg, NULL, 0));
+			break;
+	#endif
+		default:
+			fprintf(stderr, "usage: %s [-n iterations] [-t max_threads] [-s sample_rate] [-d stack_depth]\n", argv[0]);
+			return 1;
+		}
+	}
+	if (iterations == 0)
+		iterations = 1;
+	if (max_threads == 0)
+		max_threads = sysconf(_SC_NPROCESSORS_ONLN);
+	if (max_threads > BENCH_MAX_THREADS)
+		max_threads = BENCH_MAX_THREADS;
+
+#ifdef BENCH_RAW
+	printf("*** raw allocator, %lu iterations ***\n", iterations);
+#else
+	printf("*** mmwl, %lu iterations ***\n", iterations);
+#endif
+	for (i = 0; i < sizeof(size_classes) / sizeof(size_classes[0]); i++)
+		bench_size_class(size_classes[i]);
+	bench_realloc();
+	bench_producer_consumer();
+	bench_scaling();
+	return 0;
+}
@@ -23,6 +23,8 @@
 #include <linux/kernel.h>
 #include <linux/init.h>
 #include <linux/slab.h>
+#include <linux/vmalloc.h>
+#include <linux/mm.h>
 #include "mmwl.h"
 
 MODULE_LICENSE("Dual MIT/GPL");
@@ -32,14 +34,101 @@ MODULE_DESCRIPTION("Test module for memory management wrapper library");
 
 static int *test_mem1;
 //static void *test_mem2;
+static struct kmem_cache *test_cache;
+static int failures;
+
+#define CHECK(cond)											\
+	do {												\
+		if (!(cond)) {										\
+			printk(KERN_ERR "FAIL %s:%d: %s\n", __FILE__, __LINE__, #cond);			\
+			failures++;									\
+		}											\
+	} while(0)
+
+/* Objects of a wrapped cache keep the alignment the cache was created with */
+static void test_cache_align(void) {
+	struct kmem_cache *cache = kmem_cache_create("mmwl_test_align", 72, 128, 0, NULL);
+	struct kmem_cache *hw_cache = kmem_cache_create("mmwl_test_hwcache", 72, 0, SLAB_HWCACHE_ALIGN, NULL);
+	void *obj[4];
+	int i;
+
+	CHECK(cache != NULL && hw_cache != NULL);
+	if (cache == NULL || hw_cache == NULL)
+		goto out;
+	for (i = 0; i < 4; i++) {
+		obj[i] = kmem_cache_alloc(cache, GFP_KERNEL);
+		CHECK(obj[i] != NULL && ((unsigned long)obj[i] & 127) == 0);
+	}
+	for (i = 0; i < 4; i++)
+		kmem_cache_free(cache, obj[i]);
+	for (i = 0; i < 4; i++) {
+		obj[i] = kmem_cache_alloc(hw_cache, GFP_KERNEL);
+		CHECK(obj[i] != NULL && ((unsigned long)obj[i] & (cache_line_size() - 1)) == 0);
+	}
+	for (i = 0; i < 4; i++)
+		kmem_cache_free(hw_cache, obj[i]);
+out:
+	kmem_cache_destroy(cache);
+	kmem_cache_destroy(hw_cache);
+}
+
+static void test_ctor(void *obj) {
+	*(int *)obj = 0x5a5a;
+}
+
+/* A cache with a constructor is left unwrapped, its objects are constructed */
+static void test_cache_ctor(void) {
+	struct kmem_cache *cache = kmem_cache_create("mmwl_test_ctor", 64, 0, 0, test_ctor);
+	int *obj;
+
+	CHECK(cache != NULL);
+	if (cache == NULL)
+		return;
+	obj = kmem_cache_alloc(cache, GFP_KERNEL);
+	CHECK(obj != NULL && *obj == 0x5a5a);
+	kmem_cache_free(cache, obj);
+	kmem_cache_destroy(cache);
+}
+
+/* vmalloc & kvmalloc blocks are tracked, a free of the wrong family leaves the block alone */
+static void test_vmalloc(void) {
+	char *vblock = vzalloc(3 * PAGE_SIZE);
+	char *kvblock = kvmalloc(4 << 20, GFP_KERNEL);
+	char *kblock = kmalloc(100, GFP_KERNEL);
+
+	CHECK(vblock != NULL && kvblock != NULL && kblock != NULL);
+	if (vblock == NULL || kvblock == NULL || kblock == NULL)
+		goto out;
+	CHECK(vblock[0] == 0 && vblock[3 * PAGE_SIZE - 1] == 0);
+	CHECK(mmwl_block_size(vblock) == 3 * PAGE_SIZE);
+	CHECK(mmwl_block_size(kvblock) == 4 << 20);
+	kfree(vblock);				/* reported, left allocated */
+	CHECK(mmwl_block_size(vblock) == 3 * PAGE_SIZE);
+	vfree(kblock);				/* reported, left allocated */
+	CHECK(mmwl_block_size(kblock) == 100);
+out:
+	vfree(vblock);
+	kvfree(kvblock);
+	kfree(kblock);
+}
 
 int __init init_module(void) {
+	mmwl_debugfs_create();
 	test_mem1 = (int *)kmalloc(300, GFP_KERNEL);
 	test_mem1[2] = 0;
 	test_mem1 = krealloc(test_mem1, 500, GFP_KERNEL);
 	test_mem1[-6] = 12;
 	test_mem1 = (int *)kmalloc(400, GFP_KERNEL);
 	test_mem1 = (int *)kmalloc(600, GFP_KERNEL);
+	vfree(vzalloc(3 * PAGE_SIZE));
+	kvfree(kvmalloc(200, GFP_KERNEL));
+	test_cache = kmem_cache_create("mmwl_test", 72, 0, 0, NULL);
+	kmem_cache_free(test_cache, kmem_cache_zalloc(test_cache, GFP_KERNEL));
+	kmem_cache_alloc(test_cache, GFP_KERNEL);
+	test_cache_align();
+	test_cache_ctor();
+	test_vmalloc();
+	printk(KERN_INFO "mmwl test %s, %d failures", failures ? "FAILED" : "passed", failures);
 	printk(KERN_INFO "test module inserted");
 	return 0;
 }
@@ -47,5 +136,8 @@ int __init init_module(void) {
 void __exit cleanup_module(void) {
 	kfree(test_mem1);
 	mmwl_status();
+	mmwl_status_caches();
+	kmem_cache_destroy(test_cache);
+	mmwl_debugfs_remove();
 	printk(KERN_INFO "cleaning up test module");
 }
@@ -27,17 +27,32 @@
 
 #include <linux/kernel.h>
 #include <linux/slab.h>
+#include <linux/vmalloc.h>
 #define kmalloc(size, flags)		mmwl_malloc(size, flags, __FILE__, __FUNCTION__, __LINE__)
+#define kzalloc(size, flags)		mmwl_malloc(size, (flags) | __GFP_ZERO, __FILE__, __FUNCTION__, __LINE__)
 #define krealloc(ptr, size, flags)	mmwl_realloc(ptr, size, flags, __FILE__, __FUNCTION__, __LINE__)
-#define kcalloc(blocks, size)		mmwl_malloc((blocks)*(size), flags, __FILE__, __FUNCTION__, __LINE__)
+#define kcalloc(blocks, size, flags)	mmwl_calloc(blocks, size, flags, __FILE__, __FUNCTION__, __LINE__)
 #define kfree(ptr)			mmwl_free(ptr, __FILE__, __FUNCTION__, __LINE__)
 
+#define vmalloc(size)			mmwl_vmalloc(size, GFP_KERNEL, __FILE__, __FUNCTION__, __LINE__)
+#define vzalloc(size)			mmwl_vmalloc(size, GFP_KERNEL | __GFP_ZERO, __FILE__, __FUNCTION__, __LINE__)
+#define vfree(ptr)			mmwl_vfree(ptr, __FILE__, __FUNCTION__, __LINE__)
+#define kvmalloc(size, flags)		mmwl_kvmalloc(size, flags, __FILE__, __FUNCTION__, __LINE__)
+#define kvzalloc(size, flags)		mmwl_kvmalloc(size, (flags) | __GFP_ZERO, __FILE__, __FUNCTION__, __LINE__)
+#define kvfree(ptr)			mmwl_kvfree(ptr, __FILE__, __FUNCTION__, __LINE__)
+
+#define kmem_cache_create(name, size, align, flags, ctor)	mmwl_cache_create(name, size, align, flags, ctor)
+#define kmem_cache_destroy(cache)	mmwl_cache_destroy(cache)
+#define kmem_cache_alloc(cache, flags)	mmwl_cache_alloc(cache, flags, __FILE__, __FUNCTION__, __LINE__)
+#define kmem_cache_zalloc(cache, flags)	mmwl_cache_alloc(cache, (flags) | __GFP_ZERO, __FILE__, __FUNCTION__, __LINE__)
+#define kmem_cache_free(cache, ptr)	mmwl_cache_free(cache, ptr, __FILE__, __FUNCTION__, __LINE__)
+
 #else /* __KERNEL__ */
 
 #include <stdlib.h>
 #define malloc(size)			mmwl_malloc(size, __FILE__, __FUNCTION__, __LINE__)
 #define realloc(ptr, size)		mmwl_realloc(ptr, size, __FILE__, __FUNCTION__, __LINE__)
-#define calloc(blocks, size)		mmwl_malloc((blocks)*(size), __FILE__, __FUNCTION__, __LINE__)
+#define calloc(blocks, size)		mmwl_calloc(blocks, size, __FILE__, __FUNCTION__, __LINE__)
 #define free(ptr)			mmwl_free(ptr, __FILE__, __FUNCTION__, __LINE__)
 
 #endif /* __KERNEL__ */
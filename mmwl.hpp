@@ -0,0 +1,132 @@
+/* SPDX-License-Identifier: GPL-2.0 OR MIT */
+/* * Copyright (C) 2019 Abhishek Ghogare <abhishek.ghogare@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of
+ * this software and associated documentation files (the "Software"), to deal in
+ * the Software without restriction, including without limitation the rights to
+ * use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of
+ * the Software, and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+ * FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+ * COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+ * IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#ifndef MMWL_HPP_
+#define MMWL_HPP_
+
+/*
+ *	C++ side of the library, user side only
+ *
+ *	mmwl::allocator<T> is an allocator for the standard containers, its blocks are charged to a
+ *	call site named after T, e.g. '@std::_Rb_tree_node<std::pair<const int, double> >:0 in
+ *	mmwl::allocator' for the nodes of a std::map<int, double>. The name comes from the compiler
+ *	and is copied once per type. Sized deallocations are checked against the allocated size.
+ *	Global operator new & delete are routed to the library by linking mmwl_new.cpp.
+ */
+
+#include <cstddef>
+#include <cstring>
+#include <new>
+#include "mmwl_core.h"
+
+#define MMWL_TYPE_NAME_MAX	256		// Longest type name kept, longer names are truncated
+
+namespace mmwl {
+
+/*
+ *	Copies the T of a __PRETTY_FUNCTION__ of the form "... [with T = <type>]" (gcc) or "... [T = <type>]" (clang)
+ */
+inline const char * type_name_copy (char * name, std::size_t size, const char * pretty)
+{
+	const char * start = std::strstr(pretty, "T = ");
+	const char * end = std::strrchr(pretty, ']');
+	std::size_t length = 0;
+
+	if (start == NULL || end == NULL || end < start)
+		return pretty;
+	start += 4;
+	length = end - start < (std::ptrdiff_t)size ? end - start : size - 1;
+	std::memcpy(name, start, length);
+	name[length] = '\0';
+	return name;
+}
+
+/*
+ *	Returns the name of T, the same pointer on every call as call sites are compared by address
+ */
+template <typename T>
+inline const char * type_name ()
+{
+	static char name[MMWL_TYPE_NAME_MAX];
+	static const char * const copied = type_name_copy(name, sizeof(name), __PRETTY_FUNCTION__);
+	return copied;
+}
+
+/*
+ *	Standard allocator charging its blocks to the call site of T
+ */
+template <typename T>
+class allocator {
+public:
+	typedef T		value_type;
+	typedef T *		pointer;
+	typedef const T *	const_pointer;
+	typedef T &		reference;
+	typedef const T &	const_reference;
+	typedef std::size_t	size_type;
+	typedef std::ptrdiff_t	difference_type;
+
+	template <typename U>
+	struct rebind {
+		typedef allocator<U>	other;
+	};
+
+	allocator () noexcept {}
+
+	template <typename U>
+	allocator (const allocator<U> &) noexcept {}
+
+	T * allocate (std::size_t n)
+	{
+		void * ptr = NULL;
+
+		if (n > (std::size_t)-1 / sizeof(T))
+			throw std::bad_array_new_length();
+		if (alignof(T) > alignof(std::max_align_t))
+			ptr = mmwl_memalign(alignof(T), n * sizeof(T), "mmwl::allocator", type_name<T>(), 0);
+		else
+			ptr = mmwl_malloc(n * sizeof(T), "mmwl::allocator", type_name<T>(), 0);
+		if (ptr == NULL)
+			throw std::bad_alloc();
+		return static_cast<T *>(ptr);
+	}
+
+	void deallocate (T * ptr, std::size_t n) noexcept
+	{
+		mmwl_free_sized(ptr, n * sizeof(T), "mmwl::allocator", type_name<T>(), 0);
+	}
+};
+
+template <typename T, typename U>
+inline bool operator== (const allocator<T> &, const allocator<U> &) noexcept
+{
+	return true;
+}
+
+template <typename T, typename U>
+inline bool operator!= (const allocator<T> &, const allocator<U> &) noexcept
+{
+	return false;
+}
+
+} // namespace mmwl
+
+#endif //MMWL_HPP_
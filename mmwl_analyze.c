@@ -0,0 +1,550 @@
+/* SPDX-License-Identifier: GPL-2.0 OR MIT */
+/* * Copyright (C) 2019 Abhishek Ghogare <abhishek.ghogare@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of
+ * this software and associated documentation files (the "Software"), to deal in
+ * the Software without restriction, including without limitation the rights to
+ * use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of
+ * the Software, and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+ * FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+ * COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+ * IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+
+/*
+ *	Offline analyzer of mmwl binary event traces (see mmwl_trace.h)
+ *
+ *	usage: mmwl_analyze [-i interval_ms] [-n top_n] [-w window] trace_file
+ *
+ *	The trace is streamed, memory use is bounded by the number of live blocks and call sites.
+ *	Events of different threads are written in batches, so they are put back in timestamp order
+ *	through a reorder window of 'window' events before being analyzed.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "mmwl_trace.h"
+
+#define DEFAULT_INTERVAL_MS	1000	// Default period of the timeline
+#define DEFAULT_TOP_N		10	// Default number of call sites listed
+#define DEFAULT_WINDOW		(1<<18)	// Default size of the reorder window, in events
+
+
+/*
+ *	Live block, entry of the address table
+ */
+struct live_block {
+	unsigned long long	addr;			// Address of the user block, 0 for an empty entry
+	unsigned long long	size;			// Size of the user block
+	unsigned long long	timestamp;		// Time of the allocation
+	unsigned int		site_id;		// Call site of the allocation
+};
+
+/*
+ *	Statistics of a call site
+ */
+struct site_stats {
+	char *			filename;		// Name of the source file, NULL if not defined
+	char *			func_name;		// Name of the function
+	unsigned int		line_num;		// Line number
+	unsigned long long	alloc_count;		// Blocks allocated from the site
+	unsigned long long	alloc_size;		// Bytes allocated from the site
+	unsigned long long	free_count;		// Blocks allocated from the site and freed
+	unsigned long long	live_count;		// Blocks allocated from the site still alive
+	unsigned long long	live_size;		// Bytes allocated from the site still alive
+	unsigned long long	lifetime;		// Sum of the lifetimes of the freed blocks, in ns
+};
+
+
+static struct live_block * table = NULL;		// Open addressing table of live blocks
+static size_t table_size = 0;				// Number of entries, power of two
+static size_t table_used = 0;				// Number of live blocks
+
+static struct site_stats * sites = NULL;		// Statistics indexed by site id
+static size_t site_count = 0;				// Number of entries of sites[]
+
+static struct mmwl_trace_event * window = NULL;		// Min heap of events ordered by timestamp
+static size_t window_size = DEFAULT_WINDOW;		// Capacity of the heap
+static size_t window_used = 0;				// Events in the heap
+
+static unsigned long long interval = DEFAULT_INTERVAL_MS * 1000000ULL;	// Timeline period in ns
+static unsigned long long first_ts = 0;			// Timestamp of the first event
+static unsigned long long next_tick = 0;		// Timestamp of the next timeline line
+static unsigned long long live_size = 0;		// Bytes alive
+static unsigned long long peak_size = 0;		// Highest value of live_size
+static unsigned long long peak_ts = 0;			// Time of peak_size
+static unsigned long long tick_allocs = 0;		// Allocations since the last timeline line
+static unsigned long long event_count[MMWL_TRACE_DROP+1];	// Number of events per operation
+static unsigned long long dropped = 0;			// Events lost while tracing
+static unsigned long long unmatched = 0;		// Frees of blocks allocated before the trace started
+
+
+
+
+static inline size_t addr_hash (unsigned long long addr)
+{
+	addr ^= addr >> 29;
+	addr *= 0xBF58476D1CE4E5B9ULL;
+	addr ^= addr >> 32;
+	return (size_t)addr & (table_size - 1);
+}
+
+
+
+
+/*
+ *	Returns the slot of a block in the address table, or of the empty slot where it goes
+ */
+static size_t table_find (unsigned long long addr)
+{
+	size_t slot = addr_hash(addr);
+	while (table[slot].addr != 0 && table[slot].addr != addr)
+		slot = (slot + 1) & (table_size - 1);
+	return slot;
+}
+
+
+
+
+static void table_insert (struct live_block * block)
+{
+	size_t slot = 0;
+
+	if (2 * (table_used + 1) > table_size)
+	{
+		// Grow the table to keep the load under a half
+		struct live_block * old = table;
+		size_t old_size = table_size;
+		size_t i = 0;
+
+		table_size = table_size ? 2 * table_size : 1024;
+		table = calloc(table_size, sizeof(struct live_block));
+		if (table == NULL)
+		{
+			fprintf(stderr, "out of memory\n");
+			exit(1);
+		}
+		for (i = 0 ; i < old_size ; i++)
+			if (old[i].addr != 0)
+				table[table_find(old[i].addr)] = old[i];
+		free(old);
+	}
+
+	slot = table_find(block->addr);
+	if (table[slot].addr == 0)
+		table_used++;
+	table[slot] = *block;
+}
+
+
+
+
+/*
+ *	Removes a block from the address table, returns 0 if the block is not in the table
+ */
+static int table_remove (unsigned long long addr, struct live_block * block)
+{
+	size_t slot = 0;
+	size_t next = 0;
+
+	if (table_size == 0 || table[slot = table_find(addr)].addr == 0)
+		return 0;
+	*block = table[slot];
+	table_used--;
+
+	// Shift back the following entries of the probe sequence
+	for (next = (slot + 1) & (table_size - 1) ; table[next].addr != 0 ; next = (next + 1) & (table_size - 1))
+	{
+		size_t home = addr_hash(table[next].addr);
+		if (((next - home) & (table_size - 1)) >= ((next - slot) & (table_size - 1)))
+		{
+			table[slot] = table[next];
+			slot = next;
+		}
+	}
+	table[slot].addr = 0;
+	return 1;
+}
+
+
+
+
+/*
+ *	Returns the statistics of a call site, growing the array when needed
+ */
+static struct site_stats * site_of (unsigned int site_id)
+{
+	if (site_id >= site_count)
+	{
+		size_t count = site_count ? site_count : 256;
+		while (count <= site_id)
+			count *= 2;
+		sites = realloc(sites, count * sizeof(struct site_stats));
+		if (sites == NULL)
+		{
+			fprintf(stderr, "out of memory\n");
+			exit(1);
+		}
+		memset(&sites[site_count], 0, (count - site_count) * sizeof(struct site_stats));
+		site_count = count;
+	}
+	return &sites[site_id];
+}
+
+
+
+
+static void account_alloc (struct mmwl_trace_event * event)
+{
+	struct live_block block = {
+		.addr		= event->addr,
+		.size		= event->size,
+		.timestamp	= event->timestamp,
+		.site_id	= event->site_id,
+	};
+	struct live_block stale;
+	struct site_stats * site = NULL;
+
+	// The free of the previous block at this address was lost
+	if (table_size != 0 && table_remove(event->addr, &stale))
+	{
+		site = site_of(stale.site_id);
+		site->live_count--;
+		site->live_size -= stale.size;
+		live_size -= stale.size;
+	}
+
+	site = site_of(event->site_id);
+	table_insert(&block);
+	site->alloc_count++;
+	site->alloc_size += event->size;
+	site->live_count++;
+	site->live_size += event->size;
+	live_size += event->size;
+	tick_allocs++;
+	if (live_size > peak_size)
+	{
+		peak_size = live_size;
+		peak_ts = event->timestamp;
+	}
+}
+
+
+
+
+static void account_free (unsigned long long addr, unsigned long long timestamp)
+{
+	struct live_block block;
+	struct site_stats * site = NULL;
+
+	if (!table_remove(addr, &block))
+	{
+		unmatched++;
+		return;
+	}
+	site = site_of(block.site_id);
+	site->free_count++;
+	site->live_count--;
+	site->live_size -= block.size;
+	site->lifetime += timestamp - block.timestamp;
+	live_size -= block.size;
+}
+
+
+
+
+/*
+ *	Analyzes an event, events come in timestamp order
+ */
+static void process (struct mmwl_trace_event * event)
+{
+	if (first_ts == 0)
+	{
+		first_ts = event->timestamp;
+		next_tick = first_ts + interval;
+		printf("timeline:\n");
+		printf("%14s %16s %12s %12s\n", "time (ms)", "live size", "live count", "allocs");
+	}
+	while (event->timestamp >= next_tick)
+	{
+		printf("%14llu %16llu %12zu %12llu\n"
+				, (next_tick - first_ts) / 1000000ULL
+				, live_size
+				, table_used
+				, tick_allocs);
+		tick_allocs = 0;
+		next_tick += interval;
+	}
+
+	event_count[event->op]++;
+	switch (event->op)
+	{
+	case MMWL_TRACE_MALLOC:
+		account_alloc(event);
+		break;
+	case MMWL_TRACE_REALLOC:
+		account_free(event->old_addr, event->timestamp);
+		account_alloc(event);
+		break;
+	case MMWL_TRACE_FREE:
+		account_free(event->addr, event->timestamp);
+		break;
+	}
+}
+
+
+
+
+static inline int earlier (size_t a, size_t b)
+{
+	return window[a].timestamp < window[b].timestamp;
+}
+
+static inline void window_swap (size_t a, size_t b)
+{
+	struct mmwl_trace_event tmp = window[a];
+	window[a] = window[b];
+	window[b] = tmp;
+}
+
+
+
+
+/*
+ *	Removes the earliest event of the reorder window and analyzes it
+ */
+static void window_pop (void)
+{
+	struct mmwl_trace_event event = window[0];
+	size_t i = 0;
+
+	window[0] = window[--window_used];
+	for (;;)
+	{
+		size_t child = 2*i + 1;
+		if (child >= window_used)
+			break;
+		if (child + 1 < window_used && earlier(child + 1, child))
+			child++;
+		if (!earlier(child, i))
+			break;
+		window_swap(i, child);
+		i = child;
+	}
+	process(&event);
+}
+
+
+
+
+/*
+ *	Adds an event to the reorder window, analyzing the earliest one if the window is full
+ */
+static void window_push (struct mmwl_trace_event * event)
+{
+	size_t i = 0;
+
+	if (window_used == window_size)
+		window_pop();
+	i = window_used++;
+	window[i] = *event;
+	while (i > 0 && earlier(i, (i - 1) / 2))
+	{
+		window_swap(i, (i - 1) / 2);
+		i = (i - 1) / 2;
+	}
+}
+
+
+
+
+/*
+ *	Reads a call site definition following its record
+ */
+static int read_site (FILE * file, struct mmwl_trace_event * event)
+{
+	struct site_stats * site = site_of(event->site_id);
+
+	free(site->filename);
+	free(site->func_name);
+	site->filename = calloc(1, event->addr + 1);
+	site->func_name = calloc(1, event->old_addr + 1);
+	site->line_num = event->line;
+	if (site->filename == NULL || site->func_name == NULL)
+		return -1;
+	if (fread(site->filename, 1, event->addr, file) != event->addr
+			|| fread(site->func_name, 1, event->old_addr, file) != event->old_addr)
+		return -1;
+	return 0;
+}
+
+
+
+
+static void print_site (struct site_stats * site, unsigned int site_id, const char * extra)
+{
+	if (site->filename)
+		printf(" @%s:%u in %s%s\n", site->func_name, site->line_num, site->filename, extra);
+	else
+		printf(" site:%u%s\n", site_id, extra);
+}
+
+
+
+
+/*
+ *	Prints the top_n sites for the given statistic, with a selection sort of the site ids
+ */
+static void print_top_sites (unsigned int top_n, int by_live)
+{
+	unsigned int * order = calloc(site_count + 1, sizeof(unsigned int));
+	size_t count = 0;
+	size_t i = 0;
+	size_t j = 0;
+
+	if (order == NULL)
+		return;
+	for (i = 0 ; i < site_count ; i++)
+		if (by_live ? sites[i].live_count != 0 : sites[i].alloc_count != 0)
+			order[count++] = i;
+
+	for (i = 0 ; i < count && i < top_n ; i++)
+	{
+		struct site_stats * site = NULL;
+		size_t best = i;
+		for (j = i + 1 ; j < count ; j++)
+		{
+			if (by_live ? sites[order[j]].live_size > sites[order[best]].live_size
+					: sites[order[j]].alloc_count > sites[order[best]].alloc_count)
+				best = j;
+		}
+		site = &sites[order[best]];
+		order[best] = order[i];
+		order[i] = site - sites;
+
+		if (by_live)
+			printf("%16llu %12llu", site->live_size, site->live_count);
+		else
+			printf("%12llu %16llu %12llu %16llu"
+					, site->alloc_count
+					, site->alloc_size
+					, site->free_count
+					, site->free_count ? site->lifetime / site->free_count / 1000 : 0);
+		print_site(site, order[i], "");
+	}
+	free(order);
+}
+
+
+
+
+int main (int argc, char ** argv)
+{
+	struct mmwl_trace_file_header header;
+	struct mmwl_trace_event event;
+	unsigned int top_n = DEFAULT_TOP_N;
+	FILE * file = NULL;
+	int opt = 0;
+
+	while ((opt = getopt(argc, argv, "i:n:w:")) != -1)
+	{
+		switch (opt)
+		{
+		case 'i':
+			interval = strtoull(optarg, NULL, 0) * 1000000ULL;
+			break;
+		case 'n':
+			top_n = strtoul(optarg, NULL, 0);
+			break;
+		case 'w':
+			window_size = strtoull(optarg, NULL, 0);
+			break;
+		default:
+			fprintf(stderr, "usage: %s [-i interval_ms] [-n top_n] [-w window] trace_file\n", argv[0]);
+			return 1;
+		}
+	}
+	if (optind + 1 != argc || interval == 0 || window_size == 0)
+	{
+		fprintf(stderr, "usage: %s [-i interval_ms] [-n top_n] [-w window] trace_file\n", argv[0]);
+		return 1;
+	}
+
+	file = fopen(argv[optind], "rb");
+	if (file == NULL)
+	{
+		perror(argv[optind]);
+		return 1;
+	}
+	if (fread(&header, sizeof(header), 1, file) != 1
+			|| memcmp(header.magic, MMWL_TRACE_MAGIC, sizeof(MMWL_TRACE_MAGIC)) != 0
+			|| header.version != MMWL_TRACE_VERSION
+			|| header.event_size != sizeof(struct mmwl_trace_event))
+	{
+		fprintf(stderr, "%s: not a mmwl trace of version %u\n", argv[optind], MMWL_TRACE_VERSION);
+		return 1;
+	}
+
+	window = malloc(window_size * sizeof(struct mmwl_trace_event));
+	if (window == NULL)
+	{
+		fprintf(stderr, "out of memory\n");
+		return 1;
+	}
+
+	while (fread(&event, sizeof(event), 1, file) == 1)
+	{
+		if (event.op == MMWL_TRACE_SITE)
+		{
+			if (read_site(file, &event) != 0)
+			{
+				fprintf(stderr, "%s: truncated call site definition\n", argv[optind]);
+				break;
+			}
+			event_count[MMWL_TRACE_SITE]++;
+		}
+		else if (event.op == MMWL_TRACE_DROP)
+		{
+			dropped += event.size;
+		}
+		else if (event.op >= MMWL_TRACE_MALLOC && event.op <= MMWL_TRACE_FREE)
+		{
+			window_push(&event);
+		}
+	}
+	while (window_used)
+		window_pop();
+	fclose(file);
+
+	printf("\nsummary:\n");
+	printf("mallocs                 : %llu\n", event_count[MMWL_TRACE_MALLOC]);
+	printf("reallocs                : %llu\n", event_count[MMWL_TRACE_REALLOC]);
+	printf("frees                   : %llu\n", event_count[MMWL_TRACE_FREE]);
+	printf("call sites              : %llu\n", event_count[MMWL_TRACE_SITE]);
+	printf("peak size               : %llu at %llu ms\n", peak_size, peak_ts ? (peak_ts - first_ts) / 1000000ULL : 0);
+	printf("leaked size             : %llu\n", live_size);
+	printf("leaked count            : %zu\n", table_used);
+	printf("unmatched frees         : %llu\n", unmatched);
+	if (dropped)
+		printf("dropped events          : %llu, leak figures are not reliable\n", dropped);
+
+	printf("\nleaks by call site:\n");
+	printf("%16s %12s\n", "live size", "live count");
+	print_top_sites(top_n, 1);
+
+	printf("\nchurn by call site:\n");
+	printf("%12s %16s %12s %16s\n", "allocs", "alloc size", "frees", "avg life (us)");
+	print_top_sites(top_n, 0);
+	return 0;
+}
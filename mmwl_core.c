@@ -19,32 +19,81 @@
  * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
  */
 
+#if !defined(__KERNEL__) && !defined(_GNU_SOURCE)
+#define _GNU_SOURCE			// dl_iterate_phdr & pthread_getattr_np, used by the leak check
+#endif
 #include "mmwl_core.h"
+#include "mmwl_trace.h"
+#include "mmwl_stats.h"
 
 
-#define STACK_DUMP_DEPTH	32	// Depth of the stack dump to be stored
-#define FILENAME_SIZE		300	// Size of filename to be maintained
-#define FUNCNAME_SIZE		100	// Size of function name to be maintained
-
-// TODO::add freed block signature to determine if the block was already freed
-#define SIGNx1 0x4B1D4B1D
-#define SIGNx2 SIGNx1, SIGNx1
-#define SIGNx4 SIGNx2, SIGNx2
-#define SIGNx8 SIGNx4, SIGNx4
-#define SIGNx16 SIGNx8, SIGNx8
-#define SIGNx32 SIGNx16, SIGNx16
-
-#define SIGN_COMPx1(sign_array, X) (sign_array[X] == SIGNx1)
-#define SIGN_COMPx2(sign_array, X) (SIGN_COMPx1(sign_array, X) && SIGN_COMPx1(sign_array, X+1))
-#define SIGN_COMPx4(sign_array, X) (SIGN_COMPx2(sign_array, X) && SIGN_COMPx2(sign_array, X+2))
-#define SIGN_COMPx8(sign_array, X) (SIGN_COMPx4(sign_array, X) && SIGN_COMPx4(sign_array, X+4))
-#define SIGN_COMPx16(sign_array, X) (SIGN_COMPx8(sign_array, X) && SIGN_COMPx8(sign_array, X+8))
-#define SIGN_COMPx32(sign_array, X) (SIGN_COMPx16(sign_array, X) && SIGN_COMPx16(sign_array, X+16))
-
+#define STACK_DUMP_DEPTH	32	// Maximum depth of the stack dump to be stored
+#define MMWL_MAX_SITES		4096	// Maximum number of distinct call sites, must be a power of two
+#ifdef __KERNEL__
+#define MMWL_MAX_STACKS		4096	// Maximum number of distinct stacks in the depot, must be a power of two
+#define MMWL_DEPOT_FRAMES	(1<<15)	// Number of frames the stack depot can store
+#else
+#define MMWL_MAX_STACKS		16384	// Maximum number of distinct stacks in the depot, must be a power of two
+#define MMWL_DEPOT_FRAMES	(1<<18)	// Number of frames the stack depot can store
+#endif
+#ifdef MMWL_PRELOAD
+#define MMWL_STACK_SKIP		4	// Frames of mmwl itself on top of a captured stack, with the interposed function
+#else
+#define MMWL_STACK_SKIP		3	// Frames of mmwl itself on top of a captured stack
+#endif
+#define MMWL_MIN_ALIGN		16	// Alignment of the blocks returned by the wrapped allocator
+#define MMWL_SIZE_SLACK		(1<<17)	// Bytes kept below SIZE_MAX for the page rounding of a guarded block
+#define MMWL_MAX_CACHES		256	// Maximum number of kernel caches tracked, must be a power of two
+#define MMWL_CAPTURE_BATCH	256	// Blocks copied per lock hold while capturing the live set
+#define MMWL_SCAN_BATCH		64	// Default number of blocks verified per lock hold by the scanner
+#define MMWL_SCAN_REPORTS	8	// Corruptions reported per batch, the batch ends early when reached
+#define MMWL_TRACE_RING_SIZE	(1<<16)	// Events in the trace ring of a thread, must be a power of two
+#define MMWL_TRACE_PERIOD_MS	2	// Period of the trace writer thread
+#define MMWL_SIZE_CLASSES	24	// log2 size classes of the histograms, the last one gathers the larger blocks
+#define MMWL_LIFE_CLASSES	32	// log2 lifetime classes of the histograms, in units of 1024 clock ticks
+#define MMWL_MAX_TOP_HIST	32	// Maximum number of sites printed by mmwl_histograms
+#define MMWL_MAX_THREADS	1024	// Threads whose stacks are scanned by the leak check
+#define MMWL_MAX_ROOTS		4096	// Root ranges scanned by the leak check
+#define MMWL_EXPORT_BUFFER	4096	// Bytes buffered by mmwl_export before a write
+#define MMWL_GUARD_SITES	16	// Call sites which may be guarded by mmwl_guard_site
+#define MMWL_GUARD_NAME		128	// Maximum length of the file name of a guarded site
+#define MMWL_GUARD_POOL_SLOTS	4096	// Maximum number of freed guarded blocks kept inaccessible
+#define MMWL_GUARD_FILL		0xFB	// Fill byte between a guarded block and its guard page
+#define MMWL_MAX_TAGS		64	// Maximum number of allocation tags, tag 0 stands for untagged blocks
+#define MMWL_TAG_DEPTH		16	// Depth of the tag stack of a thread
+#define MMWL_TAG_BATCH		65536	// Bytes a shard gathers for a tag before adding them to the tag totals
+#define MMWL_SITE_CACHE		8	// Call sites whose counters a shard gathers at once, must be a power of two
+#define MMWL_STACK_CACHE	8	// Stacks whose counters a shard gathers at once, must be a power of two
+#define MMWL_SITE_BATCH		128	// Blocks a shard gathers for a site or stack before adding them to its totals
+#define MMWL_SITE_BATCH_BYTES	65536	// Bytes a shard gathers for a site or stack before adding them to its totals
+#ifdef MMWL_META_OOL
+#ifdef __KERNEL__
+#define MMWL_META_BUCKETS	(1<<14)	// Buckets of the metadata table, must be a power of two
+#else
+#define MMWL_META_BUCKETS	(1<<18)	// Buckets of the metadata table, must be a power of two
+#endif
+#define MMWL_META_LOCKS		64	// Locks of the metadata table buckets, must be a power of two
+#define MMWL_META_GRANULE	8	// log2 of the address range hashed to one bucket
+#define MMWL_META_CHUNK		64	// Headers allocated at once by the metadata pool
+#endif
 
-#define SIGNATURE_SIZE 8						// Block signature size
-#define SIGN_COMP(sign_array) SIGN_COMPx8(sign_array, 0)		// Validates signature
-static const unsigned long SIGNATURE[SIGNATURE_SIZE] = {SIGNx8};	// Signature to validate the allocated block
+#define BLOCK_MAGIC		0x4B1D4B1DUL	// Tag word just before a tracked user block
+#define BLOCK_FREED_MAGIC	0xF4EEF4EEUL	// Tag word of a freed block held in quarantine
+#define MMWL_POISON		0xFD		// Fill byte of the freed blocks held in quarantine
+#define MMWL_QUARANTINE_BATCH	32	// Freed blocks gathered by a shard before joining the quarantine
+#ifndef MMWL_GUARD_POOL
+#define MMWL_GUARD_POOL		1024	// Default number of freed guarded blocks kept inaccessible
+#endif
+#ifndef MMWL_QUARANTINE_SIZE
+#define MMWL_QUARANTINE_SIZE	0	// Default quarantine budget in bytes, 0 disables it
+#endif
+#define MMWL_MAX_REDZONE	4096	// Maximum size of a redzone
+#ifndef MMWL_HEAD_REDZONE
+#define MMWL_HEAD_REDZONE	64	// Default size of the redzone before the user block, multiple of 16
+#endif
+#ifndef MMWL_FOOT_REDZONE
+#define MMWL_FOOT_REDZONE	64	// Default size of the redzone after the user block, multiple of 16
+#endif
 
 #ifdef __KERNEL__
 // Kernel side macros
@@ -54,9 +103,37 @@ static const unsigned long SIGNATURE[SIGNATURE_SIZE] = {SIGNx8};	// Signature to
 #include <linux/spinlock.h>
 #include <linux/sched/debug.h>
 #include <linux/stacktrace.h>
+#include <linux/percpu.h>
+#include <linux/random.h>
+#include <linux/mutex.h>
+#include <linux/mm.h>
+#include <linux/kthread.h>
+#include <linux/sched.h>
+#include <linux/timekeeping.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
+#include <linux/vmalloc.h>
 MODULE_LICENSE("Dual MIT/GPL");				// Kernel module license
-#define MMWL_MUTEX_LOCK(lock) spin_lock(lock)		// Kernel side mutex lock
-#define MMWL_MUTEX_UNLOCK(lock) spin_unlock(lock)	// Kernel side mutex unlock
+// Kernel side mutex, a spin lock taken with interrupts disabled so that any context may allocate
+// flags is a local of the caller receiving the interrupt state, given back to the unlock
+#define MMWL_MUTEX_LOCK(lock, flags) spin_lock_irqsave(lock, flags)		// Kernel side mutex lock
+#define MMWL_MUTEX_UNLOCK(lock, flags) spin_unlock_irqrestore(lock, flags)	// Kernel side mutex unlock
+#define MMWL_SLEEP_LOCK(lock) mutex_lock(lock)		// Kernel side lock which may be held while sleeping
+#define MMWL_SLEEP_UNLOCK(lock) mutex_unlock(lock)
+#define MMWL_YIELD() cond_resched()			// Let other tasks run between batches
+#define MMWL_LOAD_ACQUIRE(ptr) smp_load_acquire(ptr)			// Kernel side ordered load
+#define MMWL_STORE_RELEASE(ptr, val) smp_store_release(ptr, val)	// Kernel side ordered store
+#define MMWL_CMPXCHG(ptr, old, val) cmpxchg(ptr, old, val)		// Compare and swap, returns old value
+typedef atomic64_t mmwl_counter_t;					// Kernel side lock free counter
+#define MMWL_COUNTER_ADD(ctr, val) atomic64_add_return(val, ctr)	// Adds to counter, returns new value
+#define MMWL_COUNTER_SUB(ctr, val) atomic64_sub_return(val, ctr)	// Subtracts from counter, returns new value
+#define MMWL_COUNTER_READ(ctr) ((unsigned long long)atomic64_read(ctr))	// Reads counter
+#define MMWL_COUNTER_CMPXCHG(ctr, old, val) (atomic64_cmpxchg(ctr, old, val) == (old))	// Compare and swap
+#define MMWL_WRAPPED_MALLOC(size, flags) kmalloc(size, flags)		// Wrapped allocation function
+#define MMWL_WRAPPED_REALLOC(ptr, size, flags) krealloc(ptr, size, flags)	// Wrapped reallocation function
+#define MMWL_WRAPPED_FREE(ptr) kfree(ptr)				// Wrapped free function
+#define MMWL_INTERNAL_ALLOC(size) kvmalloc(size, GFP_KERNEL)	// Allocation for mmwl own use
+#define MMWL_INTERNAL_FREE(ptr) kvfree(ptr)			// Free of MMWL_INTERNAL_ALLOC memory
 #define assert(X) BUG_ON(!(X))
 
 #else /* __KERNEL__ */
@@ -66,6 +143,23 @@ MODULE_LICENSE("Dual MIT/GPL");				// Kernel module license
 #include <string.h>
 #include <pthread.h>
 #include <assert.h>
+#include <execinfo.h>
+#include <time.h>
+#include <unistd.h>
+#include <sched.h>
+#include <setjmp.h>
+#include <link.h>
+#include <dlfcn.h>
+#include <errno.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <sys/syscall.h>
+#if defined(__x86_64__)
+#include <immintrin.h>
+#define MMWL_RZ_SIMD			// SSE2 & AVX2 redzone kernels
+#define MMWL_LIFE_TSC			// Block lifetimes are measured with the TSC
+#endif
 
 /*
  *	User-side implementation of linked list
@@ -91,6 +185,14 @@ static inline void list_add_tail(struct list_head *new, struct list_head *head)
 	head->prev->next = new;
 	head->prev = new;
 }
+// Adds a list node just after the given node
+static inline void list_add(struct list_head *new, struct list_head *head)
+{
+	new->next = head->next;
+	new->prev = head;
+	head->next->prev = new;
+	head->next = new;
+}
 // Removes a list node from the linked list
 static inline void list_del(struct list_head * entry)
 {
@@ -98,9 +200,54 @@ static inline void list_del(struct list_head * entry)
 	entry->prev->next = entry->next;
 	entry->next = entry->prev = NULL;
 }
+// Returns non zero if the list is empty
+static inline int list_empty(const struct list_head * head)
+{
+	return head->next == head;
+}
+// Moves all the nodes of list at the end of head, list is left empty
+static inline void list_splice_tail_init(struct list_head * list, struct list_head * head)
+{
+	if (list_empty(list))
+		return;
+	list->next->prev = head->prev;
+	list->prev->next = head;
+	head->prev->next = list->next;
+	head->prev = list->prev;
+	INIT_LIST_HEAD(list);
+}
 
-#define MMWL_MUTEX_LOCK(lock) pthread_mutex_lock(lock)		// User side mutex lock
-#define MMWL_MUTEX_UNLOCK(lock) pthread_mutex_unlock(lock)	// User side mutex unlock
+#define MMWL_MUTEX_LOCK(lock, flags) ((void)(flags), pthread_mutex_lock(lock))	// User side mutex lock, no interrupt state
+#define MMWL_MUTEX_UNLOCK(lock, flags) ((void)(flags), pthread_mutex_unlock(lock))	// User side mutex unlock
+#define MMWL_SLEEP_LOCK(lock) pthread_mutex_lock(lock)		// User side lock which may be held while sleeping
+#define MMWL_SLEEP_UNLOCK(lock) pthread_mutex_unlock(lock)
+#define MMWL_YIELD() sched_yield()				// Let other threads run between batches
+#ifdef MMWL_PRELOAD
+// malloc & co. are interposed by mmwl_preload.c, the wrapped functions are resolved by it
+extern void * (*mmwl_real_malloc) (size_t);
+extern void * (*mmwl_real_realloc) (void *, size_t);
+extern void (*mmwl_real_free) (void *);
+#define MMWL_WRAPPED_MALLOC(size, flags) mmwl_real_malloc(size)		// Wrapped allocation function
+#define MMWL_WRAPPED_REALLOC(ptr, size, flags) mmwl_real_realloc(ptr, size)	// Wrapped reallocation function
+#define MMWL_WRAPPED_FREE(ptr) mmwl_real_free(ptr)				// Wrapped free function
+#else
+#define MMWL_WRAPPED_MALLOC(size, flags) malloc(size)			// Wrapped allocation function
+#define MMWL_WRAPPED_REALLOC(ptr, size, flags) realloc(ptr, size)	// Wrapped reallocation function
+#define MMWL_WRAPPED_FREE(ptr) free(ptr)				// Wrapped free function
+#endif
+#define MMWL_INTERNAL_ALLOC(size) MMWL_WRAPPED_MALLOC(size, 0)	// Allocation for mmwl own use
+#define MMWL_INTERNAL_FREE(ptr) MMWL_WRAPPED_FREE(ptr)		// Free of MMWL_INTERNAL_ALLOC memory
+// Thread local storage, initial-exec as TLS must not allocate when mmwl is a preloaded library
+#define MMWL_TLS __thread __attribute__((tls_model("initial-exec")))
+#define MMWL_LOAD_ACQUIRE(ptr) __atomic_load_n(ptr, __ATOMIC_ACQUIRE)			// User side ordered load
+#define MMWL_STORE_RELEASE(ptr, val) __atomic_store_n(ptr, val, __ATOMIC_RELEASE)	// User side ordered store
+#define MMWL_CMPXCHG(ptr, old, val) __sync_val_compare_and_swap(ptr, old, val)		// Compare and swap, returns old value
+typedef unsigned long long mmwl_counter_t;						// User side lock free counter
+#define MMWL_COUNTER_ADD(ctr, val) __atomic_add_fetch(ctr, val, __ATOMIC_RELAXED)	// Adds to counter, returns new value
+#define MMWL_COUNTER_SUB(ctr, val) __atomic_sub_fetch(ctr, val, __ATOMIC_RELAXED)	// Subtracts from counter, returns new value
+#define MMWL_COUNTER_READ(ctr) __atomic_load_n(ctr, __ATOMIC_RELAXED)			// Reads counter
+#define MMWL_COUNTER_CMPXCHG(ctr, old, val)	({ unsigned long long __old = (old);		\
+		__atomic_compare_exchange_n(ctr, &__old, val, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED); })	// Compare and swap
 
 #endif /* __KERNEL__ */
 
@@ -110,347 +257,5817 @@ static inline void list_del(struct list_head * entry)
 
 
 
+#define MMWL_SHARD_COUNT	64	// Number of tracking shards, must be a power of two
+#define MMWL_CACHELINE_SIZE	64	// Shards are padded to this size to avoid false sharing
+
+#if MMWL_SITE_BATCH > 255
+#error "MMWL_SITE_BATCH must fit the byte counters of struct site_delta"
+#endif
+
+/*
+ *	Counters of a call site gathered by a shard
+ *	Added to the site totals by site_fold, when the site is evicted from the cache of the shard or
+ *	the batch is full. ops is below MMWL_SITE_BATCH, hence the histogram classes fit in a byte.
+ */
+struct site_delta {
+	unsigned int		site_id;		// Site of the counters, meaningless when ops is 0
+	unsigned int		ops;			// Allocations & frees gathered, 0 for an empty entry
+	long long		live_size;		// Live bytes added
+	long long		peak_size;		// Highest value of live_size within the batch
+	unsigned int		alloc_count;		// Blocks allocated
+	unsigned int		free_count;		// Blocks freed
+#if MMWL_LEVEL >= MMWL_LEVEL_LIST
+	unsigned char		size_hist[MMWL_SIZE_CLASSES];	// Allocations by log2 size class
+	unsigned char		life_hist[MMWL_LIFE_CLASSES];	// Frees by log2 lifetime class
+#endif
+};
+
+/*
+ *	Counters of a depot stack gathered by a shard, added to the stack totals by stack_fold
+ */
+struct stack_delta {
+	unsigned int		stack_id;		// Stack of the counters, meaningless when ops is 0
+	unsigned int		ops;			// Allocations & frees gathered, 0 for an empty entry
+	long long		live_size;		// Live bytes added
+	long long		live_count;		// Live blocks added
+};
+
 /*
  *	MMWL instance type
+ *	Tracking state is split into MMWL_SHARD_COUNT instances (shards). An allocating thread (user side)
+ *	or CPU (kernel side) works on its own shard, so the locks and counters of different shards are
+ *	not contended. A block remembers its shard, hence a free from any other thread/CPU updates the
+ *	shard which owns the block and the counters of every shard stay consistent on their own.
  */
 struct mmwl_instance {
 	unsigned long long alloc_count;		// Number of allocated blocks
 	unsigned long long free_count;		// Number of freed blocks
 	unsigned long long alloc_size;		// Total size allocated
 	unsigned long long free_size;		// Total size freed
+	unsigned long long est_alloc_count;	// Estimated number of allocated blocks, in 1/MMWL_EST_SCALE units
+	unsigned long long est_free_count;	// Estimated number of freed blocks, in 1/MMWL_EST_SCALE units
+	unsigned long long est_alloc_size;	// Estimated total size allocated
+	unsigned long long est_free_size;	// Estimated total size freed
 #ifdef __KERNEL__
 	spinlock_t lock;			// Kernel side mutex lock
 #else
 	pthread_mutex_t lock;			// User side mutex lock
 #endif
 	struct list_head head;			// Head of the linked list of blocks
-};
+	struct list_head cursor;		// Position of mmwl_live_capture in the list, not a block
+	struct list_head scan_cursor;		// Position of the scanner in the list, not a block
+	struct list_head qbatch;		// Freed blocks waiting to join the quarantine
+	unsigned int qbatch_count;		// Number of blocks in qbatch
+	size_t qbatch_bytes;			// Bytes held by the blocks in qbatch
+	unsigned long long size_hist[MMWL_SIZE_CLASSES];	// Allocations by log2 size class
+	unsigned long long life_hist[MMWL_LIFE_CLASSES];	// Frees by log2 lifetime class
+	struct site_delta site_cache[MMWL_SITE_CACHE];	// Site counters not yet added to the site totals, by site id
+	struct stack_delta stack_cache[MMWL_STACK_CACHE];	// Stack counters not yet added to the stack totals, by stack id
+#ifndef __KERNEL__
+	long long tag_delta[MMWL_MAX_TAGS];	// Live bytes by tag not yet added to the tag totals
+	int owned;				// Claimed by a thread which updates it without the lock, MMWL_LEVEL_COUNTERS
+#endif
+#ifdef MMWL_META_OOL
+	struct block_header * meta_pool;	// Free headers of the metadata pool
+#endif
+} __attribute__((aligned(MMWL_CACHELINE_SIZE)));
+
+
+// Initializer of the shard at index X
+#ifdef __KERNEL__
+#define SHARD_INITx1(X)	{ .lock = __SPIN_LOCK_UNLOCKED(mmwl_gbl_inst[X].lock),		\
+			  .head = LIST_HEAD_INIT(mmwl_gbl_inst[X].head),			\
+			  .qbatch = LIST_HEAD_INIT(mmwl_gbl_inst[X].qbatch) }
+#else
+#define SHARD_INITx1(X)	{ .lock = PTHREAD_MUTEX_INITIALIZER,				\
+			  .head = LIST_HEAD_INIT(mmwl_gbl_inst[X].head),			\
+			  .qbatch = LIST_HEAD_INIT(mmwl_gbl_inst[X].qbatch) }
+#endif
+#define SHARD_INITx2(X) SHARD_INITx1(2*(X)), SHARD_INITx1(2*(X)+1)
+#define SHARD_INITx4(X) SHARD_INITx2(2*(X)), SHARD_INITx2(2*(X)+1)
+#define SHARD_INITx8(X) SHARD_INITx4(2*(X)), SHARD_INITx4(2*(X)+1)
+#define SHARD_INITx16(X) SHARD_INITx8(2*(X)), SHARD_INITx8(2*(X)+1)
+#define SHARD_INITx32(X) SHARD_INITx16(2*(X)), SHARD_INITx16(2*(X)+1)
+#define SHARD_INITx64(X) SHARD_INITx32(2*(X)), SHARD_INITx32(2*(X)+1)
 
 
 /*
- *	MMWL global instance
+ *	MMWL global instance, one entry per shard
  */
-struct mmwl_instance mmwl_gbl_inst = {
-	.alloc_count	= 0,
-	.free_count	= 0,
-	.alloc_size	= 0,
-	.free_size	= 0,
+struct mmwl_instance mmwl_gbl_inst[MMWL_SHARD_COUNT] = { SHARD_INITx64(0) };
+
 #ifdef __KERNEL__
-	.lock		= __SPIN_LOCK_UNLOCKED(mmwl_gbl_inst.lock),
+static DEFINE_MUTEX(mmwl_capture_lock);				// Serializes users of the shard capture cursors
 #else
-	.lock		= PTHREAD_MUTEX_INITIALIZER,
+static pthread_mutex_t mmwl_capture_lock = PTHREAD_MUTEX_INITIALIZER;
 #endif
-	.head		= LIST_HEAD_INIT(mmwl_gbl_inst.head)
-};
+static unsigned int mmwl_generation = 0;			// Last snapshot returned by mmwl_snapshot
+
+#ifndef __KERNEL__
+static MMWL_TLS int mmwl_busy = 0;				// Set while mmwl calls code which may allocate
+static unsigned int mmwl_next_shard = 0;			// Shard to be given to the next new thread
+static MMWL_TLS int mmwl_thread_shard = -1;			// Shard of the current thread, -1 if not assigned yet
 
 /*
- *	Header of allocated block entry
+ *	Registry of the threads which allocated a tracked block, their stacks are roots of the leak check
+ *	mmwl_thread_lock is held while the stacks are scanned, so that an exiting thread waits for the scan.
  */
-struct block_header {
-	struct			list_head head;
-	//unsigned long 	stack_entries[STACK_DUMP_DEPTH];
-	//struct stack_trace 	trace;
-	char			filename[FILENAME_SIZE];	// Name of the source file from where block was allocated
-	char			func_name[FUNCNAME_SIZE];	// Name of the function from which block was allocated
-	unsigned int		line_num;			// Line number in source file where block was allocated
-	size_t 			size;				// Size of the user block allocated
-	unsigned long		signature[SIGNATURE_SIZE];	// For validating the header
-	char			end[];				// Start of the user block
-};
+static pthread_t mmwl_threads[MMWL_MAX_THREADS];		// Registered threads
+static unsigned char mmwl_thread_used[MMWL_MAX_THREADS];	// Non zero for the used entries of mmwl_threads[]
+static unsigned int mmwl_threads_missed = 0;			// Threads not registered as mmwl_threads[] was full
+static pthread_mutex_t mmwl_thread_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_key_t mmwl_thread_key;				// Unregisters a thread at exit
+static pthread_once_t mmwl_thread_key_once = PTHREAD_ONCE_INIT;
+#if MMWL_LEVEL < MMWL_LEVEL_LIST
+static pthread_key_t mmwl_shard_key;				// Gives back the shard claimed by a thread at exit
+#endif
+#endif
+
+#define MMWL_EST_SCALE		1024			// Fixed point scale of estimated block counts
 
 /*
- *	Footer of allocated block entry
+ *	Sampling state
+ *	With a sample rate of R bytes, allocations of at least R bytes are always tracked and smaller
+ *	ones are picked by a byte countdown with random intervals averaging R. A tracked small block
+ *	stands for R bytes of allocations, which gives unbiased estimates of the totals.
  */
-struct block_footer {
-	unsigned long signature[SIGNATURE_SIZE];		// For validating the footer
-};
+static unsigned int mmwl_sample_shift = 0;			// log2 of the sample rate, 0 tracks every allocation
+#ifdef __KERNEL__
+static DEFINE_PER_CPU(long, mmwl_sample_left);			// Bytes to allocate before the next sample
+#else
+static MMWL_TLS long mmwl_sample_left = 0;			// Bytes to allocate before the next sample
+static MMWL_TLS unsigned long mmwl_sample_seed = 0;		// State of the sampling random generator
+#endif
 
 
+#ifndef __KERNEL__
+/*
+ *	Thread exit handler, removes the thread from the registry
+ */
+static void thread_unregister (void * arg)
+{
+	unsigned long flags = 0;
 
-// Size to be allocated including header and footer
-#define BLOCK_SIZE(size)	(size+sizeof(struct block_header)+sizeof(struct block_footer))
+	MMWL_MUTEX_LOCK(&mmwl_thread_lock, flags);
+	mmwl_thread_used[(unsigned long)arg - 1] = 0;
+	MMWL_MUTEX_UNLOCK(&mmwl_thread_lock, flags);
+}
 
+#if MMWL_LEVEL < MMWL_LEVEL_LIST
+/*
+ *	Thread exit handler, gives back the shard claimed by the thread
+ *	The counters gathered by the shard stay in it, site_flush folds them until the next claim.
+ */
+static void shard_release (void * arg)
+{
+	struct mmwl_instance * inst = &mmwl_gbl_inst[mmwl_thread_shard];
+	unsigned long flags = 0;
 
-// Returns pointer to the header when pointer to the user block provided
-#define BLOCK_HEADER_OF(ptr)	((struct block_header*)((void*)ptr - (size_t)&((struct block_header *)0)->end))
-// returns pointer to footer when pointer to the user block provided
-#define BLOCK_FOOTER_OF(ptr)	((struct block_footer*)((void*)ptr + BLOCK_HEADER_OF(ptr)->size))
+	(void)arg;
+	MMWL_MUTEX_LOCK(&inst->lock, flags);					// Publish the unlocked updates
+	MMWL_STORE_RELEASE(&inst->owned, 0);
+	MMWL_MUTEX_UNLOCK(&inst->lock, flags);
+	mmwl_thread_shard = 0;							// Later allocations use the shared shard
+}
+#endif
 
+static void thread_key_create (void)
+{
+	pthread_key_create(&mmwl_thread_key, thread_unregister);
+#if MMWL_LEVEL < MMWL_LEVEL_LIST
+	pthread_key_create(&mmwl_shard_key, shard_release);
+#endif
+}
 
-// Set signature for allocated block
-#define SIGNATURE_SET(block)									\
-	do {											\
-		memcpy(block->signature, SIGNATURE, sizeof(SIGNATURE));				\
-		memcpy(BLOCK_FOOTER_OF(block->end)->signature, SIGNATURE, sizeof(SIGNATURE));	\
-	} while(0)
-// Erase signature of block when freed
-#define SIGNATURE_ERASE(block)									\
-	do {											\
-		memset(block->signature, 0, sizeof(SIGNATURE));					\
-		memset(BLOCK_FOOTER_OF(block->end)->signature, 0, sizeof(SIGNATURE));		\
-	} while(0)
+/*
+ *	Adds the current thread to the registry
+ */
+static void thread_register (void)
+{
+	unsigned long slot = 0;
+	unsigned long flags = 0;
 
+	pthread_once(&mmwl_thread_key_once, thread_key_create);
+	MMWL_MUTEX_LOCK(&mmwl_thread_lock, flags);
+	while (slot < MMWL_MAX_THREADS && mmwl_thread_used[slot])
+		slot++;
+	if (slot < MMWL_MAX_THREADS)
+	{
+		mmwl_threads[slot] = pthread_self();
+		mmwl_thread_used[slot] = 1;
+	}
+	else
+	{
+		mmwl_threads_missed++;
+	}
+	MMWL_MUTEX_UNLOCK(&mmwl_thread_lock, flags);
+	if (slot < MMWL_MAX_THREADS)
+		pthread_setspecific(mmwl_thread_key, (void *)(slot + 1));
+}
 
-// Initializes block header & footer
-#define INIT_BLOCK(block, alloc_size, filename, func_name, line_num)				\
-	do {											\
-		INIT_LIST_HEAD(&block->head);							\
-		strncpy(block->filename, filename, FILENAME_SIZE-1);				\
-		strncpy(block->func_name, func_name, FUNCNAME_SIZE-1);				\
-		block->line_num = line_num;							\
-		block->size = alloc_size;							\
-		SIGNATURE_SET(block);								\
-	} while(0)
 
 
-// Initializes block header & footer
-#define INIT_BLOCK_OF(ptr, alloc_size, filename, func_name, line_num)				\
-	INIT_BLOCK(BLOCK_HEADER_OF(ptr), alloc_size, filename, func_name, line_num)
 
+#if MMWL_LEVEL < MMWL_LEVEL_LIST
+/*
+ *	Claims a shard for the calling thread, which then updates it without taking its lock
+ *	Only without the list of blocks, a block may then be counted as freed by any shard. Shard 0 is
+ *	never claimed, it is shared, locked, by the threads which found no free shard. Returns the index.
+ */
+static int shard_claim (void)
+{
+	unsigned int start = __atomic_fetch_add(&mmwl_next_shard, 1, __ATOMIC_RELAXED);
+	unsigned int i = 0;
+	unsigned long flags = 0;
 
-// Boolean expression to verify the signature of the block
-#define CHECK_SIGN_OF(ptr)	((SIGN_COMP(BLOCK_HEADER_OF(ptr)->signature) && 		\
-				SIGN_COMP(BLOCK_FOOTER_OF(ptr)->signature)))
-#define CHECK_SIGN(block)	((SIGN_COMP(block->signature) && 				\
-				SIGN_COMP(BLOCK_FOOTER_OF(block->end)->signature)))
+	for (i = 0 ; i < MMWL_SHARD_COUNT-1 ; i++)
+	{
+		struct mmwl_instance * inst = &mmwl_gbl_inst[1 + (start + i) % (MMWL_SHARD_COUNT-1)];
+		if (MMWL_CMPXCHG(&inst->owned, 0, 1) != 0)
+			continue;
+		// Wait for a site_flush folding the shard, the later ones skip it
+		MMWL_MUTEX_LOCK(&inst->lock, flags);
+		MMWL_MUTEX_UNLOCK(&inst->lock, flags);
+		pthread_setspecific(mmwl_shard_key, (void *)1);
+		return inst - mmwl_gbl_inst;
+	}
+	return 0;
+}
 
+// Non zero for the shard claimed by the calling thread, updated without its lock
+#define SHARD_MINE(inst)	(mmwl_thread_shard > 0 && (inst) - mmwl_gbl_inst == mmwl_thread_shard)
+#else
+#define SHARD_MINE(inst)	0
+#endif
+#else
+#define SHARD_MINE(inst)	0
+#endif
 
-// Assert consistency of the allocation statistics
-#define MMWL_BASIC_ASSERT									\
-	do {											\
-		MMWL_MUTEX_LOCK(&mmwl_gbl_inst.lock);						\
-		assert(										\
-			(mmwl_gbl_inst.head.next 	== &(mmwl_gbl_inst.head)		\
-			&& mmwl_gbl_inst.alloc_count 	== mmwl_gbl_inst.free_count		\
-			&& mmwl_gbl_inst.alloc_size 	== mmwl_gbl_inst.free_size)		\
-			||									\
-			(mmwl_gbl_inst.head.next 	!= &(mmwl_gbl_inst.head)		\
-			&& mmwl_gbl_inst.alloc_count 	> mmwl_gbl_inst.free_count		\
-			&& mmwl_gbl_inst.alloc_size 	> mmwl_gbl_inst.free_size)		\
-		);										\
-		MMWL_MUTEX_UNLOCK(&mmwl_gbl_inst.lock);						\
-	} while(0)
+// Non zero for a shard claimed by another thread, which updates it without its lock
+#if !defined(__KERNEL__) && MMWL_LEVEL < MMWL_LEVEL_LIST
+#define SHARD_FOREIGN(inst)	(MMWL_LOAD_ACQUIRE(&(inst)->owned) && !SHARD_MINE(inst))
+#else
+#define SHARD_FOREIGN(inst)	0
+#endif
 
+// Lock & unlock the shard a block is accounted to, unless the calling thread has claimed it
+#define SHARD_LOCK(inst, flags)		do { if (!SHARD_MINE(inst)) MMWL_MUTEX_LOCK(&(inst)->lock, flags); } while(0)
+#define SHARD_UNLOCK(inst, flags)	do { if (!SHARD_MINE(inst)) MMWL_MUTEX_UNLOCK(&(inst)->lock, flags); } while(0)
 
 
 /*
- *	Add block to the allocation list
+ *	Returns the shard of the calling thread (user side) or CPU (kernel side)
  */
-static void add_malloc_entry (	struct	block_header * 	block,			// Pointer to block
-					size_t		size,			// Size of the user block
-				const	char *		filename,		// Filename from where alloc was called
-				const	char *		func_name,		// Function name from which alloc was called
-				const	unsigned int	line_num )		// Line number of alloc function call
+static inline struct mmwl_instance * current_shard (void)
 {
-	INIT_BLOCK(block, size, filename, func_name, line_num);			// Initialize block
-	MMWL_MUTEX_LOCK(&mmwl_gbl_inst.lock);					// Lock MMWL instance
-	list_add_tail(&block->head, &mmwl_gbl_inst.head);			// Add new block at the end of the list
-	mmwl_gbl_inst.alloc_count++;						// Increment allocation count
-	mmwl_gbl_inst.alloc_size += (unsigned long long)size;			// Add user block size to total allocation size
-	MMWL_MUTEX_UNLOCK(&mmwl_gbl_inst.lock);					// Unlock MMWL instance
+#ifdef __KERNEL__
+	// The shard is locked before use, being migrated to another CPU meanwhile is harmless
+	return &mmwl_gbl_inst[raw_smp_processor_id() & (MMWL_SHARD_COUNT-1)];
+#else
+	if (mmwl_thread_shard < 0)
+	{
+		thread_register();
+	#if MMWL_LEVEL < MMWL_LEVEL_LIST
+		mmwl_thread_shard = shard_claim();
+	#else
+		mmwl_thread_shard = __atomic_fetch_add(&mmwl_next_shard, 1, __ATOMIC_RELAXED) & (MMWL_SHARD_COUNT-1);
+	#endif
+	}
+	return &mmwl_gbl_inst[mmwl_thread_shard];
+#endif
 }
 
 
+// Shard a freed block is accounted to: its owner, whose list holds it, or any shard without the list
+#if MMWL_LEVEL >= MMWL_LEVEL_LIST
+#define FREE_SHARD(block)	(&mmwl_gbl_inst[(block)->shard & (MMWL_SHARD_COUNT-1)])
+#else
+#define FREE_SHARD(block)	current_shard()
+#endif
 
 
 /*
- *	Remove block from allocation list
+ *	Returns a monotonic time in ns, used for the block lifetimes and the trace timestamps
  */
-static void remove_malloc_entry (	struct	block_header * 	block,		// Pointer to block
-					const	char *		filename,	// Filename from where alloc was called
-					const	char *		func_name,	// Function name from which alloc was called
-					const	unsigned int	line_num )	// Line number of alloc function call
+static inline unsigned long long mmwl_clock_ns (void)
 {
-	if(!CHECK_SIGN(block)) {						// Verify block signature
-		// Signature mismatch for following reasons:
-		//	1. Signature was overwritten by the user program, suggesting out of bound write.
-		//	2. Wrong pointer was given to "free" call
-		//	3. The block was already freed, hence multiple "free" called on same address
-		MMWL_LOG_ERROR("caller @%s:%u in %s"
-				, func_name
-				, line_num
-				, filename);
-		MMWL_LOG_ERROR("\tsignature mismatch, addr:%p"
-				, block->end);
-		MMWL_LOG_ERROR("\tblock origin @%s:%u in %s"
-				, block->func_name
-				, block->line_num
-				, block->filename);
-		// TODO::do not free block
-	}
-
-	SIGNATURE_ERASE(block);							// Erase signature
-	MMWL_MUTEX_LOCK(&mmwl_gbl_inst.lock);					// Lock MMWL instance
-	list_del(&block->head);							// Remove block from allocation list
-	mmwl_gbl_inst.free_count++;						// Increment free count
-	mmwl_gbl_inst.free_size += block->size;					// Add user block size to total freed size
-	MMWL_MUTEX_UNLOCK(&mmwl_gbl_inst.lock);					// Unlock MMWL instance
+#ifdef __KERNEL__
+	return ktime_get_ns();
+#else
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (unsigned long long)now.tv_sec * 1000000000ULL + now.tv_nsec;
+#endif
 }
 
 
+/*
+ *	Lifetime clock
+ *	Lifetimes are measured in ticks of the cheapest clock available: the TSC on x86_64 user side,
+ *	ns otherwise. The TSC is converted to ns against CLOCK_MONOTONIC when the histograms are printed.
+ */
+#ifdef MMWL_LIFE_TSC
+#define MMWL_LIFE_TICKS()	__builtin_ia32_rdtsc()
+static unsigned long long mmwl_tsc_base = 0;			// TSC at load time
+static unsigned long long mmwl_tsc_base_ns = 0;			// mmwl_clock_ns at load time
 
+__attribute__((constructor)) static void tsc_calibrate_base (void)
+{
+	mmwl_tsc_base_ns = mmwl_clock_ns();
+	mmwl_tsc_base = __builtin_ia32_rdtsc();
+}
+#else
+#define MMWL_LIFE_TICKS()	mmwl_clock_ns()
+#endif
 
 
 /*
- *	Wrapper function for malloc & kmalloc
+ *	Returns the ns of one lifetime class unit (1024 ticks)
  */
-void * mmwl_malloc (		size_t		size,				// Size of the user block
-		#ifdef __KERNEL__
-				gfp_t		flags,				// kmalloc flags
-		#endif
-			const	char *		filename,			// Filename from where alloc was called
-			const	char *		func_name,			// Function name from which alloc was called
-			const	unsigned int	line_num )			// Line number of alloc function call
+static unsigned long long life_unit_ns (void)
 {
-	struct block_header * block = NULL;
-
-	// Call wrapped function
-	#ifdef __KERNEL__
-	block = (struct block_header *) kmalloc(BLOCK_SIZE(size), flags);
-	#else
-	block = (struct block_header *) malloc(BLOCK_SIZE(size));
-	#endif
+#ifdef MMWL_LIFE_TSC
+	unsigned long long ticks = __builtin_ia32_rdtsc() - mmwl_tsc_base;
+	unsigned long long ns = mmwl_clock_ns() - mmwl_tsc_base_ns;
+	if (ticks == 0)
+		return 1024;
+	return (unsigned long long)(((unsigned __int128)ns << 10) / ticks);	// ns << 10 overflows after 208 days
+#else
+	return 1024;
+#endif
+}
 
-	if (block != NULL)
-	{
-		add_malloc_entry(block, size, filename, func_name, line_num);
-		MMWL_BASIC_ASSERT;
-		return (void*)block->end;
-	}
 
-	MMWL_BASIC_ASSERT;
-	return block;
+/*
+ *	Returns the log2 class of a value: 0 for 0, c for [2^(c-1), 2^c), capped to the last class
+ */
+static inline unsigned int log2_class (unsigned long long value, unsigned int classes)
+{
+	unsigned int c = value ? 8*sizeof(value) - __builtin_clzll(value) : 0;
+	return c < classes ? c : classes - 1;
 }
 
+// Histogram class of a block size and of a block lifetime in ns
+#define SIZE_CLASS(size)	log2_class(size, MMWL_SIZE_CLASSES)
+#define LIFE_CLASS(ticks)	log2_class((ticks) >> 10, MMWL_LIFE_CLASSES)
 
+// Start of the lifetime of a block and its class once freed, lifetimes are not measured without the list
+#if MMWL_LEVEL >= MMWL_LEVEL_LIST
+#define LIFE_START(block)	((block)->alloc_time = MMWL_LIFE_TICKS())
+#define LIFE_CLASS_OF(block)	LIFE_CLASS(MMWL_LIFE_TICKS() - (block)->alloc_time)
+#else
+#define LIFE_START(block)	do { } while(0)
+#define LIFE_CLASS_OF(block)	0
+#endif
 
 
 /*
- *	Wrapper function for realloc & krealloc
+ *	Call site of an allocation
+ *	__FILE__ and __FUNCTION__ are static strings, so a site only keeps the pointers to them. Each
+ *	distinct site is interned once into mmwl_sites[] and blocks refer to it by its index (site id).
+ *	Its counters are updated from the batches of the shards (struct site_delta), see site_flush.
  */
-void * mmwl_realloc (	void *		ptr,					// User block address to be 'realloc'ated
-			size_t		size,					// Size of the user block
-	#ifdef __KERNEL__
-			gfp_t 		flags,					// kmalloc flags
-	#endif
-		const	char *		filename,				// Filename from where realloc was called
-		const	char *		func_name,				// Function name from which realloc was called
-		const	unsigned int	line_num )				// Line number of realloc function call
-{
-	struct block_header * block_old = BLOCK_HEADER_OF(ptr);
-	struct block_header * block_new = NULL;
-	remove_malloc_entry(block_old, filename, func_name, line_num);
+struct mmwl_site {
+	const	char *		filename;		// Name of the source file from where block was allocated
+	const	char *		func_name;		// Name of the function from which block was allocated
+		unsigned int	line_num;		// Line number in source file where block was allocated
+#ifndef __KERNEL__
+		unsigned int	guard;			// Non zero if the blocks of the site are placed against guard pages
+#endif
+	mmwl_counter_t		live_size;		// Size of the blocks currently allocated from the site
+	mmwl_counter_t		live_count;		// Number of blocks currently allocated from the site
+	mmwl_counter_t		alloc_count;		// Number of blocks ever allocated from the site
+	mmwl_counter_t		free_count;		// Number of blocks allocated from the site and freed
+	mmwl_counter_t		peak_size;		// Highest value of live_size seen
+	mmwl_counter_t		size_hist[MMWL_SIZE_CLASSES];	// Allocations by log2 size class
+	mmwl_counter_t		life_hist[MMWL_LIFE_CLASSES];	// Frees by log2 lifetime class
+};
 
-	// Call wrapped function
-	#ifdef __KERNEL__
-	block_new = krealloc(block_old, BLOCK_SIZE(size), flags);
-	#else
-	block_new = realloc(block_old, BLOCK_SIZE(size));
-	#endif
+#define MMWL_MAX_TOP_SITES	64			// Maximum number of sites printed by mmwl_status_sites
+#define MMWL_DIFF_TOP_SITES	20			// Sites printed by mmwl_diff
+#define MMWL_SITE_UNKNOWN	0			// Site id used when the site table is full
+
+static struct mmwl_site mmwl_sites[MMWL_MAX_SITES] = {
+	[MMWL_SITE_UNKNOWN] = { .filename = "<unknown>", .func_name = "<unknown>", .line_num = 0 }
+};
+static unsigned int mmwl_site_count = 1;		// Number of used entries of mmwl_sites[]
+static unsigned int mmwl_site_hash[2*MMWL_MAX_SITES];	// Open addressing table of site ids, 0 is empty slot
+#ifdef __KERNEL__
+static DEFINE_SPINLOCK(mmwl_site_lock);			// Serializes insertion of new sites
+#else
+static pthread_mutex_t mmwl_site_lock = PTHREAD_MUTEX_INITIALIZER;
+#endif
+
+// Returns the site entry of a block
+#define SITE_OF(block)		(&mmwl_sites[(block)->site_id & (MMWL_MAX_SITES-1)])
 
-	if (block_new != NULL)
+// Reads the current sample shift, every block is tracked with out of line metadata
+#ifdef MMWL_META_OOL
+#define READ_SAMPLE_SHIFT()	0
+#else
+#define READ_SAMPLE_SHIFT()	MMWL_LOAD_ACQUIRE(&mmwl_sample_shift)
+#endif
+
+
+#ifndef __KERNEL__
+/*
+ *	Guard page mode settings
+ *	Blocks of the size range are guarded one in mmwl_guard_rate, the blocks of the sites given to
+ *	mmwl_guard_site all are. Guarded sites are matched when the site is interned, under mmwl_site_lock.
+ */
+struct mmwl_guard_spec {
+	char			filename[MMWL_GUARD_NAME];	// End of the source file name
+	unsigned int		line_num;			// Line number, 0 for every line of the file
+};
+
+static unsigned int mmwl_guard_on = 0;			// Non zero if some blocks may be guarded
+static unsigned int mmwl_guard_mode = 0;		// MMWL_GUARD_OVERFLOW or MMWL_GUARD_UNDERFLOW
+static unsigned int mmwl_guard_rate = 0;		// One in 'rate' blocks of the size range is guarded, 0 for none
+static size_t mmwl_guard_min = 0;			// Size range of the blocks guarded by rate
+static size_t mmwl_guard_max = 0;
+static size_t mmwl_page_size = 0;			// Set when guard page mode is first configured
+static struct mmwl_guard_spec mmwl_guard_specs[MMWL_GUARD_SITES];
+static unsigned int mmwl_guard_spec_count = 0;		// Number of used entries of mmwl_guard_specs[]
+static MMWL_TLS unsigned int mmwl_guard_left = 0;	// Blocks of the size range to allocate before the next guarded one
+
+/*
+ *	Returns non zero if a site matches one of the guarded sites, mmwl_site_lock must be held
+ */
+static int guard_site_match (	const	char *		filename,	// Filename of the site
+				const	unsigned int	line_num )	// Line number of the site
+{
+	size_t len = strlen(filename);
+	unsigned int i = 0;
+
+	for (i = 0 ; i < mmwl_guard_spec_count ; i++)
 	{
-		add_malloc_entry(block_new, size, filename, func_name, line_num);
-		MMWL_BASIC_ASSERT;
-		return (void*)block_new->end;
-	}
+		struct mmwl_guard_spec * spec = &mmwl_guard_specs[i];
+		size_t spec_len = strlen(spec->filename);
 
-	MMWL_BASIC_ASSERT;
-	return block_new;
+		if (spec->line_num != 0 && spec->line_num != line_num)
+			continue;
+		// The file name matches by its end, at a directory boundary
+		if (spec_len <= len && strcmp(filename + len - spec_len, spec->filename) == 0
+				&& (spec_len == len || filename[len - spec_len - 1] == '/'))
+			return 1;
+	}
+	return 0;
 }
 
+#define SITE_GUARD_INIT(site)	((site)->guard = guard_site_match((site)->filename, (site)->line_num))
+#else
+#define SITE_GUARD_INIT(site)	do { } while(0)
+#endif
+
+
+#ifndef __KERNEL__
+/*
+ *	Allocation tag
+ *	A thread charges its tracked blocks to the tag on top of its tag stack. The shards gather the
+ *	live bytes of each tag and add them to the tag totals once they exceed the tag batch, so that
+ *	an allocation only updates its shard, locked anyway. live_size is off by less than a batch per
+ *	shard; the batch of a tag with a budget is small enough for the error to stay below the budget.
+ */
+struct mmwl_tag {
+	const	char *		name;			// Name of the tag, a static string
+	mmwl_counter_t		live_size;		// Bytes added from the shards, signed
+	mmwl_counter_t		peak_size;		// Highest value of live_size seen
+		long long	batch;			// Bytes gathered by a shard before adding them to live_size
+	unsigned long long	budget;			// Soft limit of live_size, 0 for none
+		mmwl_budget_fn	callback;		// Called when live_size goes over the budget
+		unsigned int	over;			// Non zero while over the budget, the callback fires once per crossing
+};
+
+static struct mmwl_tag mmwl_tags[MMWL_MAX_TAGS] = {
+	[0] = { .name = "<untagged>", .batch = MMWL_TAG_BATCH }
+};
+static unsigned int mmwl_tag_count = 1;			// Number of used entries of mmwl_tags[]
+static pthread_mutex_t mmwl_tag_lock = PTHREAD_MUTEX_INITIALIZER;	// Serializes registration of new tags
+static MMWL_TLS unsigned char mmwl_tag_stack[MMWL_TAG_DEPTH];	// Tag stack of the thread
+static MMWL_TLS unsigned int mmwl_tag_depth = 0;	// Number of tags pushed, may exceed MMWL_TAG_DEPTH
+
+// Tag of the blocks allocated by the current thread, a stack deeper than MMWL_TAG_DEPTH keeps its deepest stored tag
+#define CURRENT_TAG()		(mmwl_tag_depth == 0 ? 0 :							\
+				 mmwl_tag_stack[(mmwl_tag_depth < MMWL_TAG_DEPTH ? mmwl_tag_depth : MMWL_TAG_DEPTH) - 1])
 
+// Adds delta bytes of a tag to a shard, locked, and sets fold when the shard batch is to be added to the tag
+#define TAG_ACCOUNT(inst, tag, delta, fold)							\
+	do {											\
+		long long __live = ((inst)->tag_delta[tag] += (delta));				\
+		if (__live >= mmwl_tags[tag].batch || -__live >= mmwl_tags[tag].batch)		\
+		{										\
+			(fold) = __live;							\
+			(inst)->tag_delta[tag] = 0;						\
+		}										\
+	} while(0)
+#else
+#define CURRENT_TAG()		0
+#define TAG_ACCOUNT(inst, tag, delta, fold)	do { } while(0)
+#define tag_fold(tag, delta)	do { } while(0)
+#endif
 
 
 /*
- *	Wrapper function for free & kfree
+ *	Stack depot entry
+ *	Every distinct allocation stack is stored once, blocks refer to it by its index (stack id).
+ *	Frames of all the stacks are packed in mmwl_depot_frames[], the depot never frees entries.
  */
-void mmwl_free (	void *		ptr,					// User block address to be freed
-		const	char *		filename,				// Filename from where free was called
-		const	char *		func_name,				// Function name from which free was called
-		const	unsigned int	line_num )				// Line number of function call
-{
-	struct block_header * block = BLOCK_HEADER_OF(ptr);
+struct mmwl_stack {
+	unsigned int		hash;			// Hash of the frames
+	unsigned int		nr_frames;		// Number of frames
+	unsigned int		offset;			// Index of the first frame in mmwl_depot_frames[]
+	mmwl_counter_t		live_size;		// Size of the blocks currently allocated with this stack
+	mmwl_counter_t		live_count;		// Number of blocks currently allocated with this stack
+};
 
-	remove_malloc_entry(block, filename, func_name, line_num);
+#define MMWL_STACK_NONE		0			// Stack id of blocks without a captured stack
 
+static struct mmwl_stack mmwl_stacks[MMWL_MAX_STACKS];
+static unsigned long mmwl_depot_frames[MMWL_DEPOT_FRAMES];
+static unsigned int mmwl_stack_count = 1;		// Number of used entries of mmwl_stacks[]
+static unsigned int mmwl_depot_used = 0;		// Number of used entries of mmwl_depot_frames[]
+static unsigned int mmwl_stack_hash[2*MMWL_MAX_STACKS];	// Open addressing table of stack ids, 0 is empty slot
+static unsigned int mmwl_stack_depth = 0;		// Number of frames to capture, 0 disables capture
+#ifdef __KERNEL__
+static DEFINE_SPINLOCK(mmwl_depot_lock);		// Serializes insertion of new stacks
+#else
+static pthread_mutex_t mmwl_depot_lock = PTHREAD_MUTEX_INITIALIZER;
+#endif
 
-	// Call wrapped function
-	#ifdef __KERNEL__
-	kfree(block);
-	/*
-	{
-		static unsigned long entries[32];
-		static struct stack_trace trace = {
-			.entries = entries,
-			.max_entries = ARRAY_SIZE(entries),
-		};
+// Returns the depot entry of a block
+#define STACK_OF(block)		(&mmwl_stacks[(block)->stack_id & (MMWL_MAX_STACKS-1)])
 
-		trace.nr_entries = 0;
-		trace.skip = 0; // skip the last two entries
-		save_stack_trace(&trace);
 
-		print_stack_trace(&trace, 0);
-	}
-	*/
-	#else
-	free(block);
-	#endif
-	MMWL_BASIC_ASSERT;
-}
+/*
+ *	Header of allocated block entry
+ *	A tracked block is laid out as: header, head redzone, tail, user block, foot redzone.
+ *	The redzones are filled with a canary derived from the block address, see SIGNATURE_SET.
+ *	With MMWL_META_OOL the header is kept out of line in a pool and found through the metadata
+ *	table, the wrapped allocation starts with the head redzone.
+ */
+struct block_header {
+	struct			list_head head;
+	unsigned int		site_id;			// Call site from where block was allocated
+	unsigned int		stack_id;			// Stack at the allocation in the stack depot, 0 if not captured
+	unsigned short		shard;				// Index of the shard tracking this block
+	unsigned short		sample_shift;			// log2 of the sample rate when block was allocated
+	unsigned int		offset;				// Offset of the header in the wrapped allocation
+	size_t 			size;				// Size of the user block allocated
+	unsigned long long	alloc_time;			// Time of the allocation, see MMWL_LIFE_TICKS
+	unsigned short		head_rz;			// Size of the head redzone
+	unsigned short		foot_rz;			// Size of the foot redzone
+	unsigned char		flags;				// BLOCK_FLAG_*
+	unsigned char		tag;				// Allocation tag, 0 if untagged
+	unsigned int		generation;			// Snapshot generation when block was allocated
+	unsigned char		kind;				// BLOCK_KIND_* of the wrapped allocation
+	unsigned char		guard;				// 0, or MMWL_GUARD_* + 1 for a block placed against a guard page
+	unsigned short		cache_id;			// Kernel cache of a BLOCK_KIND_CACHE block
+#ifdef MMWL_META_OOL
+	void *			user;				// Address of the user block
+	struct	block_header *	meta_next;			// Next header in the metadata table bucket or pool
+#endif
+} __attribute__((aligned(16)));
 
+#define BLOCK_FLAG_REPORTED	0x1				// Corruption was reported by the scanner
+#define BLOCK_FLAG_FREED	0x2				// Block is in quarantine
 
+#define BLOCK_KIND_KMALLOC	0				// malloc or kmalloc family
+#define BLOCK_KIND_VMALLOC	1				// vmalloc family (kernel)
+#define BLOCK_KIND_KVMALLOC	2				// kvmalloc family (kernel)
+#define BLOCK_KIND_CACHE	3				// kmem_cache object (kernel)
+#define KIND_MASK(kind)		(1U << (kind))			// Set of kinds accepted by a free function
+#define SIZE_ANY		((size_t)-1)			// Free function not given the size of the block
 
+static const char * const mmwl_kind_names[] = { "kmalloc", "vmalloc", "kvmalloc", "kmem_cache" };
 
 /*
- *	Print current status of allocation tracking list
+ *	Tail of the header, just before the user block
  */
-void mmwl_status (void)
-{
-	struct list_head *iter = NULL;
+struct block_tail {
+	unsigned int		head_rz;			// Size of the head redzone, locates the header
+	unsigned int		reserved;
+	unsigned long		magic;				// BLOCK_MAGIC, overlaps the raw header magic
+	char			end[];				// Start of the user block
+};
 
-	MMWL_MUTEX_LOCK(&mmwl_gbl_inst.lock);
-	MMWL_LOG_INFO("*** mmwl statistics START ***");
-	MMWL_LOG_INFO("total alloc count       : %llu", mmwl_gbl_inst.alloc_count);
-	MMWL_LOG_INFO("total free count        : %llu", mmwl_gbl_inst.free_count);
-	MMWL_LOG_INFO("total size allocated    : %llu", mmwl_gbl_inst.alloc_size);
-	MMWL_LOG_INFO("total size freed        : %llu", mmwl_gbl_inst.free_size);
-	MMWL_LOG_INFO("current allocated size  : %llu", mmwl_gbl_inst.alloc_size-mmwl_gbl_inst.free_size);
-	MMWL_LOG_INFO("current alloc count     : %llu", mmwl_gbl_inst.alloc_count-mmwl_gbl_inst.free_count);
+// User block must keep the alignment given by the wrapped allocator
+_Static_assert(sizeof(struct block_header) % 16 == 0 && sizeof(struct block_tail) % 16 == 0,
+		"block_header breaks user block alignment");
 
-	// Print list of allocated blocks if list is not empty
-	if(mmwl_gbl_inst.head.next == &(mmwl_gbl_inst.head))
-	{
-		MMWL_LOG_INFO("list of allocations is empty");
-	}
-	else
+/*
+ *	Header of an allocation not picked by sampling, it is not tracked
+ */
+struct raw_header {
+	size_t			size;				// Size of the user block allocated
+	unsigned long		magic;				// RAW_MAGIC, overlaps the tail magic of tracked blocks
+	char			end[];				// Start of the user block
+};
+
+#define RAW_MAGIC		0x5A3C5A3CUL			// Marks an untracked block, must differ from BLOCK_MAGIC
+
+// Returns the word just before the user block, RAW_MAGIC for an untracked block
+#define MMWL_TAG_OF(ptr)	(((unsigned long *)(ptr))[-1])
+// Returns pointer to the raw header when pointer to the user block provided
+#define RAW_HEADER_OF(ptr)	((struct raw_header*)((void*)ptr - sizeof(struct raw_header)))
+// Size to be allocated for an untracked block
+#define RAW_SIZE(size)		(size+sizeof(struct raw_header))
+
+
+// Bytes of the header in the wrapped allocation
+#ifdef MMWL_META_OOL
+#define BLOCK_INLINE_HEADER	0
+#else
+#define BLOCK_INLINE_HEADER	sizeof(struct block_header)
+#endif
+
+// Size to be allocated including header and redzones
+#define BLOCK_SIZE(size, head_rz, foot_rz)							\
+	((size) + BLOCK_INLINE_HEADER + (head_rz) + sizeof(struct block_tail) + (foot_rz))
+// Largest user block whose allocation size, alignment & guard pages included, does not wrap around
+#define BLOCK_SIZE_MAX(head_rz, foot_rz, alignment)						\
+	((size_t)-1 - BLOCK_SIZE(0, head_rz, foot_rz) - (alignment) - MMWL_SIZE_SLACK)
+
+
+// Returns pointer to the tail when pointer to the user block provided
+#define BLOCK_TAIL_OF(ptr)	((struct block_tail*)((void*)(ptr) - sizeof(struct block_tail)))
+#ifdef MMWL_META_OOL
+// Returns pointer to the header when pointer to the user block provided, NULL if not a tracked block
+#define BLOCK_HEADER_OF(ptr)	meta_find(ptr)
+// Returns pointer to the user block when pointer to the header provided
+#define USER_OF(block)		((block)->user)
+// Returns pointer to the head redzone of a block
+#define HEAD_RZ_OF(block)	(USER_OF(block) - sizeof(struct block_tail) - (block)->head_rz)
+// Places the header of a block at the start of its wrapped allocation, after a realloc
+#define BLOCK_AT(block, base)	((block)->user = (void*)(base) + BLOCK_SIZE(0, (block)->head_rz, 0), (block))
+// True for an untracked block, every block is tracked
+#define IS_RAW_BLOCK(ptr)	0
+#else
+// Returns pointer to the header when pointer to the user block provided, the tail magic must be valid
+#define BLOCK_HEADER_OF(ptr)	((struct block_header*)((void*)BLOCK_TAIL_OF(ptr)			\
+					- BLOCK_TAIL_OF(ptr)->head_rz - sizeof(struct block_header)))
+// Returns pointer to the user block when pointer to the header provided
+#define USER_OF(block)		((void*)(block) + sizeof(struct block_header) + (block)->head_rz	\
+					+ sizeof(struct block_tail))
+// Returns pointer to the head redzone of a block
+#define HEAD_RZ_OF(block)	((void*)(block) + sizeof(struct block_header))
+// Places the header of a block at the start of its wrapped allocation, after a realloc
+#define BLOCK_AT(block, base)	((struct block_header *)(base))
+// True for an untracked block
+#define IS_RAW_BLOCK(ptr)	(MMWL_TAG_OF(ptr) == RAW_MAGIC)
+#endif
+// Returns pointer to the foot redzone of a block
+#define FOOT_RZ_OF(block)	(USER_OF(block) + (block)->size)
+// Returns the start of the wrapped allocation of a block
+#define ALLOC_BASE_OF(block)	(HEAD_RZ_OF(block) - BLOCK_INLINE_HEADER - (block)->offset)
+
+
+#if MMWL_LEVEL >= MMWL_LEVEL_CANARIES
+static unsigned int mmwl_redzones = (MMWL_HEAD_REDZONE << 16) | MMWL_FOOT_REDZONE;	// Head and foot redzone sizes
+static unsigned long mmwl_canary_secret = 0;		// Mixed into the canaries, set on first use
+
+// Reads the redzone sizes of new blocks
+#define READ_HEAD_RZ()		(MMWL_LOAD_ACQUIRE(&mmwl_redzones) >> 16)
+#define READ_FOOT_RZ()		(MMWL_LOAD_ACQUIRE(&mmwl_redzones) & 0xFFFF)
+
+
+/*
+ *	Redzone fill & compare kernels
+ *	Redzone sizes are multiples of 16, the foot redzone may be unaligned. The compare kernels
+ *	accumulate the differences and test once, so their cost does not depend on where a mismatch is.
+ */
+#ifdef MMWL_RZ_SIMD
+static void rz_fill_sse2 (void * dst, unsigned long canary, size_t len)
+{
+	__m128i pattern = _mm_set1_epi64x(canary);
+	size_t i = 0;
+	for (i = 0 ; i < len ; i += 16)
+		_mm_storeu_si128((__m128i *)(dst + i), pattern);
+}
+
+static int rz_check_sse2 (const void * src, unsigned long canary, size_t len)
+{
+	__m128i pattern = _mm_set1_epi64x(canary);
+	__m128i diff = _mm_setzero_si128();
+	size_t i = 0;
+	for (i = 0 ; i < len ; i += 16)
+		diff = _mm_or_si128(diff, _mm_xor_si128(_mm_loadu_si128((const __m128i *)(src + i)), pattern));
+	return _mm_movemask_epi8(_mm_cmpeq_epi8(diff, _mm_setzero_si128())) == 0xFFFF;
+}
+
+static __attribute__((target("avx2"))) void rz_fill_avx2 (void * dst, unsigned long canary, size_t len)
+{
+	__m256i pattern = _mm256_set1_epi64x(canary);
+	size_t i = 0;
+	for (i = 0 ; i + 32 <= len ; i += 32)
+		_mm256_storeu_si256((__m256i *)(dst + i), pattern);
+	if (i < len)
+		_mm_storeu_si128((__m128i *)(dst + i), _mm256_castsi256_si128(pattern));
+}
+
+static __attribute__((target("avx2"))) int rz_check_avx2 (const void * src, unsigned long canary, size_t len)
+{
+	__m256i pattern = _mm256_set1_epi64x(canary);
+	__m256i diff = _mm256_setzero_si256();
+	size_t i = 0;
+	for (i = 0 ; i + 32 <= len ; i += 32)
+		diff = _mm256_or_si256(diff, _mm256_xor_si256(_mm256_loadu_si256((const __m256i *)(src + i)), pattern));
+	if (i < len)
+		diff = _mm256_or_si256(diff, _mm256_castsi128_si256(_mm_xor_si128(
+				_mm_loadu_si128((const __m128i *)(src + i)), _mm256_castsi256_si128(pattern))));
+	return _mm256_testz_si256(diff, diff);
+}
+
+// Kernels used, upgraded to AVX2 at load time when the CPU supports it
+static void (*rz_fill) (void *, unsigned long, size_t) = rz_fill_sse2;
+static int (*rz_check) (const void *, unsigned long, size_t) = rz_check_sse2;
+
+__attribute__((constructor)) static void rz_select_kernels (void)
+{
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2"))
 	{
-		MMWL_LOG_INFO("list of allocations     :");
-		for(iter = mmwl_gbl_inst.head.next ; iter != &mmwl_gbl_inst.head ; iter = iter->next)
+		rz_fill = rz_fill_avx2;
+		rz_check = rz_check_avx2;
+	}
+}
+#else
+static void rz_fill_scalar (void * dst, unsigned long canary, size_t len)
+{
+	size_t i = 0;
+	for (i = 0 ; i < len ; i += sizeof(canary))
+		memcpy(dst + i, &canary, sizeof(canary));
+}
+
+static int rz_check_scalar (const void * src, unsigned long canary, size_t len)
+{
+	unsigned long diff = 0, word = 0;
+	size_t i = 0;
+	for (i = 0 ; i < len ; i += sizeof(canary))
+	{
+		memcpy(&word, src + i, sizeof(word));
+		diff |= word ^ canary;
+	}
+	return diff == 0;
+}
+
+#define rz_fill			rz_fill_scalar
+#define rz_check		rz_check_scalar
+#endif
+
+
+/*
+ *	Returns the process wide secret of the canaries, chosen on first use
+ */
+static unsigned long canary_secret (void)
+{
+	unsigned long secret = MMWL_LOAD_ACQUIRE(&mmwl_canary_secret);
+
+	if (__builtin_expect(secret == 0, 0))
+	{
+	#ifdef __KERNEL__
+		secret = get_random_long() | 1;
+	#else
+		struct timespec ts;
+		clock_gettime(CLOCK_MONOTONIC, &ts);
+		secret = ((unsigned long)&ts ^ (unsigned long)ts.tv_nsec * (unsigned long)0x9E3779B97F4A7C15ULL
+				^ (unsigned long)getpid() << 20) | 1;
+	#endif
+		// First thread to set the secret wins, blocks must all use the same one
+		MMWL_CMPXCHG(&mmwl_canary_secret, 0, secret);
+		secret = MMWL_LOAD_ACQUIRE(&mmwl_canary_secret);
+	}
+	return secret;
+}
+
+/*
+ *	Returns the canary of a block, a stale canary left at another address does not match it
+ */
+static inline unsigned long canary_of (struct block_header * block)
+{
+	unsigned long canary = ((unsigned long)USER_OF(block) ^ canary_secret()) * (unsigned long)0x9E3779B97F4A7C15ULL;
+	return canary ^ (canary >> 29);
+}
+
+#else
+#define READ_HEAD_RZ()		0
+#define READ_FOOT_RZ()		0
+#endif
+
+
+// Set signature for allocated block: tail magic and redzone canaries
+#if MMWL_LEVEL >= MMWL_LEVEL_CANARIES
+#define SIGNATURE_SET(block)									\
+	do {											\
+		unsigned long __canary = canary_of(block);					\
+		BLOCK_TAIL_OF(USER_OF(block))->head_rz = (block)->head_rz;			\
+		BLOCK_TAIL_OF(USER_OF(block))->magic = BLOCK_MAGIC;				\
+		rz_fill(HEAD_RZ_OF(block), __canary, (block)->head_rz);				\
+		rz_fill(FOOT_RZ_OF(block), __canary, (block)->foot_rz);				\
+	} while(0)
+#else
+#define SIGNATURE_SET(block)									\
+	do {											\
+		BLOCK_TAIL_OF(USER_OF(block))->head_rz = (block)->head_rz;			\
+		BLOCK_TAIL_OF(USER_OF(block))->magic = BLOCK_MAGIC;				\
+	} while(0)
+#endif
+// Erase signature of block when freed
+#define SIGNATURE_ERASE(block)	(BLOCK_TAIL_OF(USER_OF(block))->magic = 0)
+
+
+// Initializes block header & redzones, the redzone sizes must be set
+#define INIT_BLOCK(block, alloc_size, site)							\
+	do {											\
+		INIT_LIST_HEAD(&block->head);							\
+		block->site_id = site;								\
+		block->flags = 0;								\
+		block->size = alloc_size;							\
+		SIGNATURE_SET(block);								\
+	} while(0)
+
+
+// Boolean expression to verify the signature of the block
+#if MMWL_LEVEL >= MMWL_LEVEL_CANARIES
+#define CHECK_SIGN(block)	(BLOCK_TAIL_OF(USER_OF(block))->magic == BLOCK_MAGIC			\
+				&& rz_check(HEAD_RZ_OF(block), canary_of(block), (block)->head_rz)	\
+				&& rz_check(FOOT_RZ_OF(block), canary_of(block), (block)->foot_rz))
+#else
+#define CHECK_SIGN(block)	(BLOCK_TAIL_OF(USER_OF(block))->magic == BLOCK_MAGIC)
+#endif
+#define CHECK_SIGN_OF(ptr)	CHECK_SIGN(BLOCK_HEADER_OF(ptr))
+
+// Bytes of the wrapped allocation of a block
+#define BLOCK_FOOTPRINT(block)	(BLOCK_SIZE((block)->size, (block)->head_rz, (block)->foot_rz) + (block)->offset)
+
+
+#if MMWL_LEVEL >= MMWL_LEVEL_CANARIES
+#define POISON_WORD		((unsigned long)0x0101010101010101ULL * MMWL_POISON)
+
+/*
+ *	Fill a freed user block with the poison byte
+ */
+static inline void poison_fill (void * ptr, size_t len)
+{
+	rz_fill(ptr, POISON_WORD, len & ~(size_t)15);
+	memset(ptr + (len & ~(size_t)15), MMWL_POISON, len & 15);
+}
+
+/*
+ *	Returns non zero if a freed user block still holds the poison
+ */
+static inline int poison_check (const void * ptr, size_t len)
+{
+	size_t i = len & ~(size_t)15;
+	int intact = rz_check(ptr, POISON_WORD, i);
+	for ( ; i < len ; i++)
+		intact &= ((const unsigned char *)ptr)[i] == MMWL_POISON;
+	return intact;
+}
+
+// Boolean expression to verify a freed block of the quarantine
+#define CHECK_FREED(block)	(BLOCK_TAIL_OF(USER_OF(block))->magic == BLOCK_FREED_MAGIC			\
+				&& rz_check(HEAD_RZ_OF(block), canary_of(block), (block)->head_rz)		\
+				&& rz_check(FOOT_RZ_OF(block), canary_of(block), (block)->foot_rz)		\
+				&& poison_check(USER_OF(block), (block)->size))
+#else
+#define poison_fill(ptr, len)	do { } while(0)
+#define CHECK_FREED(block)	(BLOCK_TAIL_OF(USER_OF(block))->magic == BLOCK_FREED_MAGIC)
+#endif
+
+
+// True for the cursors parked in a shard list by the walkers, they are not blocks
+#define IS_CURSOR(inst, node)	((node) == &(inst)->cursor || (node) == &(inst)->scan_cursor)
+
+/*
+ *	Returns non zero if the list of a locked shard holds blocks, not only cursors
+ */
+static inline int shard_has_blocks (struct mmwl_instance * inst)
+{
+	struct list_head * node = inst->head.next;
+	while (node != &inst->head && IS_CURSOR(inst, node))
+		node = node->next;
+	return node != &inst->head;
+}
+
+
+// Add & remove a block from the allocation list of a shard, shard must be locked
+#if MMWL_LEVEL >= MMWL_LEVEL_LIST
+#define LIST_TRACK(block, inst)	list_add_tail(&(block)->head, &(inst)->head)
+#define LIST_UNTRACK(block)	list_del(&(block)->head)
+#else
+#define LIST_TRACK(block, inst)	do { } while(0)
+#define LIST_UNTRACK(block)	do { } while(0)
+#endif
+
+
+// Assert consistency of the allocation statistics of a shard
+#if MMWL_LEVEL >= MMWL_LEVEL_ASSERTS
+#define MMWL_BASIC_ASSERT(inst)									\
+	do {											\
+		unsigned long __flags = 0;							\
+		MMWL_MUTEX_LOCK(&(inst)->lock, __flags);					\
+		assert(										\
+			(!shard_has_blocks(inst)						\
+			&& (inst)->alloc_count 	== (inst)->free_count				\
+			&& (inst)->alloc_size 	== (inst)->free_size)				\
+			||									\
+			(shard_has_blocks(inst)							\
+			&& (inst)->alloc_count 	> (inst)->free_count				\
+			&& (inst)->alloc_size 	>= (inst)->free_size)				\
+		);										\
+		MMWL_MUTEX_UNLOCK(&(inst)->lock, __flags);					\
+	} while(0)
+#else
+#define MMWL_BASIC_ASSERT(inst)	do { (void)(inst); } while(0)
+#endif
+
+
+
+/*
+ *	Returns the next sampling interval in bytes, uniformly distributed in [1, 2*rate]
+ */
+static inline long next_sample_interval (void)
+{
+	unsigned long rnd = 0;
+#ifdef __KERNEL__
+	rnd = get_random_u32();
+#else
+	// xorshift64, seeded per thread
+	if (mmwl_sample_seed == 0)
+		mmwl_sample_seed = (unsigned long)&mmwl_sample_seed ^ (unsigned long)0x9E3779B97F4A7C15ULL;
+	mmwl_sample_seed ^= mmwl_sample_seed << 13;
+	mmwl_sample_seed ^= mmwl_sample_seed >> 7;
+	mmwl_sample_seed ^= mmwl_sample_seed << 17;
+	rnd = mmwl_sample_seed;
+#endif
+	return (long)(rnd & ((2UL << mmwl_sample_shift) - 1)) + 1;
+}
+
+
+
+
+/*
+ *	Decides whether an allocation of the given size is tracked
+ */
+static inline int sample_allocation (size_t size)
+{
+	unsigned int shift = READ_SAMPLE_SHIFT();
+	long left = 0;
+
+	if (shift == 0 || size >= ((size_t)1 << shift))
+		return 1;
+#ifdef __KERNEL__
+	left = this_cpu_sub_return(mmwl_sample_left, (long)size);
+	if (left > 0)
+		return 0;
+	this_cpu_write(mmwl_sample_left, next_sample_interval());
+#else
+	left = (mmwl_sample_left -= (long)size);
+	if (left > 0)
+		return 0;
+	mmwl_sample_left = next_sample_interval();
+#endif
+	return 1;
+}
+
+
+
+
+/*
+ *	Returns the estimated size of allocations a tracked block stands for
+ */
+static inline unsigned long long block_est_size (struct block_header * block)
+{
+	size_t rate = (size_t)1 << block->sample_shift;
+	if (block->sample_shift == 0 || block->size >= rate)
+		return block->size;
+	return rate;
+}
+
+
+
+
+/*
+ *	Returns the estimated number of allocations a tracked block stands for, in 1/MMWL_EST_SCALE units
+ */
+static inline unsigned long long block_est_count (struct block_header * block)
+{
+	if (block->sample_shift == 0 || block->size == 0)
+		return MMWL_EST_SCALE;
+	return block_est_size(block) * MMWL_EST_SCALE / block->size;
+}
+
+
+
+
+/*
+ *	Hash of a call site, the strings are static hence their addresses identify them
+ */
+static inline unsigned int site_hash (	const	char *		filename,
+					const	char *		func_name,
+					const	unsigned int	line_num )
+{
+	unsigned long key = (unsigned long)filename ^ ((unsigned long)func_name << 7) ^ line_num;
+	key ^= key >> 17;
+	key *= 0x9E3779B1UL;
+	key ^= key >> 15;
+	return (unsigned int)key & (2*MMWL_MAX_SITES-1);
+}
+
+
+
+
+/*
+ *	Returns the id of a call site, registering it on the first call
+ *	Lookup of a known site is lock free, only a new site takes mmwl_site_lock.
+ */
+static unsigned int intern_site (	const	char *		filename,	// Filename from where alloc was called
+					const	char *		func_name,	// Function name from which alloc was called
+					const	unsigned int	line_num )	// Line number of alloc function call
+{
+	unsigned int slot = site_hash(filename, func_name, line_num);
+	unsigned int id = 0;
+	int locked = 0;
+	unsigned long flags = 0;
+
+	for (;;)
+	{
+		id = MMWL_LOAD_ACQUIRE(&mmwl_site_hash[slot]);
+		if (id == 0)
 		{
-			struct block_header * block = list_entry(iter, struct block_header, head);
-			// Verify signature
-			if(!CHECK_SIGN(block))
+			if (!locked)
 			{
-				MMWL_LOG_ERROR("\taddr:%p size:%lu block origin @%s:%u in %s <signature mismatch>"
-						, block->end
-						, block->size
-						, block->func_name
-						, block->line_num
-						, block->filename);
+				// Not found, search again under the lock as another thread may be adding it
+				MMWL_MUTEX_LOCK(&mmwl_site_lock, flags);
+				locked = 1;
+				continue;
 			}
-			else
+			if (mmwl_site_count >= MMWL_MAX_SITES)
 			{
-				MMWL_LOG_INFO ("\taddr:%p size:%lu block origin @%s:%u in %s"
-						, block->end
-						, block->size
-						, block->func_name
-						, block->line_num
-						, block->filename);
+				id = MMWL_SITE_UNKNOWN;
+				break;
 			}
+			id = mmwl_site_count++;
+			mmwl_sites[id].filename		= filename;
+			mmwl_sites[id].func_name	= func_name;
+			mmwl_sites[id].line_num		= line_num;
+			SITE_GUARD_INIT(&mmwl_sites[id]);
+			MMWL_STORE_RELEASE(&mmwl_site_hash[slot], id);	// Publish the filled entry
+			break;
 		}
+		if (mmwl_sites[id].filename == filename
+				&& mmwl_sites[id].func_name == func_name
+				&& mmwl_sites[id].line_num == line_num)
+			break;
+		slot = (slot + 1) & (2*MMWL_MAX_SITES-1);
 	}
-	MMWL_LOG_INFO("*** mmwl statistics END ***");
-	MMWL_MUTEX_UNLOCK(&mmwl_gbl_inst.lock);
-	MMWL_BASIC_ASSERT;
+
+	if (locked)
+		MMWL_MUTEX_UNLOCK(&mmwl_site_lock, flags);
+	return id;
+}
+
+
+
+
+/*
+ *	Returns the id of a stack, storing it in the depot on the first call
+ *	Lookup of a known stack is lock free, only a new stack takes mmwl_depot_lock.
+ */
+static unsigned int intern_stack (	unsigned long *	frames,			// Return addresses
+					unsigned int	nr_frames )		// Number of return addresses
+{
+	unsigned int hash = 2166136261U;
+	unsigned int slot = 0;
+	unsigned int id = 0;
+	unsigned int i = 0;
+	int locked = 0;
+	unsigned long flags = 0;
+
+	for (i = 0 ; i < nr_frames ; i++)
+	{
+		hash ^= (unsigned int)(frames[i] ^ (frames[i] >> 32));
+		hash *= 16777619U;
+	}
+	slot = hash & (2*MMWL_MAX_STACKS-1);
+
+	for (;;)
+	{
+		id = MMWL_LOAD_ACQUIRE(&mmwl_stack_hash[slot]);
+		if (id == 0)
+		{
+			if (!locked)
+			{
+				// Not found, search again under the lock as another thread may be adding it
+				MMWL_MUTEX_LOCK(&mmwl_depot_lock, flags);
+				locked = 1;
+				continue;
+			}
+			if (mmwl_stack_count >= MMWL_MAX_STACKS || mmwl_depot_used + nr_frames > MMWL_DEPOT_FRAMES)
+			{
+				id = MMWL_STACK_NONE;			// Depot is full
+				break;
+			}
+			id = mmwl_stack_count++;
+			mmwl_stacks[id].hash		= hash;
+			mmwl_stacks[id].nr_frames	= nr_frames;
+			mmwl_stacks[id].offset		= mmwl_depot_used;
+			memcpy(&mmwl_depot_frames[mmwl_depot_used], frames, nr_frames * sizeof(unsigned long));
+			mmwl_depot_used += nr_frames;
+			MMWL_STORE_RELEASE(&mmwl_stack_hash[slot], id);	// Publish the filled entry
+			break;
+		}
+		if (mmwl_stacks[id].hash == hash
+				&& mmwl_stacks[id].nr_frames == nr_frames
+				&& memcmp(&mmwl_depot_frames[mmwl_stacks[id].offset], frames,
+					nr_frames * sizeof(unsigned long)) == 0)
+			break;
+		slot = (slot + 1) & (2*MMWL_MAX_STACKS-1);
+	}
+
+	if (locked)
+		MMWL_MUTEX_UNLOCK(&mmwl_depot_lock, flags);
+	return id;
+}
+
+
+
+
+/*
+ *	Captures the stack of the caller of the wrapper function and returns its id in the depot
+ *	Not inlined so that the number of mmwl frames on the stack is known (MMWL_STACK_SKIP).
+ */
+static __attribute__((noinline)) unsigned int capture_stack (void)
+{
+	unsigned int depth = MMWL_LOAD_ACQUIRE(&mmwl_stack_depth);
+	unsigned long frames[STACK_DUMP_DEPTH + MMWL_STACK_SKIP];
+	unsigned int nr_frames = 0;
+
+	if (depth == 0)
+		return MMWL_STACK_NONE;
+
+#ifdef __KERNEL__
+	nr_frames = stack_trace_save(frames, depth, MMWL_STACK_SKIP);
+	return intern_stack(frames, nr_frames);
+#else
+	// backtrace() may allocate, such allocations are tracked without stack
+	if (mmwl_busy)
+		return MMWL_STACK_NONE;
+	mmwl_busy = 1;
+	nr_frames = backtrace((void **)frames, depth + MMWL_STACK_SKIP);
+	mmwl_busy = 0;
+	if (nr_frames <= MMWL_STACK_SKIP)
+		return MMWL_STACK_NONE;
+	return intern_stack(frames + MMWL_STACK_SKIP, nr_frames - MMWL_STACK_SKIP);
+#endif
+}
+
+
+
+
+/*
+ *	Print the symbolized frames of a stack of the depot
+ */
+static void print_stack_frames (unsigned int id)
+{
+	struct mmwl_stack * stack = &mmwl_stacks[id & (MMWL_MAX_STACKS-1)];
+	unsigned long * frames = &mmwl_depot_frames[stack->offset];
+	unsigned int i = 0;
+#ifdef __KERNEL__
+	for (i = 0 ; i < stack->nr_frames ; i++)
+		MMWL_LOG_INFO("\t\t%pS", (void *)frames[i]);
+#else
+	char ** symbols = backtrace_symbols((void **)frames, stack->nr_frames);
+	for (i = 0 ; i < stack->nr_frames ; i++)
+		MMWL_LOG_INFO("\t\t%s", symbols ? symbols[i] : "?");
+	free(symbols);
+#endif
+}
+
+
+
+
+/*
+ *	Add the counters gathered by a shard to the site totals and empty the entry
+ *	The peak is raised to the highest live size reached within the batch, on top of the totals.
+ *	Histograms & peaks are only kept with the list of blocks.
+ */
+static void site_fold (struct site_delta * delta)
+{
+	struct mmwl_site * site = &mmwl_sites[delta->site_id & (MMWL_MAX_SITES-1)];
+	long long live = (long long)MMWL_COUNTER_ADD(&site->live_size, (unsigned long long)delta->live_size);
+#if MMWL_LEVEL >= MMWL_LEVEL_LIST
+	long long high = live - delta->live_size + delta->peak_size;
+	long long peak = (long long)MMWL_COUNTER_READ(&site->peak_size);
+	unsigned int c = 0;
+#else
+	(void)live;
+#endif
+
+	MMWL_COUNTER_ADD(&site->live_count, (unsigned long long)((long long)delta->alloc_count - delta->free_count));
+	if (delta->alloc_count != 0)
+		MMWL_COUNTER_ADD(&site->alloc_count, delta->alloc_count);
+	if (delta->free_count != 0)
+		MMWL_COUNTER_ADD(&site->free_count, delta->free_count);
+#if MMWL_LEVEL >= MMWL_LEVEL_LIST
+	for (c = 0 ; c < MMWL_SIZE_CLASSES ; c++)
+		if (delta->size_hist[c] != 0)
+			MMWL_COUNTER_ADD(&site->size_hist[c], delta->size_hist[c]);
+	for (c = 0 ; c < MMWL_LIFE_CLASSES ; c++)
+		if (delta->life_hist[c] != 0)
+			MMWL_COUNTER_ADD(&site->life_hist[c], delta->life_hist[c]);
+	// Raise the peak unless another shard has already raised it higher
+	while (high > peak && !MMWL_COUNTER_CMPXCHG(&site->peak_size, (unsigned long long)peak, (unsigned long long)high))
+		peak = (long long)MMWL_COUNTER_READ(&site->peak_size);
+#endif
+	memset(delta, 0, sizeof(*delta));
+}
+
+
+
+
+/*
+ *	Add the counters gathered by a shard to the stack totals and empty the entry
+ */
+static void stack_fold (struct stack_delta * delta)
+{
+	struct mmwl_stack * stack = &mmwl_stacks[delta->stack_id & (MMWL_MAX_STACKS-1)];
+
+	MMWL_COUNTER_ADD(&stack->live_size, (unsigned long long)delta->live_size);
+	MMWL_COUNTER_ADD(&stack->live_count, (unsigned long long)delta->live_count);
+	memset(delta, 0, sizeof(*delta));
 }
+
+
+
+
+/*
+ *	Returns the cache entry of a site in a shard, locked, folding the site it holds in its place
+ */
+static inline struct site_delta * site_delta_of (	struct	mmwl_instance *	inst,		// Shard, locked
+							unsigned int	site_id )	// Call site
+{
+	struct site_delta * delta = &inst->site_cache[site_id & (MMWL_SITE_CACHE-1)];
+
+	if (delta->ops != 0 && delta->site_id != site_id)
+		site_fold(delta);
+	delta->site_id = site_id;
+	return delta;
+}
+
+// Folds a site or stack cache entry once its batch is full
+#define DELTA_FULL(delta)	((delta)->ops >= MMWL_SITE_BATCH						\
+				 || (delta)->live_size >= MMWL_SITE_BATCH_BYTES					\
+				 || -(delta)->live_size >= MMWL_SITE_BATCH_BYTES)
+
+
+
+
+/*
+ *	Gather the live bytes of a block in the stack cache of a shard, locked
+ */
+static inline void stack_account (	struct	mmwl_instance *	inst,		// Shard, locked
+					unsigned int	stack_id,	// Stack of the block
+					long long	size,		// Live bytes added, negative for a free
+					long long	count )		// Live blocks added, negative for a free
+{
+	struct stack_delta * delta = &inst->stack_cache[stack_id & (MMWL_STACK_CACHE-1)];
+
+	if (stack_id == MMWL_STACK_NONE)					// Blocks without stack are not counted
+		return;
+	if (delta->ops != 0 && delta->stack_id != stack_id)
+		stack_fold(delta);
+	delta->stack_id = stack_id;
+	delta->live_size += size;
+	delta->live_count += count;
+	delta->ops++;
+	if (DELTA_FULL(delta))
+		stack_fold(delta);
+}
+
+
+
+
+/*
+ *	Account a new block to its call site and stack, in the caches of its shard, locked
+ */
+static inline void site_account_alloc (	struct	mmwl_instance *	inst,		// Shard, locked
+				struct	block_header * 	block,		// New block
+					unsigned int	size_class )	// Size class of the block
+{
+	struct site_delta * delta = site_delta_of(inst, block->site_id);
+
+	delta->live_size += block_est_size(block);
+	delta->alloc_count++;
+#if MMWL_LEVEL >= MMWL_LEVEL_LIST
+	if (delta->live_size > delta->peak_size)
+		delta->peak_size = delta->live_size;
+	delta->size_hist[size_class]++;
+#else
+	(void)size_class;
+#endif
+	delta->ops++;
+	if (DELTA_FULL(delta))
+		site_fold(delta);
+	stack_account(inst, block->stack_id, block_est_size(block), 1);
+}
+
+
+
+
+/*
+ *	Account a freed block to its call site and stack, in the caches of its owner shard, locked
+ */
+static inline void site_account_free (	struct	mmwl_instance *	inst,		// Owner shard, locked
+				struct	block_header * 	block,		// Block freed
+					unsigned int	life_class )	// Lifetime class of the block
+{
+	struct site_delta * delta = site_delta_of(inst, block->site_id);
+
+	delta->live_size -= block_est_size(block);
+	delta->free_count++;
+#if MMWL_LEVEL >= MMWL_LEVEL_LIST
+	delta->life_hist[life_class]++;
+#else
+	(void)life_class;
+#endif
+	delta->ops++;
+	if (DELTA_FULL(delta))
+		site_fold(delta);
+	stack_account(inst, block->stack_id, -(long long)block_est_size(block), -1);
+}
+
+
+
+
+/*
+ *	Add the site & stack counters gathered by every shard to the totals
+ *	Called before the site or stack totals are reported. A shard claimed by another thread is left
+ *	to its owner, which folds each entry once full, so its counters are late by at most a batch.
+ */
+static void site_flush (void)
+{
+	unsigned int i = 0, j = 0;
+	unsigned long flags = 0;
+
+	for (i = 0 ; i < MMWL_SHARD_COUNT ; i++)
+	{
+		struct mmwl_instance * inst = &mmwl_gbl_inst[i];
+		MMWL_MUTEX_LOCK(&inst->lock, flags);
+		if (SHARD_FOREIGN(inst))
+		{
+			MMWL_MUTEX_UNLOCK(&inst->lock, flags);
+			continue;
+		}
+		for (j = 0 ; j < MMWL_SITE_CACHE ; j++)
+			if (inst->site_cache[j].ops != 0)
+				site_fold(&inst->site_cache[j]);
+		for (j = 0 ; j < MMWL_STACK_CACHE ; j++)
+			if (inst->stack_cache[j].ops != 0)
+				stack_fold(&inst->stack_cache[j]);
+		MMWL_MUTEX_UNLOCK(&inst->lock, flags);
+	}
+}
+
+
+
+
+#ifndef __KERNEL__
+/*
+ *	Add the bytes gathered by a shard to a tag, calling its callback when it goes over its budget
+ *	Called with no lock held, the callback may allocate.
+ */
+static void tag_fold (unsigned int tag, long long delta)
+{
+	struct mmwl_tag * entry = &mmwl_tags[tag];
+	long long live = (long long)MMWL_COUNTER_ADD(&entry->live_size, (unsigned long long)delta);
+	long long peak = (long long)MMWL_COUNTER_READ(&entry->peak_size);
+	unsigned long long budget = MMWL_LOAD_ACQUIRE(&entry->budget);
+
+	// Raise the peak unless another thread has already raised it higher
+	while (live > peak && !MMWL_COUNTER_CMPXCHG(&entry->peak_size, (unsigned long long)peak, (unsigned long long)live))
+		peak = (long long)MMWL_COUNTER_READ(&entry->peak_size);
+
+	if (budget == 0)
+		return;
+	if (live > (long long)budget)
+	{
+		mmwl_budget_fn callback = MMWL_LOAD_ACQUIRE(&entry->callback);
+		if (MMWL_CMPXCHG(&entry->over, 0, 1) == 0 && callback != NULL)
+			callback(entry->name, live, budget);
+	}
+	else if (MMWL_LOAD_ACQUIRE(&entry->over))
+	{
+		MMWL_STORE_RELEASE(&entry->over, 0);
+	}
+}
+#endif
+
+
+
+
+#ifdef MMWL_META_OOL
+/*
+ *	Metadata table
+ *	Headers of the tracked blocks are hashed by the address range (granule) holding the start of
+ *	their user block, so that any pointer is validated without reading the memory it points to.
+ *	Headers come from per shard pools, refilled by chunks which are never freed.
+ */
+static struct block_header * mmwl_meta_table[MMWL_META_BUCKETS];	// Chains of headers linked by meta_next
+static size_t mmwl_meta_max_size = 0;				// Largest user block ever tracked
+#ifdef __KERNEL__
+static spinlock_t mmwl_meta_locks[MMWL_META_LOCKS] = { [0 ... MMWL_META_LOCKS-1] = __SPIN_LOCK_UNLOCKED(mmwl_meta_locks) };
+#else
+static pthread_mutex_t mmwl_meta_locks[MMWL_META_LOCKS] = { [0 ... MMWL_META_LOCKS-1] = PTHREAD_MUTEX_INITIALIZER };
+#endif
+
+// Granule of an address, bucket of a granule and lock of a bucket
+#define META_GRANULE(addr)	((unsigned long)(addr) >> MMWL_META_GRANULE)
+#define META_BUCKET(granule)	((unsigned int)(((unsigned long long)(granule) * 0x9E3779B97F4A7C15ULL) >> 40)	\
+					& (MMWL_META_BUCKETS-1))
+#define META_LOCK(bucket)	(&mmwl_meta_locks[(bucket) & (MMWL_META_LOCKS-1)])
+
+
+
+
+/*
+ *	Add the header of a block to the metadata table, its user block must be set
+ */
+static void meta_insert (struct block_header * block)
+{
+	unsigned int bucket = META_BUCKET(META_GRANULE(USER_OF(block)));
+	size_t max = MMWL_LOAD_ACQUIRE(&mmwl_meta_max_size);
+	size_t old = 0;
+	unsigned long flags = 0;
+
+	// Raise the largest size, it bounds the search of mmwl_lookup
+	while (block->size > max && (old = MMWL_CMPXCHG(&mmwl_meta_max_size, max, block->size)) != max)
+		max = old;
+
+	MMWL_MUTEX_LOCK(META_LOCK(bucket), flags);
+	block->meta_next = mmwl_meta_table[bucket];
+	mmwl_meta_table[bucket] = block;
+	MMWL_MUTEX_UNLOCK(META_LOCK(bucket), flags);
+}
+
+
+
+
+/*
+ *	Remove the header of a block from the metadata table
+ */
+static void meta_remove (struct block_header * block)
+{
+	unsigned int bucket = META_BUCKET(META_GRANULE(USER_OF(block)));
+	struct block_header ** link = &mmwl_meta_table[bucket];
+	unsigned long flags = 0;
+
+	MMWL_MUTEX_LOCK(META_LOCK(bucket), flags);
+	while (*link != NULL && *link != block)
+		link = &(*link)->meta_next;
+	if (*link != NULL)
+		*link = block->meta_next;
+	MMWL_MUTEX_UNLOCK(META_LOCK(bucket), flags);
+}
+
+
+
+
+/*
+ *	Returns the header of the tracked block starting at ptr, NULL if there is none
+ *	A block in quarantine is found too, with BLOCK_FLAG_FREED set.
+ */
+static struct block_header * meta_find (void * ptr)
+{
+	unsigned int bucket = META_BUCKET(META_GRANULE(ptr));
+	struct block_header * block = NULL;
+	unsigned long flags = 0;
+
+	MMWL_MUTEX_LOCK(META_LOCK(bucket), flags);
+	for (block = mmwl_meta_table[bucket] ; block != NULL && USER_OF(block) != ptr ; block = block->meta_next)
+		;
+	MMWL_MUTEX_UNLOCK(META_LOCK(bucket), flags);
+	return block;
+}
+
+
+
+
+/*
+ *	Returns a header from the pool of a shard, NULL if out of memory
+ */
+static struct block_header * meta_alloc (
+		#ifdef __KERNEL__
+					gfp_t			flags,		// kmalloc flags of the allocation
+		#endif
+				struct	mmwl_instance *		inst )		// Shard of the allocating thread
+{
+	struct block_header * block = NULL;
+	struct block_header * chunk = NULL;
+	unsigned int i = 0;
+	unsigned long flags = 0;
+
+	MMWL_MUTEX_LOCK(&inst->lock, flags);
+	if ((block = inst->meta_pool) != NULL)
+		inst->meta_pool = block->meta_next;
+	MMWL_MUTEX_UNLOCK(&inst->lock, flags);
+	if (block != NULL)
+		return block;
+
+	// Pool is empty, refill it with a new chunk of headers
+	chunk = MMWL_WRAPPED_MALLOC(MMWL_META_CHUNK * sizeof(struct block_header), flags);
+	if (chunk == NULL)
+		return NULL;
+	for (i = 1 ; i < MMWL_META_CHUNK - 1 ; i++)
+		chunk[i].meta_next = &chunk[i+1];
+	MMWL_MUTEX_LOCK(&inst->lock, flags);
+	chunk[MMWL_META_CHUNK-1].meta_next = inst->meta_pool;
+	inst->meta_pool = &chunk[1];
+	MMWL_MUTEX_UNLOCK(&inst->lock, flags);
+	return &chunk[0];
+}
+
+
+
+
+/*
+ *	Give the header of a released block back to the pool of its shard
+ */
+static void meta_release (struct block_header * block)
+{
+	struct mmwl_instance * inst = &mmwl_gbl_inst[block->shard & (MMWL_SHARD_COUNT-1)];
+	unsigned long flags = 0;
+
+	MMWL_MUTEX_LOCK(&inst->lock, flags);
+	block->meta_next = inst->meta_pool;
+	inst->meta_pool = block;
+	MMWL_MUTEX_UNLOCK(&inst->lock, flags);
+}
+
+#define META_INSERT(block)	meta_insert(block)
+#define META_REMOVE(block)	meta_remove(block)
+#define META_RELEASE(block)	meta_release(block)
+#else
+#define META_INSERT(block)	do { } while(0)
+#define META_REMOVE(block)	do { } while(0)
+#define META_RELEASE(block)	do { } while(0)
+#endif
+
+
+
+
+#ifdef __KERNEL__
+/*
+ *	Kernel caches
+ *	A cache created through mmwl_cache_create gets objects large enough for the header and the
+ *	redzones, the head redzone is padded so that the user objects keep their alignment. Caches are
+ *	found by address in an open addressing table read without lock, entry 0 is not a cache.
+ */
+struct mmwl_cache {
+	struct	kmem_cache *	cache;			// Wrapped cache, NULL for a free entry
+	const	char *		name;			// Name of the cache
+		size_t		object_size;		// Size of the user objects
+		unsigned short	head_rz;		// Head redzone of the objects with the alignment padding
+		unsigned short	foot_rz;		// Foot redzone of the objects, fixed at creation
+	mmwl_counter_t		live_size;		// Size of the objects currently allocated
+	mmwl_counter_t		live_count;		// Number of objects currently allocated
+	mmwl_counter_t		peak_size;		// Highest value of live_size seen
+	mmwl_counter_t		alloc_count;		// Number of objects ever allocated
+	mmwl_counter_t		free_count;		// Number of objects freed
+};
+
+static struct mmwl_cache mmwl_caches[MMWL_MAX_CACHES];		// Cache entries, by cache id
+static unsigned short mmwl_cache_hash[2*MMWL_MAX_CACHES];	// Open addressing table of cache ids, 0 is empty slot
+static DEFINE_MUTEX(mmwl_cache_lock);				// Serializes creation & destruction of caches
+
+#define CACHE_SLOT(cache)	((unsigned int)(((unsigned long)(cache) * 0x9E3779B97F4A7C15ULL) >> 40) & (2*MMWL_MAX_CACHES-1))
+#define CACHE_TOMBSTONE		0xFFFF			// Slot of a destroyed cache, skipped by lookups
+
+
+
+
+/*
+ *	Returns the entry of a cache created through mmwl_cache_create, NULL for any other cache
+ */
+static inline struct mmwl_cache * cache_entry (struct kmem_cache * cache)
+{
+	unsigned int slot = CACHE_SLOT(cache);
+	unsigned short id = 0;
+	unsigned int probe = 0;
+
+	// Tombstones are reused but never cleared, the probes are bounded
+	for (probe = 0 ; probe < 2*MMWL_MAX_CACHES && (id = MMWL_LOAD_ACQUIRE(&mmwl_cache_hash[slot])) != 0 ; probe++)
+	{
+		if (id != CACHE_TOMBSTONE && mmwl_caches[id].cache == cache)
+			return &mmwl_caches[id];
+		slot = (slot + 1) & (2*MMWL_MAX_CACHES-1);
+	}
+	return NULL;
+}
+
+
+
+
+/*
+ *	Allocate the wrapped memory of a block with the allocator of its kind
+ */
+static inline void * wrapped_alloc (	unsigned int		kind,		// BLOCK_KIND_* of the block
+				struct	mmwl_cache *		cache,		// Cache of a BLOCK_KIND_CACHE block
+					size_t			size,		// Size to be allocated
+					gfp_t			flags )		// Allocation flags of the caller
+{
+	switch (kind)
+	{
+	case BLOCK_KIND_VMALLOC:
+		return __vmalloc(size, flags);
+	case BLOCK_KIND_KVMALLOC:
+		return kvmalloc(size, flags);
+	case BLOCK_KIND_CACHE:
+		return kmem_cache_alloc(cache->cache, flags);
+	default:
+		return kmalloc(size, flags);
+	}
+}
+
+
+
+
+/*
+ *	Give wrapped memory back to the allocator of its kind
+ */
+static inline void wrapped_free (	unsigned int		kind,		// BLOCK_KIND_* of the block
+				struct	mmwl_cache *		cache,		// Cache of a BLOCK_KIND_CACHE block
+					void *			base )		// Wrapped memory
+{
+	switch (kind)
+	{
+	case BLOCK_KIND_VMALLOC:
+		vfree(base);
+		break;
+	case BLOCK_KIND_KVMALLOC:
+		kvfree(base);
+		break;
+	case BLOCK_KIND_CACHE:
+		kmem_cache_free(cache->cache, base);
+		break;
+	default:
+		kfree(base);
+	}
+}
+
+
+
+
+/*
+ *	Account an allocated cache object to its cache
+ */
+static inline void cache_account_alloc (struct mmwl_cache * entry)
+{
+	unsigned long long live = MMWL_COUNTER_ADD(&entry->live_size, entry->object_size);
+	unsigned long long peak = MMWL_COUNTER_READ(&entry->peak_size);
+
+	MMWL_COUNTER_ADD(&entry->live_count, 1);
+	MMWL_COUNTER_ADD(&entry->alloc_count, 1);
+	// Raise the peak unless another CPU has already raised it higher
+	while (live > peak && !MMWL_COUNTER_CMPXCHG(&entry->peak_size, peak, live))
+		peak = MMWL_COUNTER_READ(&entry->peak_size);
+}
+
+
+
+
+/*
+ *	Account a freed cache object to its cache
+ */
+static inline void cache_account_free (struct block_header * block)
+{
+	struct mmwl_cache * entry = &mmwl_caches[block->cache_id & (MMWL_MAX_CACHES-1)];
+
+	MMWL_COUNTER_SUB(&entry->live_size, block->size);
+	MMWL_COUNTER_SUB(&entry->live_count, 1);
+	MMWL_COUNTER_ADD(&entry->free_count, 1);
+}
+
+#define MMWL_KIND_MALLOC(kind, cache, size, flags) wrapped_alloc(kind, cache, size, flags)	// Wrapped allocation of a kind
+#define MMWL_KIND_FREE(kind, cache, base) wrapped_free(kind, cache, base)			// Wrapped free of a kind
+#define BLOCK_RELEASE(block)	wrapped_free((block)->kind, &mmwl_caches[(block)->cache_id & (MMWL_MAX_CACHES-1)], ALLOC_BASE_OF(block))
+#define BLOCK_SET_KIND(block, kind, cache)	((block)->kind = (kind), (block)->cache_id = (cache) != NULL ? (cache) - mmwl_caches : 0)
+#define KIND_SAMPLED(kind)	((kind) == BLOCK_KIND_KMALLOC)		// Only kmalloc blocks may pass through untracked
+#define CACHE_ACCOUNT_FREE(block)	do { if ((block)->kind == BLOCK_KIND_CACHE) cache_account_free(block); } while(0)
+#else
+#define MMWL_KIND_MALLOC(kind, cache, size, flags) MMWL_WRAPPED_MALLOC(size, flags)
+#define MMWL_KIND_FREE(kind, cache, base) MMWL_WRAPPED_FREE(base)
+#define BLOCK_RELEASE(block)	((block)->guard ? guard_release(block) : MMWL_WRAPPED_FREE(ALLOC_BASE_OF(block)))
+#define BLOCK_SET_KIND(block, kind, cache)	((block)->kind = BLOCK_KIND_KMALLOC, (block)->cache_id = 0)
+#define KIND_SAMPLED(kind)	1
+#define CACHE_ACCOUNT_FREE(block)	do { } while(0)
+#endif
+
+
+#ifndef __KERNEL__
+/*
+ *	Guard page mode (electric fence)
+ *	A guarded block gets its own mapping with an inaccessible page right after the user block
+ *	(MMWL_GUARD_OVERFLOW) or before the block header (MMWL_GUARD_UNDERFLOW), so that an access
+ *	past it faults at the offending instruction. In overflow mode the block has no foot redzone, the
+ *	few bytes left by the alignment between the block and the guard page are filled and verified
+ *	when the block is freed. Freed guarded blocks are made inaccessible and their memory is given
+ *	back, the mappings are kept in a pool of bounded size to catch a use after free.
+ */
+static struct {
+	void *			addr;				// Mapping of a freed guarded block
+	size_t			len;				// Length of the mapping
+} mmwl_guard_pool[MMWL_GUARD_POOL_SLOTS];
+
+static unsigned int mmwl_guard_pool_head = 0;		// Oldest entry of mmwl_guard_pool[]
+static unsigned int mmwl_guard_pool_count = 0;		// Number of used entries of mmwl_guard_pool[]
+static unsigned int mmwl_guard_pool_budget = MMWL_GUARD_POOL;	// Freed guarded blocks kept in the pool
+static pthread_mutex_t mmwl_guard_lock = PTHREAD_MUTEX_INITIALIZER;	// Protects mmwl_guard_pool[]
+
+#define PAGE_ROUND_UP(addr)	(((unsigned long)(addr) + mmwl_page_size - 1) & ~(unsigned long)(mmwl_page_size - 1))
+
+/*
+ *	Returns non zero if a new block is to be guarded
+ */
+static inline int guard_allocation (	size_t		size,			// Size of the user block
+					size_t		alignment,		// Alignment of the user block
+				const	char *		filename,		// Filename from where alloc was called
+				const	char *		func_name,		// Function name from which alloc was called
+				const	unsigned int	line_num )		// Line number of alloc function call
+{
+	unsigned int rate = MMWL_LOAD_ACQUIRE(&mmwl_guard_rate);
+
+	if (alignment > mmwl_page_size)
+		return 0;
+	if (rate != 0 && size >= mmwl_guard_min && size <= mmwl_guard_max)
+	{
+		if (mmwl_guard_left == 0)
+		{
+			mmwl_guard_left = rate - 1;
+			return 1;
+		}
+		mmwl_guard_left--;
+	}
+	return MMWL_LOAD_ACQUIRE(&mmwl_guard_spec_count) != 0
+		&& mmwl_sites[intern_site(filename, func_name, line_num)].guard;
+}
+
+#define GUARD_ALLOCATION(size, alignment, filename, func_name, line_num)				\
+	(__builtin_expect(MMWL_LOAD_ACQUIRE(&mmwl_guard_on) != 0, 0)					\
+		&& guard_allocation(size, alignment, filename, func_name, line_num))
+
+
+
+
+/*
+ *	Map a guarded block, returns the start of the mapping or NULL
+ *	The block header is to be placed at *start, the foot redzone size is updated for the mode.
+ */
+static char * guard_map (	size_t		size,			// Size of the user block
+				size_t		alignment,		// Alignment of the user block
+				unsigned int	mode,			// MMWL_GUARD_OVERFLOW or MMWL_GUARD_UNDERFLOW
+				unsigned int	head_rz,		// Head redzone size
+				unsigned int *	foot_rz,		// Foot redzone size
+				char **		start,			// Set to the start of the block
+				size_t *	len )			// Set to the length of the mapping
+{
+	size_t prefix = BLOCK_SIZE(0, head_rz, 0);
+	size_t data = 0;
+	char * base = NULL;
+	char * user = NULL;
+
+	if (alignment < MMWL_MIN_ALIGN)
+		alignment = MMWL_MIN_ALIGN;
+	if (mode == MMWL_GUARD_UNDERFLOW)
+		data = PAGE_ROUND_UP(((prefix + alignment - 1) & ~(alignment - 1)) + size + *foot_rz);
+	else
+		data = PAGE_ROUND_UP(prefix + size + alignment - 1);
+
+	base = mmap(NULL, data + mmwl_page_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (base == MAP_FAILED)
+		return NULL;
+
+	if (mode == MMWL_GUARD_UNDERFLOW)
+	{
+		user = base + mmwl_page_size + ((prefix + alignment - 1) & ~(alignment - 1));
+		if (mprotect(base, mmwl_page_size, PROT_NONE) != 0)
+			user = NULL;
+	}
+	else
+	{
+		*foot_rz = 0;
+		user = base + ((data - size) & ~(alignment - 1));
+		memset(user + size, MMWL_GUARD_FILL, base + data - (user + size));
+		if (mprotect(base + data, mmwl_page_size, PROT_NONE) != 0)
+			user = NULL;
+	}
+	if (user == NULL)
+	{
+		munmap(base, data + mmwl_page_size);
+		return NULL;
+	}
+	*start = user - prefix;
+	*len = data + mmwl_page_size;
+	return base;
+}
+
+
+
+
+/*
+ *	Release a guarded block into the pool of inaccessible mappings
+ *	The oldest mappings of the pool are unmapped once it is full.
+ */
+static void guard_release (struct block_header * block)
+{
+	char * base = ALLOC_BASE_OF(block);
+	char * end = (char *)PAGE_ROUND_UP(FOOT_RZ_OF(block) + block->foot_rz);
+	char * fill = NULL;
+	unsigned long flags = 0;
+
+	if (block->guard == MMWL_GUARD_OVERFLOW + 1)
+	{
+		for (fill = FOOT_RZ_OF(block) ; fill < end && *(unsigned char *)fill == MMWL_GUARD_FILL ; fill++)
+			;
+		if (fill < end)
+		{
+			MMWL_LOG_ERROR("write past the end of a guarded block, addr:%p size:%lu offset:%lu"
+					, USER_OF(block)
+					, (unsigned long)block->size
+					, (unsigned long)(fill - (char *)USER_OF(block)));
+			MMWL_LOG_ERROR("\tblock origin @%s:%u in %s"
+					, SITE_OF(block)->func_name
+					, SITE_OF(block)->line_num
+					, SITE_OF(block)->filename);
+		}
+		end += mmwl_page_size;
+	}
+
+	// Give the memory back and keep the addresses reserved, any access faults
+	madvise(base, end - base, MADV_DONTNEED);
+	mprotect(base, end - base, PROT_NONE);
+
+	MMWL_MUTEX_LOCK(&mmwl_guard_lock, flags);
+	while (mmwl_guard_pool_count != 0 && mmwl_guard_pool_count >= MMWL_LOAD_ACQUIRE(&mmwl_guard_pool_budget))
+	{
+		munmap(mmwl_guard_pool[mmwl_guard_pool_head].addr, mmwl_guard_pool[mmwl_guard_pool_head].len);
+		mmwl_guard_pool_head = (mmwl_guard_pool_head + 1) % MMWL_GUARD_POOL_SLOTS;
+		mmwl_guard_pool_count--;
+	}
+	if (MMWL_LOAD_ACQUIRE(&mmwl_guard_pool_budget) == 0)
+	{
+		munmap(base, end - base);
+	}
+	else
+	{
+		unsigned int slot = (mmwl_guard_pool_head + mmwl_guard_pool_count++) % MMWL_GUARD_POOL_SLOTS;
+		mmwl_guard_pool[slot].addr = base;
+		mmwl_guard_pool[slot].len = end - base;
+	}
+	MMWL_MUTEX_UNLOCK(&mmwl_guard_lock, flags);
+}
+#else
+#define GUARD_ALLOCATION(size, alignment, filename, func_name, line_num)	0
+#endif
+
+
+
+
+/*
+ *	Add block to the allocation list of the current shard
+ */
+static __attribute__((noinline)) struct mmwl_instance * add_malloc_entry (	struct	block_header * 	block,	// Pointer to block
+							size_t		size,	// Size of the user block
+						const	char *		filename,// Filename from where alloc was called
+						const	char *		func_name,// Function name from which alloc was called
+						const	unsigned int	line_num )// Line number of alloc function call
+{
+	struct mmwl_instance * inst = current_shard();
+	unsigned int tag = CURRENT_TAG();
+	long long fold = 0;
+	unsigned long flags = 0;
+
+	INIT_BLOCK(block, size, intern_site(filename, func_name, line_num));	// Initialize block
+	block->tag = tag;							// Charged to the tag of the thread
+	block->shard = inst - mmwl_gbl_inst;					// Remember the owner shard
+	block->sample_shift = READ_SAMPLE_SHIFT();				// Remember the sample rate
+	LIFE_START(block);							// Start of the block lifetime
+#if MMWL_LEVEL >= MMWL_LEVEL_LIST
+	block->generation = MMWL_LOAD_ACQUIRE(&mmwl_generation);		// Allocated after the last snapshot
+#endif
+	block->stack_id = capture_stack();					// Save allocation stack
+	META_INSERT(block);							// Make the block known to the metadata table
+	SHARD_LOCK(inst, flags);						// Lock shard
+	LIST_TRACK(block, inst);						// Add new block at the end of the list
+	inst->alloc_count++;							// Increment allocation count
+	inst->alloc_size += (unsigned long long)size;				// Add user block size to total allocation size
+	inst->est_alloc_count += block_est_count(block);			// Add to estimated totals
+	inst->est_alloc_size += block_est_size(block);
+	inst->size_hist[SIZE_CLASS(size)]++;					// Per shard histogram, merged on report
+	site_account_alloc(inst, block, SIZE_CLASS(size));			// Update call site & stack statistics
+	if (tag != 0)
+		TAG_ACCOUNT(inst, tag, (long long)block_est_size(block), fold);	// Per shard tag bytes
+	SHARD_UNLOCK(inst, flags);						// Unlock shard
+	if (fold != 0)
+		tag_fold(tag, fold);
+	return inst;
+}
+
+
+
+
+/*
+ *	Quarantine of freed blocks
+ *	Freed blocks are poisoned and gathered in batches by the shards, a full batch joins the global
+ *	FIFO. The oldest blocks are released to the wrapped allocator once the FIFO exceeds its budget.
+ */
+static size_t mmwl_quarantine_budget = MMWL_QUARANTINE_SIZE;	// Bytes the quarantine may hold, 0 disables it
+static size_t mmwl_quarantine_bytes = 0;			// Bytes held by mmwl_quarantine
+static struct list_head mmwl_quarantine = LIST_HEAD_INIT(mmwl_quarantine);	// Oldest block first
+#ifdef __KERNEL__
+static DEFINE_SPINLOCK(mmwl_quarantine_lock);			// Protects mmwl_quarantine
+#else
+static pthread_mutex_t mmwl_quarantine_lock = PTHREAD_MUTEX_INITIALIZER;
+#endif
+
+// Non zero if freed blocks go to quarantine
+#if MMWL_LEVEL >= MMWL_LEVEL_CANARIES
+#define QUARANTINE_ON()		(MMWL_LOAD_ACQUIRE(&mmwl_quarantine_budget) != 0)
+#else
+#define QUARANTINE_ON()		0
+#endif
+
+
+
+
+/*
+ *	Release a block leaving the quarantine to the wrapped allocator
+ *	A block modified while in quarantine was written after being freed.
+ */
+static void quarantine_release (struct block_header * block)
+{
+	if (!CHECK_FREED(block))
+	{
+		MMWL_LOG_ERROR("write after free, addr:%p size:%lu"
+				, USER_OF(block)
+				, (unsigned long)block->size);
+		MMWL_LOG_ERROR("\tblock origin @%s:%u in %s"
+				, SITE_OF(block)->func_name
+				, SITE_OF(block)->line_num
+				, SITE_OF(block)->filename);
+		if (block->stack_id != MMWL_STACK_NONE)
+			print_stack_frames(block->stack_id);
+	}
+	BLOCK_TAIL_OF(USER_OF(block))->magic = 0;
+	META_REMOVE(block);
+	BLOCK_RELEASE(block);
+	META_RELEASE(block);
+}
+
+
+
+
+/*
+ *	Append a batch of freed blocks to the quarantine and release the oldest blocks over budget
+ */
+static void quarantine_push (	struct	list_head *	batch,		// Blocks to be appended, left empty
+					size_t		bytes )		// Bytes held by the batch
+{
+	struct list_head evicted = LIST_HEAD_INIT(evicted);
+	size_t budget = MMWL_LOAD_ACQUIRE(&mmwl_quarantine_budget);
+	unsigned long flags = 0;
+
+	MMWL_MUTEX_LOCK(&mmwl_quarantine_lock, flags);
+	list_splice_tail_init(batch, &mmwl_quarantine);
+	mmwl_quarantine_bytes += bytes;
+	while (mmwl_quarantine_bytes > budget && !list_empty(&mmwl_quarantine))
+	{
+		struct list_head * node = mmwl_quarantine.next;
+		list_del(node);
+		list_add_tail(node, &evicted);
+		mmwl_quarantine_bytes -= BLOCK_FOOTPRINT(list_entry(node, struct block_header, head));
+	}
+	MMWL_MUTEX_UNLOCK(&mmwl_quarantine_lock, flags);
+
+	// Verify & release with no lock held
+	while (!list_empty(&evicted))
+	{
+		struct list_head * node = evicted.next;
+		list_del(node);
+		quarantine_release(list_entry(node, struct block_header, head));
+	}
+}
+
+
+
+
+/*
+ *	Account a block leaving its owner shard, the shard must be locked
+ */
+static inline void free_account (	struct	block_header * 	block,		// Block freed
+				struct	mmwl_instance *	inst,		// Owner shard of the block, locked
+					unsigned int	life_class,	// Lifetime class of the block
+					long long *	fold )		// Set to the tag bytes to fold after unlock
+{
+	inst->free_count++;							// Increment free count
+	inst->free_size += block->size;						// Add user block size to total freed size
+	inst->est_free_count += block_est_count(block);				// Add to estimated totals
+	inst->est_free_size += block_est_size(block);
+#if MMWL_LEVEL >= MMWL_LEVEL_LIST
+	inst->life_hist[life_class]++;						// Per shard histogram, merged on report
+#endif
+	site_account_free(inst, block, life_class);				// Update call site & stack statistics
+	if (block->tag != 0)
+		TAG_ACCOUNT(inst, block->tag, -(long long)block_est_size(block), *fold);	// Per shard tag bytes
+}
+
+
+
+
+/*
+ *	Remove block from the allocation list of its owner shard
+ *	With quarantine set, the block is poisoned and kept in quarantine instead of being released.
+ *	Returns the owner shard, or NULL if the caller must not release the block: it is corrupted
+ *	or it was put in quarantine.
+ */
+static struct mmwl_instance * remove_malloc_entry (	struct	block_header * 	block,	// Pointer to block
+							int		quarantine,// Non zero to put the block in quarantine
+						const	char *		filename,// Filename from where alloc was called
+						const	char *		func_name,// Function name from which alloc was called
+						const	unsigned int	line_num )// Line number of alloc function call
+{
+	struct mmwl_instance * inst = NULL;
+	struct list_head batch = LIST_HEAD_INIT(batch);
+	size_t batch_bytes = 0;
+	unsigned int life_class = LIFE_CLASS_OF(block);
+	unsigned int tag = block->tag;
+	long long fold = 0;
+	int corrupted = !CHECK_SIGN(block);
+	unsigned long flags = 0;
+
+	if(corrupted) {								// Verify block signature
+		// Signature was overwritten by the user program, suggesting out of bound write.
+		// The block may be damaged beyond its redzones, it is not given back to the wrapped allocator.
+		MMWL_LOG_ERROR("caller @%s:%u in %s"
+				, func_name
+				, line_num
+				, filename);
+		MMWL_LOG_ERROR("\tsignature mismatch, addr:%p, block is not freed"
+				, USER_OF(block));
+		MMWL_LOG_ERROR("\tblock origin @%s:%u in %s"
+				, SITE_OF(block)->func_name
+				, SITE_OF(block)->line_num
+				, SITE_OF(block)->filename);
+	}
+
+	inst = FREE_SHARD(block);						// Block may belong to another thread's shard
+	quarantine = quarantine && !corrupted;
+	if (quarantine)
+		poison_fill(USER_OF(block), block->size);			// Poison before joining the batch
+	SHARD_LOCK(inst, flags);						// Lock owner shard
+	LIST_UNTRACK(block);							// Remove block from allocation list
+	free_account(block, inst, life_class, &fold);
+	if (quarantine)
+	{
+		BLOCK_TAIL_OF(USER_OF(block))->magic = BLOCK_FREED_MAGIC;	// Freed signature
+		block->flags |= BLOCK_FLAG_FREED;
+		list_add_tail(&block->head, &inst->qbatch);			// List node is free once untracked
+		inst->qbatch_bytes += BLOCK_FOOTPRINT(block);
+		if (++inst->qbatch_count >= MMWL_QUARANTINE_BATCH)
+		{
+			list_splice_tail_init(&inst->qbatch, &batch);
+			batch_bytes = inst->qbatch_bytes;
+			inst->qbatch_bytes = 0;
+			inst->qbatch_count = 0;
+		}
+	}
+	else
+	{
+		SIGNATURE_ERASE(block);						// Erase signature, scanner can not see it
+	}
+	SHARD_UNLOCK(inst, flags);						// Unlock owner shard
+	if (!quarantine)
+		META_REMOVE(block);						// Pointer is no longer valid
+	if (fold != 0)
+		tag_fold(tag, fold);
+
+	if (batch_bytes != 0)
+		quarantine_push(&batch, batch_bytes);
+	return (corrupted || quarantine) ? NULL : inst;
+}
+
+
+
+
+/*
+ *	Take a block being reallocated out of its owner shard, with no accounting
+ *	The block is either accounted as freed by realloc_account once the wrapped realloc succeeds,
+ *	or put back as it was by relink_malloc_entry. A corrupted block is removed for good as by
+ *	remove_malloc_entry, NULL is returned then.
+ */
+static struct mmwl_instance * unlink_malloc_entry (	struct	block_header * 	block,	// Pointer to block
+						const	char *		filename,// Filename from where realloc was called
+						const	char *		func_name,// Function name from which realloc was called
+						const	unsigned int	line_num )// Line number of realloc function call
+{
+	struct mmwl_instance * inst = NULL;
+	unsigned long flags = 0;
+
+	if (!CHECK_SIGN(block))
+		return remove_malloc_entry(block, 0, filename, func_name, line_num);
+
+	inst = FREE_SHARD(block);
+	SHARD_LOCK(inst, flags);						// Lock owner shard
+	LIST_UNTRACK(block);							// Walkers must not read the block meanwhile
+	SIGNATURE_ERASE(block);							// Old address is invalid if the block moves
+	SHARD_UNLOCK(inst, flags);
+	META_REMOVE(block);
+	return inst;
+}
+
+
+
+
+/*
+ *	Put back a block taken out by unlink_malloc_entry, after a failed realloc
+ *	Its site, stack, times and counters are unchanged.
+ */
+static void relink_malloc_entry (struct block_header * block)
+{
+	struct mmwl_instance * inst = FREE_SHARD(block);
+	unsigned long flags = 0;
+
+	SIGNATURE_SET(block);
+	META_INSERT(block);
+	SHARD_LOCK(inst, flags);
+	LIST_TRACK(block, inst);
+	SHARD_UNLOCK(inst, flags);
+}
+
+
+
+
+/*
+ *	Account the old block of a successful realloc as freed, before the new block is added
+ *	The header was moved with the block, it still describes the old block.
+ */
+static void realloc_account (struct block_header * block)
+{
+	struct mmwl_instance * inst = FREE_SHARD(block);
+	unsigned int life_class = LIFE_CLASS_OF(block);
+	long long fold = 0;
+	unsigned long flags = 0;
+
+	SHARD_LOCK(inst, flags);
+	free_account(block, inst, life_class, &fold);
+	SHARD_UNLOCK(inst, flags);
+	if (fold != 0)
+		tag_fold(block->tag, fold);
+}
+
+
+
+
+
+#ifdef __KERNEL__
+
+// Event trace is only available on user side
+#define TRACE_EVENT(op, addr, old_addr, size, filename, func_name, line_num)	do { } while(0)
+#define TRACE_EVENT_AT(seq, op, addr, old_addr, size, filename, func_name, line_num)	do { (void)(seq); } while(0)
+#define TRACE_SEQ()	0ULL
+
+#else /* __KERNEL__ */
+
+/*
+ *	Per thread ring of trace events
+ *	Only the owner thread writes events and advances 'head', only the writer thread advances 'tail'.
+ */
+struct trace_ring {
+	struct	trace_ring *		next;		// Next ring in mmwl_trace_rings
+		unsigned int		head;		// Count of events written
+		unsigned int		tail;		// Count of events drained
+		unsigned int		tid;		// Thread id of the owner
+		int			dead;		// Owner thread has exited
+		int			dead_seen;	// Value of 'dead' taken by the writer with drain_head
+		unsigned int		drain_head;	// Value of 'head' taken by the writer
+		unsigned long long	dropped;	// Events lost as the ring was full
+		unsigned long long	dropped_written;// Value of 'dropped' reported in the file
+	struct	mmwl_trace_event	events[MMWL_TRACE_RING_SIZE];
+};
+
+static int mmwl_trace_on = 0;					// Events are recorded when non zero
+static struct trace_ring * mmwl_trace_rings = NULL;		// Rings of all the threads
+static MMWL_TLS struct trace_ring * mmwl_thread_ring = NULL;	// Ring of the current thread
+static pthread_key_t mmwl_trace_key;				// Marks the ring dead at thread exit
+static pthread_once_t mmwl_trace_key_once = PTHREAD_ONCE_INIT;
+static pthread_mutex_t mmwl_trace_lock = PTHREAD_MUTEX_INITIALIZER;	// Serializes start & stop
+static pthread_t mmwl_trace_writer;				// Thread draining the rings to the file
+static FILE * mmwl_trace_file = NULL;				// Trace file
+static unsigned int mmwl_trace_sites = 0;			// Call sites already defined in the file
+static unsigned long long mmwl_trace_dropped = 0;		// Events dropped since the trace started
+static unsigned long long mmwl_trace_seq = 0;			// Sequence number of the next event
+
+#define TRACE_SEQ_NONE	(~0ULL)					// No sequence number reserved
+
+// Records an event if tracing is on
+#define TRACE_EVENT(op, addr, old_addr, size, filename, func_name, line_num)			\
+	TRACE_EVENT_AT(TRACE_SEQ_NONE, op, addr, old_addr, size, filename, func_name, line_num)
+
+// Records an event with a sequence number taken by TRACE_SEQ() before the operation
+#define TRACE_EVENT_AT(seq, op, addr, old_addr, size, filename, func_name, line_num)		\
+	do {											\
+		if (__builtin_expect(__atomic_load_n(&mmwl_trace_on, __ATOMIC_RELAXED), 0))	\
+			trace_record(seq, op, addr, old_addr, size, filename, func_name, line_num);\
+	} while(0)
+
+// Reserves the sequence number of an operation releasing a block before recording it
+#define TRACE_SEQ()										\
+	(__builtin_expect(__atomic_load_n(&mmwl_trace_on, __ATOMIC_RELAXED), 0)			\
+		? __atomic_fetch_add(&mmwl_trace_seq, 1, __ATOMIC_RELAXED) : TRACE_SEQ_NONE)
+
+
+
+
+/*
+ *	Thread exit handler, the writer frees the ring once drained
+ */
+static void trace_ring_exit (void * arg)
+{
+	struct trace_ring * ring = arg;
+	mmwl_thread_ring = NULL;
+	MMWL_STORE_RELEASE(&ring->dead, 1);
+}
+
+static void trace_key_create (void)
+{
+	pthread_key_create(&mmwl_trace_key, trace_ring_exit);
+}
+
+
+
+
+/*
+ *	Allocates the ring of the current thread
+ */
+static struct trace_ring * new_trace_ring (void)
+{
+	struct trace_ring * ring = MMWL_INTERNAL_ALLOC(sizeof(struct trace_ring));
+	if (ring == NULL)
+		return NULL;
+	ring->head	= 0;
+	ring->tail	= 0;
+	ring->tid	= (unsigned int)syscall(SYS_gettid);
+	ring->dead	= 0;
+	ring->dead_seen	= 0;
+	ring->drain_head = 0;
+	ring->dropped	= 0;
+	ring->dropped_written = 0;
+	pthread_once(&mmwl_trace_key_once, trace_key_create);
+	pthread_setspecific(mmwl_trace_key, ring);
+
+	// Push on the list of rings, only the writer removes rings and never the first one
+	ring->next = __atomic_load_n(&mmwl_trace_rings, __ATOMIC_RELAXED);
+	while (!__atomic_compare_exchange_n(&mmwl_trace_rings, &ring->next, ring, 0,
+				__ATOMIC_RELEASE, __ATOMIC_RELAXED))
+		;
+	mmwl_thread_ring = ring;
+	return ring;
+}
+
+
+
+
+/*
+ *	Appends an event to the ring of the current thread
+ */
+static void trace_record (		unsigned long long seq,			// Reserved sequence number or TRACE_SEQ_NONE
+					unsigned int	op,			// MMWL_TRACE_* operation
+					void *		addr,			// User block address
+					void *		old_addr,		// Previous address of reallocated block
+					size_t		size,			// Size of the user block
+				const	char *		filename,		// Filename of the call
+				const	char *		func_name,		// Function name of the call
+				const	unsigned int	line_num )		// Line number of the call
+{
+	struct trace_ring * ring = mmwl_thread_ring;
+	struct mmwl_trace_event * event = NULL;
+	unsigned int head = 0;
+
+	if (ring == NULL)
+	{
+		// Creating the ring may allocate, such allocations are not traced
+		if (mmwl_busy)
+			return;
+		mmwl_busy = 1;
+		ring = new_trace_ring();
+		mmwl_busy = 0;
+		if (ring == NULL)
+			return;
+	}
+
+	head = ring->head;
+	if (head - MMWL_LOAD_ACQUIRE(&ring->tail) >= MMWL_TRACE_RING_SIZE)
+	{
+		ring->dropped++;
+		return;
+	}
+
+	event = &ring->events[head & (MMWL_TRACE_RING_SIZE-1)];
+	event->timestamp	= mmwl_clock_ns();
+	event->seq		= seq != TRACE_SEQ_NONE ? seq : __atomic_fetch_add(&mmwl_trace_seq, 1, __ATOMIC_RELAXED);
+	event->addr		= (unsigned long)addr;
+	event->old_addr		= (unsigned long)old_addr;
+	event->size		= size;
+	event->site_id		= intern_site(filename, func_name, line_num);
+	event->tid		= ring->tid;
+	event->op		= op;
+	event->line		= 0;
+	MMWL_STORE_RELEASE(&ring->head, head + 1);		// Publish the event
+}
+
+
+
+
+/*
+ *	Writes the pending events of all the rings to the trace file, called by the writer thread only
+ */
+static void trace_drain (void)
+{
+	struct trace_ring * first = MMWL_LOAD_ACQUIRE(&mmwl_trace_rings);
+	struct trace_ring * ring = NULL;
+	struct trace_ring * prev = NULL;
+	unsigned int site_count = 0;
+
+	// Take the heads first, the call sites used by these events are then visible
+	for (ring = first ; ring != NULL ; ring = ring->next)
+	{
+		ring->dead_seen = MMWL_LOAD_ACQUIRE(&ring->dead);
+		ring->drain_head = MMWL_LOAD_ACQUIRE(&ring->head);
+	}
+
+	// Define the new call sites before the events using them
+	site_count = MMWL_LOAD_ACQUIRE(&mmwl_site_count);
+	for ( ; mmwl_trace_sites < site_count ; mmwl_trace_sites++)
+	{
+		struct mmwl_site * site = &mmwl_sites[mmwl_trace_sites];
+		struct mmwl_trace_event event = {
+			.addr		= strlen(site->filename),
+			.old_addr	= strlen(site->func_name),
+			.site_id	= mmwl_trace_sites,
+			.op		= MMWL_TRACE_SITE,
+			.line		= site->line_num,
+		};
+		fwrite(&event, sizeof(event), 1, mmwl_trace_file);
+		fwrite(site->filename, 1, event.addr, mmwl_trace_file);
+		fwrite(site->func_name, 1, event.old_addr, mmwl_trace_file);
+	}
+
+	for (ring = first ; ring != NULL ; ring = ring->next)
+	{
+		unsigned long long dropped = __atomic_load_n(&ring->dropped, __ATOMIC_RELAXED);
+		if (dropped != ring->dropped_written)
+		{
+			// Tell the analyzer that its results are incomplete
+			struct mmwl_trace_event event = {
+				.size	= dropped - ring->dropped_written,
+				.tid	= ring->tid,
+				.op	= MMWL_TRACE_DROP,
+			};
+			fwrite(&event, sizeof(event), 1, mmwl_trace_file);
+			mmwl_trace_dropped += event.size;
+			ring->dropped_written = dropped;
+		}
+		// Events may wrap around the end of the ring, write them in two parts then
+		while (ring->tail != ring->drain_head)
+		{
+			unsigned int start = ring->tail & (MMWL_TRACE_RING_SIZE-1);
+			unsigned int count = ring->drain_head - ring->tail;
+			if (count > MMWL_TRACE_RING_SIZE - start)
+				count = MMWL_TRACE_RING_SIZE - start;
+			fwrite(&ring->events[start], sizeof(struct mmwl_trace_event), count, mmwl_trace_file);
+			MMWL_STORE_RELEASE(&ring->tail, ring->tail + count);
+		}
+	}
+
+	// Free the drained rings of exited threads, the first ring may be racing with a push
+	for (prev = first, ring = first ? first->next : NULL ; ring != NULL ; ring = prev->next)
+	{
+		if (ring->dead_seen && ring->tail == ring->drain_head)
+		{
+			prev->next = ring->next;
+			MMWL_INTERNAL_FREE(ring);
+		}
+		else
+		{
+			prev = ring;
+		}
+	}
+}
+
+
+
+
+/*
+ *	Trace writer thread
+ */
+static void * trace_writer (void * arg)
+{
+	struct timespec period = { 0, MMWL_TRACE_PERIOD_MS * 1000000L };
+
+	(void)arg;
+	while (MMWL_LOAD_ACQUIRE(&mmwl_trace_on))
+	{
+		trace_drain();
+		nanosleep(&period, NULL);
+	}
+	trace_drain();
+	return NULL;
+}
+
+#endif /* __KERNEL__ */
+
+
+
+
+/*
+ *	Report a block given to the free function of another allocator, returns non zero if so
+ */
+static int kind_mismatch (	void *			ptr,		// User block address
+			struct	block_header *		block,		// Header of the block, NULL for an untracked block
+				unsigned int		kinds,		// KIND_MASK of the kinds accepted by the caller
+				unsigned int		cache_id,	// Cache expected by the caller, 0 for none
+			const	char *			filename,	// Filename of the caller
+			const	char *			func_name,	// Function name of the caller
+			const	unsigned int		line_num )	// Line number of the caller
+{
+	unsigned int kind = block != NULL ? block->kind : BLOCK_KIND_KMALLOC;
+
+	if ((kinds & KIND_MASK(kind)) && (block == NULL || block->cache_id == cache_id))
+		return 0;
+	MMWL_LOG_ERROR("caller @%s:%u in %s"
+			, func_name
+			, line_num
+			, filename);
+	MMWL_LOG_ERROR("\tmismatched free, addr:%p allocated by %s, block is left untouched"
+			, ptr
+			, mmwl_kind_names[kind & 3]);
+	if (block != NULL)
+		MMWL_LOG_ERROR("\tblock origin @%s:%u in %s"
+				, SITE_OF(block)->func_name
+				, SITE_OF(block)->line_num
+				, SITE_OF(block)->filename);
+	return 1;
+}
+
+
+
+
+/*
+ *	Returns the header of a tracked block, NULL after reporting the caller if ptr is not one
+ *	The tail magic is checked before the header is located, as a bad pointer has no valid tail.
+ */
+static struct block_header * block_of (	void *		ptr,		// User block address
+					const	char *		filename,	// Filename of the caller
+					const	char *		func_name,	// Function name of the caller
+					const	unsigned int	line_num )	// Line number of the caller
+{
+#ifdef MMWL_META_OOL
+	// The table knows every block, ptr is not read
+	struct block_header * block = meta_find(ptr);
+
+	if (block != NULL && !(block->flags & BLOCK_FLAG_FREED))
+		return block;
+	if (block != NULL)
+#else
+	if (MMWL_TAG_OF(ptr) == BLOCK_MAGIC && BLOCK_TAIL_OF(ptr)->head_rz <= MMWL_MAX_REDZONE)
+		return BLOCK_HEADER_OF(ptr);
+
+	if (MMWL_TAG_OF(ptr) == BLOCK_FREED_MAGIC && BLOCK_TAIL_OF(ptr)->head_rz <= MMWL_MAX_REDZONE)
+#endif
+	{
+		// Block is still in quarantine, its header is intact
+		struct block_header * block = BLOCK_HEADER_OF(ptr);
+		MMWL_LOG_ERROR("caller @%s:%u in %s"
+				, func_name
+				, line_num
+				, filename);
+		MMWL_LOG_ERROR("	block already freed, addr:%p, block is left untouched"
+				, ptr);
+		MMWL_LOG_ERROR("	block origin @%s:%u in %s"
+				, SITE_OF(block)->func_name
+				, SITE_OF(block)->line_num
+				, SITE_OF(block)->filename);
+		return NULL;
+	}
+
+	// Tail magic mismatch for following reasons:
+	//	1. Wrong pointer was given to "free" or "realloc" call
+	//	2. The block was already freed, hence multiple "free" called on same address
+	//	3. The tail was overwritten by the user program, suggesting out of bound write
+	MMWL_LOG_ERROR("caller @%s:%u in %s"
+			, func_name
+			, line_num
+			, filename);
+	MMWL_LOG_ERROR("\tnot an allocated block, addr:%p, block is left untouched"
+			, ptr);
+	return NULL;
+}
+
+
+
+
+/*
+ *	Allocates a block, tracked or not as decided by sampling
+ *	Always inlined, so that every wrapper has the same number of frames on a captured stack.
+ */
+static inline __attribute__((always_inline)) void * alloc_block (
+				size_t		size,				// Size of the user block
+				size_t		alignment,			// Alignment of the user block, power of two
+		#ifdef __KERNEL__
+				gfp_t		flags,				// kmalloc flags
+				unsigned int	kind,				// BLOCK_KIND_* of the allocation
+			struct	mmwl_cache *	cache,				// Cache of a BLOCK_KIND_CACHE allocation
+		#endif
+			const	char *		filename,			// Filename from where alloc was called
+			const	char *		func_name,			// Function name from which alloc was called
+			const	unsigned int	line_num )			// Line number of alloc function call
+{
+	struct block_header * block = NULL;
+	struct mmwl_instance * inst = NULL;
+	unsigned int head_rz = READ_HEAD_RZ();
+	unsigned int foot_rz = READ_FOOT_RZ();
+	unsigned char guard = 0;
+#ifndef __KERNEL__
+	size_t guard_len = 0;							// Length of the mapping of a guarded block
+#endif
+	size_t prefix = 0;							// Bytes before the user block
+	char * base = NULL;
+	char * start = NULL;
+
+#ifdef __KERNEL__
+	if (cache != NULL)
+	{
+		// Objects of a cache have room for the redzones it was created with
+		head_rz = cache->head_rz;
+		foot_rz = cache->foot_rz;
+	}
+#endif
+	prefix = BLOCK_SIZE(0, head_rz, 0);
+
+	if (size > BLOCK_SIZE_MAX(head_rz, foot_rz, alignment))
+	{
+		// The header and redzones would wrap the size of the wrapped allocation around
+	#ifndef __KERNEL__
+		errno = ENOMEM;
+	#endif
+		return NULL;
+	}
+
+#ifndef __KERNEL__
+	if (GUARD_ALLOCATION(size, alignment, filename, func_name, line_num))
+	{
+		// Placed against a guard page, always tracked
+		guard = MMWL_LOAD_ACQUIRE(&mmwl_guard_mode) + 1;
+		base = guard_map(size, alignment, guard - 1, head_rz, &foot_rz, &start, &guard_len);
+	}
+	else
+#endif
+	if (alignment <= MMWL_MIN_ALIGN && KIND_SAMPLED(kind) && !sample_allocation(size))
+	{
+		// Not sampled, pass through with a minimal header
+		struct raw_header * raw = (struct raw_header *) MMWL_WRAPPED_MALLOC(RAW_SIZE(size), flags);
+		if (raw == NULL)
+			return NULL;
+		raw->size = size;
+		raw->magic = RAW_MAGIC;
+		TRACE_EVENT(MMWL_TRACE_MALLOC, raw->end, NULL, size, filename, func_name, line_num);
+		return (void*)raw->end;
+	}
+
+	// Call wrapped function
+	else if (alignment <= MMWL_MIN_ALIGN)
+	{
+		base = MMWL_KIND_MALLOC(kind, cache, BLOCK_SIZE(size, head_rz, foot_rz), flags);
+		start = base;
+	}
+	else
+	{
+		// Over-allocate and place the header just before the aligned user block
+		base = MMWL_KIND_MALLOC(kind, cache, BLOCK_SIZE(size, head_rz, foot_rz) + alignment, flags);
+		if (base != NULL)
+			start = (char *)((((unsigned long)base + prefix + alignment - 1)
+						& ~(unsigned long)(alignment - 1)) - prefix);
+	}
+
+	if (base == NULL)
+		return NULL;
+
+#ifdef MMWL_META_OOL
+	#ifdef __KERNEL__
+	block = meta_alloc(flags, current_shard());
+	#else
+	block = meta_alloc(current_shard());
+	#endif
+	if (block == NULL)
+	{
+	#ifndef __KERNEL__
+		if (guard)
+			munmap(base, guard_len);
+		else
+	#endif
+		MMWL_KIND_FREE(kind, cache, base);
+		return NULL;
+	}
+	block->user = start + prefix;
+#else
+	block = (struct block_header *) start;
+#endif
+	block->offset = start - base;
+	block->head_rz = head_rz;
+	block->foot_rz = foot_rz;
+	block->guard = guard;
+	BLOCK_SET_KIND(block, kind, cache);
+	inst = add_malloc_entry(block, size, filename, func_name, line_num);
+	MMWL_BASIC_ASSERT(inst);
+	TRACE_EVENT(MMWL_TRACE_MALLOC, USER_OF(block), NULL, size, filename, func_name, line_num);
+	return USER_OF(block);
+}
+
+
+
+
+/*
+ *	Wrapper function for malloc & kmalloc
+ */
+void * mmwl_malloc (		size_t		size,				// Size of the user block
+		#ifdef __KERNEL__
+				gfp_t		flags,				// kmalloc flags
+		#endif
+			const	char *		filename,			// Filename from where alloc was called
+			const	char *		func_name,			// Function name from which alloc was called
+			const	unsigned int	line_num )			// Line number of alloc function call
+{
+	#ifdef __KERNEL__
+	return alloc_block(size, MMWL_MIN_ALIGN, flags, BLOCK_KIND_KMALLOC, NULL, filename, func_name, line_num);
+	#else
+	return alloc_block(size, MMWL_MIN_ALIGN, filename, func_name, line_num);
+	#endif
+}
+
+
+
+
+/*
+ *	Wrapper function for calloc & kcalloc
+ */
+void * mmwl_calloc (		size_t		blocks,				// Number of elements
+				size_t		size,				// Size of an element
+		#ifdef __KERNEL__
+				gfp_t		flags,				// kmalloc flags
+		#endif
+			const	char *		filename,			// Filename from where alloc was called
+			const	char *		func_name,			// Function name from which alloc was called
+			const	unsigned int	line_num )			// Line number of alloc function call
+{
+	void * ptr = NULL;
+
+	if (size != 0 && blocks > (size_t)-1 / size)
+	{
+		// Size overflow
+	#ifndef __KERNEL__
+		errno = ENOMEM;
+	#endif
+		return NULL;
+	}
+
+	#ifdef __KERNEL__
+	ptr = alloc_block(blocks * size, MMWL_MIN_ALIGN, flags, BLOCK_KIND_KMALLOC, NULL, filename, func_name, line_num);
+	#else
+	ptr = alloc_block(blocks * size, MMWL_MIN_ALIGN, filename, func_name, line_num);
+	#endif
+	if (ptr != NULL)
+		memset(ptr, 0, blocks * size);
+	return ptr;
+}
+
+
+
+
+#ifndef __KERNEL__
+/*
+ *	Wrapper function for aligned allocations (posix_memalign, aligned_alloc, memalign)
+ *	Aligned blocks are always tracked. Returns NULL if alignment is not a power of two.
+ */
+void * mmwl_memalign (		size_t		alignment,			// Alignment of the user block
+				size_t		size,				// Size of the user block
+			const	char *		filename,			// Filename from where alloc was called
+			const	char *		func_name,			// Function name from which alloc was called
+			const	unsigned int	line_num )			// Line number of alloc function call
+{
+	if (alignment == 0 || (alignment & (alignment - 1)) != 0)
+	{
+		errno = EINVAL;
+		return NULL;
+	}
+	if (size > BLOCK_SIZE_MAX(MMWL_MAX_REDZONE, MMWL_MAX_REDZONE, alignment))
+	{
+		errno = ENOMEM;						// Size overflow with the over-allocation
+		return NULL;
+	}
+	return alloc_block(size, alignment, filename, func_name, line_num);
+}
+#endif
+
+
+
+
+/*
+ *	Wrapper function for realloc & krealloc
+ */
+void * mmwl_realloc (	void *		ptr,					// User block address to be 'realloc'ated
+			size_t		size,					// Size of the user block
+	#ifdef __KERNEL__
+			gfp_t 		flags,					// kmalloc flags
+	#endif
+		const	char *		filename,				// Filename from where realloc was called
+		const	char *		func_name,				// Function name from which realloc was called
+		const	unsigned int	line_num )				// Line number of realloc function call
+{
+	struct block_header * block_old = NULL;
+	struct block_header * block_new = NULL;
+	struct mmwl_instance * inst = NULL;
+	void * base = NULL;
+	unsigned long long seq = 0;
+
+	if (ptr == NULL)
+	{
+		#ifdef __KERNEL__
+		return alloc_block(size, MMWL_MIN_ALIGN, flags, BLOCK_KIND_KMALLOC, NULL, filename, func_name, line_num);
+		#else
+		return alloc_block(size, MMWL_MIN_ALIGN, filename, func_name, line_num);
+		#endif
+	}
+
+	if (size > BLOCK_SIZE_MAX(MMWL_MAX_REDZONE, MMWL_MAX_REDZONE, MMWL_MIN_ALIGN))
+	{
+		// Size overflow, the block is left untouched
+	#ifndef __KERNEL__
+		errno = ENOMEM;
+	#endif
+		return NULL;
+	}
+
+	if (IS_RAW_BLOCK(ptr))
+	{
+		// Untracked block stays untracked, the sampling decision is taken once per block
+		unsigned long long seq = TRACE_SEQ();			// The old block may be reused once released
+		struct raw_header * raw = (struct raw_header *) MMWL_WRAPPED_REALLOC(RAW_HEADER_OF(ptr), RAW_SIZE(size), flags);
+		if (raw == NULL)
+			return NULL;
+		raw->size = size;
+		TRACE_EVENT_AT(seq, MMWL_TRACE_REALLOC, raw->end, ptr, size, filename, func_name, line_num);
+		return (void*)raw->end;
+	}
+
+	if ((block_old = block_of(ptr, filename, func_name, line_num)) == NULL)
+		return NULL;
+	if (kind_mismatch(ptr, block_old, KIND_MASK(BLOCK_KIND_KMALLOC), 0, filename, func_name, line_num))
+		return NULL;
+
+	if (block_old->offset != 0 || block_old->guard)
+	{
+		// Aligned or guarded block, the wrapped realloc can not keep the header in place
+		void * new_ptr = NULL;
+		#ifdef __KERNEL__
+		new_ptr = alloc_block(size, MMWL_MIN_ALIGN, flags, BLOCK_KIND_KMALLOC, NULL, filename, func_name, line_num);
+		#else
+		new_ptr = alloc_block(size, MMWL_MIN_ALIGN, filename, func_name, line_num);
+		#endif
+		if (new_ptr != NULL)
+		{
+			memcpy(new_ptr, ptr, block_old->size < size ? block_old->size : size);
+			mmwl_free(ptr, filename, func_name, line_num);
+		}
+		return new_ptr;
+	}
+
+	if (unlink_malloc_entry(block_old, filename, func_name, line_num) == NULL)
+	{
+		// Corrupted block is not given to the wrapped realloc, move the data to a new block
+		void * new_ptr = NULL;
+		#ifdef __KERNEL__
+		new_ptr = alloc_block(size, MMWL_MIN_ALIGN, flags, BLOCK_KIND_KMALLOC, NULL, filename, func_name, line_num);
+		#else
+		new_ptr = alloc_block(size, MMWL_MIN_ALIGN, filename, func_name, line_num);
+		#endif
+		if (new_ptr != NULL)
+			memcpy(new_ptr, ptr, block_old->size < size ? block_old->size : size);
+		return new_ptr;
+	}
+
+	// Call wrapped function, the block keeps its redzone sizes
+	seq = TRACE_SEQ();
+	base = MMWL_WRAPPED_REALLOC(ALLOC_BASE_OF(block_old), BLOCK_SIZE(size, block_old->head_rz, block_old->foot_rz), flags);
+
+	if (base != NULL)
+	{
+		block_new = BLOCK_AT(block_old, base);
+		realloc_account(block_new);
+		inst = add_malloc_entry(block_new, size, filename, func_name, line_num);
+		MMWL_BASIC_ASSERT(inst);
+		TRACE_EVENT_AT(seq, MMWL_TRACE_REALLOC, USER_OF(block_new), ptr, size, filename, func_name, line_num);
+		return USER_OF(block_new);
+	}
+
+	// Old block is left untouched by a failed realloc, track it again as it was
+	relink_malloc_entry(block_old);
+	return NULL;
+}
+
+
+
+
+/*
+ *	Report a sized free given another size than the one allocated, the block is freed anyway
+ */
+static void size_mismatch (	void *			ptr,		// User block address
+			struct	block_header *		block,		// Header of the block, NULL for an untracked block
+				size_t			size,		// Size of the block
+				size_t			given,		// Size given by the caller
+			const	char *			filename,	// Filename of the caller
+			const	char *			func_name,	// Function name of the caller
+			const	unsigned int		line_num )	// Line number of the caller
+{
+	MMWL_LOG_ERROR("caller @%s:%u in %s"
+			, func_name
+			, line_num
+			, filename);
+	MMWL_LOG_ERROR("\tsized free of %zu bytes, addr:%p of %zu bytes"
+			, given
+			, ptr
+			, size);
+	if (block != NULL)
+		MMWL_LOG_ERROR("\tblock origin @%s:%u in %s"
+				, SITE_OF(block)->func_name
+				, SITE_OF(block)->line_num
+				, SITE_OF(block)->filename);
+}
+
+
+
+
+/*
+ *	Free a block allocated by one of the given kinds
+ *	Always inlined, so that every wrapper has the same number of frames on a captured stack.
+ */
+static inline __attribute__((always_inline)) void free_block (
+				void *		ptr,				// User block address to be freed
+				size_t		size,				// Size given by a sized free, SIZE_ANY otherwise
+				unsigned int	kinds,				// KIND_MASK of the kinds accepted by the caller
+				unsigned int	cache_id,			// Cache of the block for kmem_cache_free, else 0
+			const	char *		filename,			// Filename from where free was called
+			const	char *		func_name,			// Function name from which free was called
+			const	unsigned int	line_num )			// Line number of function call
+{
+	struct block_header * block = NULL;
+	struct mmwl_instance * inst = NULL;
+
+	if (ptr == NULL)
+		return;
+
+	if (IS_RAW_BLOCK(ptr))
+	{
+		// Untracked block, only kmalloc blocks may be untracked
+		if (kind_mismatch(ptr, NULL, kinds, cache_id, filename, func_name, line_num))
+			return;
+		if (size != SIZE_ANY && size != RAW_HEADER_OF(ptr)->size)
+			size_mismatch(ptr, NULL, RAW_HEADER_OF(ptr)->size, size, filename, func_name, line_num);
+		TRACE_EVENT(MMWL_TRACE_FREE, ptr, NULL, RAW_HEADER_OF(ptr)->size, filename, func_name, line_num);
+		MMWL_TAG_OF(ptr) = 0;
+		MMWL_WRAPPED_FREE(RAW_HEADER_OF(ptr));
+		return;
+	}
+
+	if ((block = block_of(ptr, filename, func_name, line_num)) == NULL)
+		return;
+	if (kind_mismatch(ptr, block, kinds, cache_id, filename, func_name, line_num))
+		return;
+	if (size != SIZE_ANY && size != block->size)
+		size_mismatch(ptr, block, block->size, size, filename, func_name, line_num);
+	TRACE_EVENT(MMWL_TRACE_FREE, ptr, NULL, block->size, filename, func_name, line_num);
+	CACHE_ACCOUNT_FREE(block);
+	// A cache object in quarantine would outlive the destruction of its cache
+	// A guarded block is kept inaccessible by the guard pool instead
+	inst = remove_malloc_entry(block, QUARANTINE_ON() && block->kind != BLOCK_KIND_CACHE && !block->guard
+					, filename, func_name, line_num);
+	if (inst == NULL)
+		return;								// Block is kept, corrupted or in quarantine
+
+	// Call wrapped function
+	BLOCK_RELEASE(block);
+	META_RELEASE(block);
+	MMWL_BASIC_ASSERT(inst);
+}
+
+
+
+
+/*
+ *	Wrapper function for free & kfree
+ */
+void mmwl_free (	void *		ptr,					// User block address to be freed
+		const	char *		filename,				// Filename from where free was called
+		const	char *		func_name,				// Function name from which free was called
+		const	unsigned int	line_num )				// Line number of function call
+{
+	free_block(ptr, SIZE_ANY, KIND_MASK(BLOCK_KIND_KMALLOC), 0, filename, func_name, line_num);
+}
+
+
+
+
+#ifndef __KERNEL__
+/*
+ *	Wrapper function for sized frees, as C++ sized delete
+ *	Reports a size other than the allocated one.
+ */
+void mmwl_free_sized (	void *		ptr,					// User block address to be freed
+			size_t		size,					// Size of the block given by the caller
+		const	char *		filename,				// Filename from where free was called
+		const	char *		func_name,				// Function name from which free was called
+		const	unsigned int	line_num )				// Line number of function call
+{
+	free_block(ptr, size, KIND_MASK(BLOCK_KIND_KMALLOC), 0, filename, func_name, line_num);
+}
+#endif
+
+
+
+
+#ifdef __KERNEL__
+/*
+ *	Wrapper function for vmalloc & vzalloc
+ */
+void * mmwl_vmalloc (		size_t		size,				// Size of the user block
+				gfp_t		flags,				// GFP_KERNEL, with __GFP_ZERO for vzalloc
+			const	char *		filename,			// Filename from where alloc was called
+			const	char *		func_name,			// Function name from which alloc was called
+			const	unsigned int	line_num )			// Line number of alloc function call
+{
+	return alloc_block(size, MMWL_MIN_ALIGN, flags, BLOCK_KIND_VMALLOC, NULL, filename, func_name, line_num);
+}
+
+
+
+
+/*
+ *	Wrapper function for kvmalloc & kvzalloc
+ */
+void * mmwl_kvmalloc (		size_t		size,				// Size of the user block
+				gfp_t		flags,				// kvmalloc flags
+			const	char *		filename,			// Filename from where alloc was called
+			const	char *		func_name,			// Function name from which alloc was called
+			const	unsigned int	line_num )			// Line number of alloc function call
+{
+	return alloc_block(size, MMWL_MIN_ALIGN, flags, BLOCK_KIND_KVMALLOC, NULL, filename, func_name, line_num);
+}
+
+
+
+
+/*
+ *	Wrapper function for vfree
+ */
+void mmwl_vfree (	void *		ptr,					// User block address to be freed
+		const	char *		filename,				// Filename from where free was called
+		const	char *		func_name,				// Function name from which free was called
+		const	unsigned int	line_num )				// Line number of function call
+{
+	free_block(ptr, SIZE_ANY, KIND_MASK(BLOCK_KIND_VMALLOC), 0, filename, func_name, line_num);
+}
+
+
+
+
+/*
+ *	Wrapper function for kvfree, which also frees kmalloc & vmalloc blocks
+ */
+void mmwl_kvfree (	void *		ptr,					// User block address to be freed
+		const	char *		filename,				// Filename from where free was called
+		const	char *		func_name,				// Function name from which free was called
+		const	unsigned int	line_num )				// Line number of function call
+{
+	free_block(ptr, SIZE_ANY, KIND_MASK(BLOCK_KIND_KMALLOC) | KIND_MASK(BLOCK_KIND_VMALLOC) | KIND_MASK(BLOCK_KIND_KVMALLOC)
+			, 0, filename, func_name, line_num);
+}
+
+
+
+
+/*
+ *	Wrapper function for kmem_cache_create
+ *	The wrapped cache gets objects large enough for the header and the redzones. Its objects are
+ *	aligned as requested (align, SLAB_HWCACHE_ALIGN) and the head redzone is padded to a multiple
+ *	of the alignment, so the user objects are aligned too. Caches with a constructor are not
+ *	tracked: the slab constructs an object once for all its allocations, which mmwl can not do
+ *	under the header. Neither are caches of objects reused without being freed (SLAB_TYPESAFE_BY_RCU).
+ */
+struct kmem_cache * mmwl_cache_create (	const	char *		name,		// Name of the cache
+						unsigned int	size,		// Size of the user objects
+						unsigned int	align,		// Alignment of the user objects
+						slab_flags_t	flags,		// Cache flags
+						void		(*ctor)(void *) )	// Constructor of the user objects
+{
+	struct mmwl_cache * entry = NULL;
+	unsigned int head_rz = READ_HEAD_RZ();
+	unsigned int foot_rz = READ_FOOT_RZ();
+	unsigned int prefix = 0;
+	unsigned int slot = 0;
+	unsigned int id = 0;
+
+	if ((flags & SLAB_TYPESAFE_BY_RCU) || ctor != NULL)
+		return kmem_cache_create(name, size, align, flags, ctor);
+
+	// Pad the head redzone, the wrapped cache aligns the start of its objects
+	if ((flags & SLAB_HWCACHE_ALIGN) && align < cache_line_size())
+		align = cache_line_size();
+	if (align < MMWL_MIN_ALIGN)
+		align = MMWL_MIN_ALIGN;
+	prefix = BLOCK_SIZE(0, head_rz, 0);
+	head_rz += (align - prefix % align) % align;
+	if (head_rz > MMWL_MAX_REDZONE)
+	{
+		MMWL_LOG_ERROR("alignment of %s is too large, it is not tracked", name);
+		return kmem_cache_create(name, size, align, flags, ctor);
+	}
+
+	MMWL_SLEEP_LOCK(&mmwl_cache_lock);
+	for (id = 1 ; id < MMWL_MAX_CACHES && mmwl_caches[id].cache != NULL ; id++)
+		;
+	if (id == MMWL_MAX_CACHES)
+	{
+		MMWL_SLEEP_UNLOCK(&mmwl_cache_lock);
+		MMWL_LOG_ERROR("cache table is full, %s is not tracked", name);
+		return kmem_cache_create(name, size, align, flags, ctor);
+	}
+
+	entry = &mmwl_caches[id];
+	memset(entry, 0, sizeof(*entry));
+	entry->name = name;
+	entry->object_size = size;
+	entry->head_rz = head_rz;
+	entry->foot_rz = foot_rz;
+	entry->cache = kmem_cache_create(name, BLOCK_SIZE(size, head_rz, foot_rz), align, flags, NULL);
+	if (entry->cache != NULL)
+	{
+		// Publish the entry, a destroyed cache leaves a tombstone which may be reused
+		for (slot = CACHE_SLOT(entry->cache) ; mmwl_cache_hash[slot] != 0 && mmwl_cache_hash[slot] != CACHE_TOMBSTONE ; )
+			slot = (slot + 1) & (2*MMWL_MAX_CACHES-1);
+		MMWL_STORE_RELEASE(&mmwl_cache_hash[slot], id);
+	}
+	MMWL_SLEEP_UNLOCK(&mmwl_cache_lock);
+	return entry->cache;
+}
+
+
+
+
+/*
+ *	Wrapper function for kmem_cache_destroy
+ */
+void mmwl_cache_destroy (struct kmem_cache * cache)
+{
+	struct mmwl_cache * entry = NULL;
+	unsigned int slot = 0;
+
+	if (cache == NULL)
+		return;
+
+	MMWL_SLEEP_LOCK(&mmwl_cache_lock);
+	if ((entry = cache_entry(cache)) != NULL)
+	{
+		if (MMWL_COUNTER_READ(&entry->live_count) != 0)
+			MMWL_LOG_ERROR("cache %s destroyed with %llu objects allocated"
+					, entry->name
+					, MMWL_COUNTER_READ(&entry->live_count));
+		for (slot = CACHE_SLOT(cache) ; mmwl_cache_hash[slot] != entry - mmwl_caches ; )
+			slot = (slot + 1) & (2*MMWL_MAX_CACHES-1);
+		MMWL_STORE_RELEASE(&mmwl_cache_hash[slot], CACHE_TOMBSTONE);
+		entry->cache = NULL;
+	}
+	MMWL_SLEEP_UNLOCK(&mmwl_cache_lock);
+	kmem_cache_destroy(cache);
+}
+
+
+
+
+/*
+ *	Wrapper function for kmem_cache_alloc & kmem_cache_zalloc
+ *	Objects of a cache not created through mmwl_cache_create are not tracked.
+ */
+void * mmwl_cache_alloc (	struct	kmem_cache *	cache,			// Cache of the object
+				gfp_t		flags,				// Allocation flags
+			const	char *		filename,			// Filename from where alloc was called
+			const	char *		func_name,			// Function name from which alloc was called
+			const	unsigned int	line_num )			// Line number of alloc function call
+{
+	struct mmwl_cache * entry = cache_entry(cache);
+	void * ptr = NULL;
+
+	if (entry == NULL)
+		return kmem_cache_alloc(cache, flags);
+
+	// The object is aligned by the wrapped cache and the padded head redzone
+	ptr = alloc_block(entry->object_size, MMWL_MIN_ALIGN, flags, BLOCK_KIND_CACHE, entry, filename, func_name, line_num);
+	if (ptr != NULL)
+		cache_account_alloc(entry);
+	return ptr;
+}
+
+
+
+
+/*
+ *	Wrapper function for kmem_cache_free
+ */
+void mmwl_cache_free (	struct	kmem_cache *	cache,				// Cache of the object
+				void *		ptr,				// Object to be freed
+			const	char *		filename,			// Filename from where free was called
+			const	char *		func_name,			// Function name from which free was called
+			const	unsigned int	line_num )			// Line number of function call
+{
+	struct mmwl_cache * entry = cache_entry(cache);
+
+	if (entry == NULL)
+	{
+		kmem_cache_free(cache, ptr);
+		return;
+	}
+	free_block(ptr, SIZE_ANY, KIND_MASK(BLOCK_KIND_CACHE), entry - mmwl_caches, filename, func_name, line_num);
+}
+
+
+
+
+/*
+ *	Print the counters of the caches created through mmwl_cache_create
+ */
+void mmwl_status_caches (void)
+{
+	unsigned int id = 0;
+
+	MMWL_LOG_INFO("*** mmwl caches START ***");
+	MMWL_SLEEP_LOCK(&mmwl_cache_lock);
+	for (id = 1 ; id < MMWL_MAX_CACHES ; id++)
+	{
+		struct mmwl_cache * entry = &mmwl_caches[id];
+		if (entry->cache == NULL)
+			continue;
+		MMWL_LOG_INFO("\t%s object size:%lu live size:%llu live count:%llu peak size:%llu allocs:%llu frees:%llu"
+				, entry->name
+				, (unsigned long)entry->object_size
+				, MMWL_COUNTER_READ(&entry->live_size)
+				, MMWL_COUNTER_READ(&entry->live_count)
+				, MMWL_COUNTER_READ(&entry->peak_size)
+				, MMWL_COUNTER_READ(&entry->alloc_count)
+				, MMWL_COUNTER_READ(&entry->free_count));
+	}
+	MMWL_SLEEP_UNLOCK(&mmwl_cache_lock);
+	MMWL_LOG_INFO("*** mmwl caches END ***");
+}
+#endif
+
+
+
+
+/*
+ *	Returns the size of a user block, as given to the allocation function
+ */
+size_t mmwl_block_size (void * ptr)
+{
+	struct block_header * block = NULL;
+
+	if (ptr == NULL)
+		return 0;
+	if (IS_RAW_BLOCK(ptr))
+		return RAW_HEADER_OF(ptr)->size;
+	block = BLOCK_HEADER_OF(ptr);
+	return block != NULL ? block->size : 0;
+}
+
+
+
+
+/*
+ *	Returns the bytes mmwl adds to a user block: header, redzones and alignment padding
+ */
+size_t mmwl_block_overhead (void * ptr)
+{
+	struct block_header * block = NULL;
+
+	if (ptr == NULL)
+		return 0;
+	if (IS_RAW_BLOCK(ptr))
+		return sizeof(struct raw_header);
+	if ((block = BLOCK_HEADER_OF(ptr)) == NULL)
+		return 0;
+	// An out of line header is counted too
+	return BLOCK_SIZE(0, block->head_rz, block->foot_rz) + block->offset + sizeof(struct block_header) - BLOCK_INLINE_HEADER;
+}
+
+
+
+
+/*
+ *	Describe a tracked block, its shard or bucket lock must be held
+ */
+static void fill_block_info (	struct	mmwl_block_info *	info,		// Filled description
+				struct	block_header *		block )		// Described block
+{
+	info->addr	= USER_OF(block);
+	info->size	= block->size;
+	info->filename	= SITE_OF(block)->filename;
+	info->func_name	= SITE_OF(block)->func_name;
+	info->line_num	= SITE_OF(block)->line_num;
+	info->stack_id	= block->stack_id;
+	info->corrupted	= !CHECK_SIGN(block);
+}
+
+
+
+
+/*
+ *	Copy the blocks of a shard into the live set
+ *	The shard is unlocked every MMWL_CAPTURE_BATCH blocks, its cursor keeps the position meanwhile.
+ */
+static void capture_shard (	struct	mmwl_instance *		inst,		// Shard to be captured
+				struct	mmwl_live_set *		set,		// Live set being filled
+					size_t			capacity )	// Number of entries in set->blocks[]
+{
+	struct list_head * iter = NULL;
+	unsigned int batch = 0;
+	unsigned long flags = 0;
+
+	MMWL_MUTEX_LOCK(&inst->lock, flags);
+	list_add(&inst->cursor, &inst->head);
+	while (inst->cursor.next != &inst->head)
+	{
+		for (batch = 0 ; batch < MMWL_CAPTURE_BATCH && inst->cursor.next != &inst->head ; batch++)
+		{
+			struct block_header * block = NULL;
+			struct mmwl_block_info * info = NULL;
+
+			iter = inst->cursor.next;
+			list_del(&inst->cursor);			// Move the cursor past the block
+			list_add(&inst->cursor, iter);
+			if (IS_CURSOR(inst, iter))
+				continue;				// Scanner cursor
+			if (set->count >= capacity)
+			{
+				set->missed++;
+				continue;
+			}
+			block = list_entry(iter, struct block_header, head);
+			info = &set->blocks[set->count++];
+			fill_block_info(info, block);
+		}
+		// Let the allocating threads in before the next batch
+		MMWL_MUTEX_UNLOCK(&inst->lock, flags);
+		MMWL_MUTEX_LOCK(&inst->lock, flags);
+	}
+	list_del(&inst->cursor);
+	MMWL_MUTEX_UNLOCK(&inst->lock, flags);
+}
+
+
+
+
+/*
+ *	Capture the list of allocated blocks
+ *	No lock is held for more than MMWL_CAPTURE_BATCH blocks, so allocations go on during the
+ *	capture. Returns NULL on allocation failure, the set must be released by mmwl_live_release.
+ */
+struct mmwl_live_set * mmwl_live_capture (void)
+{
+	struct mmwl_live_set * set = NULL;
+	unsigned long long live = 0;
+	size_t capacity = 0;
+	int i = 0;
+	unsigned long flags = 0;
+
+	for (i = 0 ; i < MMWL_SHARD_COUNT ; i++)
+	{
+		struct mmwl_instance * inst = &mmwl_gbl_inst[i];
+		MMWL_MUTEX_LOCK(&inst->lock, flags);
+		live += inst->alloc_count - inst->free_count;
+		MMWL_MUTEX_UNLOCK(&inst->lock, flags);
+	}
+
+	// Leave room for blocks allocated while capturing
+	capacity = live + live/8 + 64;
+	set = MMWL_INTERNAL_ALLOC(sizeof(struct mmwl_live_set) + capacity * sizeof(struct mmwl_block_info));
+	if (set == NULL)
+		return NULL;
+	set->count = 0;
+	set->missed = 0;
+
+	MMWL_SLEEP_LOCK(&mmwl_capture_lock);
+	for (i = 0 ; i < MMWL_SHARD_COUNT ; i++)
+		capture_shard(&mmwl_gbl_inst[i], set, capacity);
+	MMWL_SLEEP_UNLOCK(&mmwl_capture_lock);
+	return set;
+}
+
+
+
+
+/*
+ *	Release a live set returned by mmwl_live_capture
+ */
+void mmwl_live_release (struct mmwl_live_set * set)
+{
+	MMWL_INTERNAL_FREE(set);
+}
+
+
+
+
+/*
+ *	Start a new generation of blocks
+ *	Blocks remember the generation they were allocated in, so a snapshot costs no copy. Returns
+ *	the snapshot handle, the blocks allocated after this call have a generation >= the handle.
+ */
+unsigned int mmwl_snapshot (void)
+{
+	unsigned int generation = 0;
+
+	MMWL_SLEEP_LOCK(&mmwl_capture_lock);
+	generation = mmwl_generation + 1;
+	MMWL_STORE_RELEASE(&mmwl_generation, generation);
+	MMWL_SLEEP_UNLOCK(&mmwl_capture_lock);
+	return generation;
+}
+
+
+
+
+/*
+ *	Sum the blocks of a shard allocated in generations [from, to) by call site
+ *	The shard is unlocked every MMWL_CAPTURE_BATCH blocks, like for a capture.
+ */
+static void diff_shard (	struct	mmwl_instance *		inst,		// Shard to be walked
+					unsigned int		from,		// First generation counted
+					unsigned int		to,		// First generation not counted, 0 for none
+					unsigned long long *	counts,		// Estimated blocks by site, in 1/MMWL_EST_SCALE
+					unsigned long long *	sizes )		// Estimated bytes by site
+{
+	struct list_head * iter = NULL;
+	unsigned int batch = 0;
+	unsigned long flags = 0;
+
+	MMWL_MUTEX_LOCK(&inst->lock, flags);
+	list_add(&inst->cursor, &inst->head);
+	while (inst->cursor.next != &inst->head)
+	{
+		for (batch = 0 ; batch < MMWL_CAPTURE_BATCH && inst->cursor.next != &inst->head ; batch++)
+		{
+			struct block_header * block = NULL;
+			unsigned int site = 0;
+
+			iter = inst->cursor.next;
+			list_del(&inst->cursor);			// Move the cursor past the block
+			list_add(&inst->cursor, iter);
+			if (IS_CURSOR(inst, iter))
+				continue;				// Scanner cursor
+			block = list_entry(iter, struct block_header, head);
+			if (block->generation < from || (to != 0 && block->generation >= to))
+				continue;
+			site = block->site_id & (MMWL_MAX_SITES-1);
+			counts[site] += block_est_count(block);
+			sizes[site] += block_est_size(block);
+		}
+		// Let the allocating threads in before the next batch
+		MMWL_MUTEX_UNLOCK(&inst->lock, flags);
+		MMWL_MUTEX_LOCK(&inst->lock, flags);
+	}
+	list_del(&inst->cursor);
+	MMWL_MUTEX_UNLOCK(&inst->lock, flags);
+}
+
+
+
+
+/*
+ *	Print the blocks allocated after snapshot a and before snapshot b which are still allocated
+ *	b is 0 to count the blocks allocated up to now, a is 0 to count from the start. Blocks freed
+ *	after b are not seen, call it as soon as b is taken. Blocks are grouped by call site, largest
+ *	first. Needs MMWL_LEVEL_LIST, returns the estimated number of blocks, or -1.
+ */
+long mmwl_diff (unsigned int a, unsigned int b)
+{
+	unsigned long long * counts = NULL;
+	unsigned long long * sizes = NULL;
+	unsigned long long total_count = 0, total_size = 0;
+	unsigned int top[MMWL_DIFF_TOP_SITES];
+	unsigned int count = 0;
+	unsigned int sites = 0;
+	unsigned int site_count = MMWL_LOAD_ACQUIRE(&mmwl_site_count);
+	unsigned int id = 0;
+	unsigned int i = 0;
+
+	if (MMWL_LEVEL < MMWL_LEVEL_LIST)
+	{
+		MMWL_LOG_ERROR("diff: list of allocations is not kept at this MMWL_LEVEL");
+		return -1;
+	}
+	if ((counts = MMWL_INTERNAL_ALLOC(2 * MMWL_MAX_SITES * sizeof(*counts))) == NULL)
+	{
+		MMWL_LOG_ERROR("diff: no memory");
+		return -1;
+	}
+	memset(counts, 0, 2 * MMWL_MAX_SITES * sizeof(*counts));
+	sizes = counts + MMWL_MAX_SITES;
+
+	MMWL_SLEEP_LOCK(&mmwl_capture_lock);
+	for (i = 0 ; i < MMWL_SHARD_COUNT ; i++)
+		diff_shard(&mmwl_gbl_inst[i], a, b, counts, sizes);
+	MMWL_SLEEP_UNLOCK(&mmwl_capture_lock);
+
+	// Keep the sites holding the most bytes, descending
+	for (id = 0 ; id < site_count ; id++)
+	{
+		total_count += counts[id];
+		total_size += sizes[id];
+		sites += counts[id] != 0;
+		if (counts[id] == 0 || (count == MMWL_DIFF_TOP_SITES && sizes[id] <= sizes[top[count-1]]))
+			continue;
+		if (count < MMWL_DIFF_TOP_SITES)
+			count++;
+		for (i = count-1 ; i > 0 && sizes[top[i-1]] < sizes[id] ; i--)
+			top[i] = top[i-1];
+		top[i] = id;
+	}
+
+	MMWL_LOG_INFO("*** mmwl diff START ***");
+	if (b != 0)
+		MMWL_LOG_INFO("blocks allocated between snapshots %u and %u still allocated", a, b);
+	else
+		MMWL_LOG_INFO("blocks allocated since snapshot %u still allocated", a);
+	MMWL_LOG_INFO("total size              : %llu", total_size);
+	MMWL_LOG_INFO("total count             : %llu", total_count / MMWL_EST_SCALE);
+	if (READ_SAMPLE_SHIFT() != 0)
+		MMWL_LOG_INFO("sizes are estimated, sample rate 1 in %lu bytes", 1UL << READ_SAMPLE_SHIFT());
+	for (i = 0 ; i < count ; i++)
+	{
+		struct mmwl_site * site = &mmwl_sites[top[i]];
+		MMWL_LOG_INFO("\tsize:%llu count:%llu @%s:%u in %s"
+				, sizes[top[i]]
+				, counts[top[i]] / MMWL_EST_SCALE
+				, site->func_name
+				, site->line_num
+				, site->filename);
+	}
+	if (sites > count)
+		MMWL_LOG_INFO("\t%u other sites not listed", sites - count);
+	MMWL_LOG_INFO("*** mmwl diff END ***");
+	MMWL_INTERNAL_FREE(counts);
+	return (long)(total_count / MMWL_EST_SCALE);
+}
+
+
+
+
+// Is ptr inside the user block, a block of size 0 holds its own address only
+#define BLOCK_CONTAINS(block, ptr)	((void*)(ptr) >= USER_OF(block) &&					\
+					 ((void*)(ptr) < USER_OF(block) + (block)->size || (void*)(ptr) == USER_OF(block)))
+
+/*
+ *	Find the allocated block holding ptr, which may point inside the block
+ *	With MMWL_META_OOL the granules below ptr are searched in the metadata table, down to the
+ *	largest block size. Otherwise the lists of the shards are walked, so only the tracked blocks
+ *	are found and MMWL_LEVEL_LIST is needed. Returns 0 and fills info if found, -1 otherwise.
+ */
+int mmwl_lookup (	void *			ptr,		// Any pointer
+		struct	mmwl_block_info *	info )		// Description of the owning block
+{
+#ifdef MMWL_META_OOL
+	size_t max_size = MMWL_LOAD_ACQUIRE(&mmwl_meta_max_size);
+	unsigned long low = (unsigned long)ptr > max_size ? META_GRANULE((void*)ptr - max_size) : 0;
+	unsigned long granule = META_GRANULE(ptr);
+
+	for ( ; ; granule--)
+	{
+		unsigned int bucket = META_BUCKET(granule);
+		struct block_header * block = NULL;
+		struct block_header * nearest = NULL;
+		int found = 0;
+		unsigned long flags = 0;
+
+		MMWL_MUTEX_LOCK(META_LOCK(bucket), flags);
+		for (block = mmwl_meta_table[bucket] ; block != NULL ; block = block->meta_next)
+		{
+			if (META_GRANULE(USER_OF(block)) != granule || USER_OF(block) > ptr)
+				continue;				// Other granule of the bucket, or above ptr
+			if (nearest == NULL || USER_OF(block) > USER_OF(nearest))
+				nearest = block;
+		}
+		// Blocks do not overlap, the nearest block below ptr decides
+		if (nearest != NULL && BLOCK_CONTAINS(nearest, ptr) && !(nearest->flags & BLOCK_FLAG_FREED))
+		{
+			fill_block_info(info, nearest);
+			found = 1;
+		}
+		MMWL_MUTEX_UNLOCK(META_LOCK(bucket), flags);
+		if (nearest != NULL)
+			return found ? 0 : -1;
+		if (granule == low)
+			return -1;
+	}
+#else
+	int i = 0;
+	unsigned long flags = 0;
+
+	if (MMWL_LEVEL < MMWL_LEVEL_LIST)
+		return -1;
+
+	for (i = 0 ; i < MMWL_SHARD_COUNT ; i++)
+	{
+		struct mmwl_instance * inst = &mmwl_gbl_inst[i];
+		struct list_head * iter = NULL;
+
+		MMWL_MUTEX_LOCK(&inst->lock, flags);
+		for (iter = inst->head.next ; iter != &inst->head ; iter = iter->next)
+		{
+			struct block_header * block = list_entry(iter, struct block_header, head);
+
+			if (IS_CURSOR(inst, iter) || !BLOCK_CONTAINS(block, ptr))
+				continue;
+			fill_block_info(info, block);
+			MMWL_MUTEX_UNLOCK(&inst->lock, flags);
+			return 0;
+		}
+		MMWL_MUTEX_UNLOCK(&inst->lock, flags);
+	}
+	return -1;
+#endif
+}
+
+
+
+
+/*
+ *	Print the symbolized stacks of the allocated blocks, grouped by stack id
+ */
+static void print_stacks (void)
+{
+	unsigned int stack_count = MMWL_LOAD_ACQUIRE(&mmwl_stack_count);
+	unsigned int id = 0;
+
+	if (stack_count <= 1)
+		return;
+
+	site_flush();								// Totals include the shard caches
+	MMWL_LOG_INFO("stacks of allocations   :");
+	for (id = 1 ; id < stack_count ; id++)
+	{
+		struct mmwl_stack * stack = &mmwl_stacks[id];
+
+		if (MMWL_COUNTER_READ(&stack->live_count) == 0)
+			continue;
+		MMWL_LOG_INFO("\tstack:%u live size:%llu live count:%llu"
+				, id
+				, MMWL_COUNTER_READ(&stack->live_size)
+				, MMWL_COUNTER_READ(&stack->live_count));
+		print_stack_frames(id);
+	}
+}
+
+
+
+
+/*
+ *	Sum the counters of all the shards into total, which must be zeroed
+ */
+static void merge_shards (struct mmwl_instance * total)
+{
+	int i = 0;
+	unsigned long flags = 0;
+
+	for (i = 0 ; i < MMWL_SHARD_COUNT ; i++)
+	{
+		struct mmwl_instance * inst = &mmwl_gbl_inst[i];
+		MMWL_MUTEX_LOCK(&inst->lock, flags);
+		total->alloc_count	+= inst->alloc_count;
+		total->free_count	+= inst->free_count;
+		total->alloc_size	+= inst->alloc_size;
+		total->free_size	+= inst->free_size;
+		total->est_alloc_count	+= inst->est_alloc_count;
+		total->est_free_count	+= inst->est_free_count;
+		total->est_alloc_size	+= inst->est_alloc_size;
+		total->est_free_size	+= inst->est_free_size;
+		MMWL_MUTEX_UNLOCK(&inst->lock, flags);
+	}
+}
+
+
+
+
+/*
+ *	Print current status of allocation tracking list
+ */
+void mmwl_status (void)
+{
+	struct mmwl_instance total = { .alloc_count = 0 };
+	struct mmwl_live_set * set = NULL;
+	size_t n = 0;
+
+	merge_shards(&total);
+
+	MMWL_LOG_INFO("*** mmwl statistics START ***");
+	MMWL_LOG_INFO("total alloc count       : %llu", total.alloc_count);
+	MMWL_LOG_INFO("total free count        : %llu", total.free_count);
+	MMWL_LOG_INFO("total size allocated    : %llu", total.alloc_size);
+	MMWL_LOG_INFO("total size freed        : %llu", total.free_size);
+	MMWL_LOG_INFO("current allocated size  : %llu", total.alloc_size-total.free_size);
+	MMWL_LOG_INFO("current alloc count     : %llu", total.alloc_count-total.free_count);
+	if (QUARANTINE_ON())
+		MMWL_LOG_INFO("quarantined size        : %lu", (unsigned long)MMWL_LOAD_ACQUIRE(&mmwl_quarantine_bytes));
+	if (total.est_alloc_size != total.alloc_size || READ_SAMPLE_SHIFT() != 0)
+	{
+		// Counters above are of the sampled blocks only
+		MMWL_LOG_INFO("sample rate             : 1 in %lu bytes", 1UL << READ_SAMPLE_SHIFT());
+		MMWL_LOG_INFO("estimated alloc count   : %llu", total.est_alloc_count / MMWL_EST_SCALE);
+		MMWL_LOG_INFO("estimated free count    : %llu", total.est_free_count / MMWL_EST_SCALE);
+		MMWL_LOG_INFO("estimated size allocated: %llu", total.est_alloc_size);
+		MMWL_LOG_INFO("estimated size freed    : %llu", total.est_free_size);
+		MMWL_LOG_INFO("estimated current size  : %llu", total.est_alloc_size-total.est_free_size);
+		MMWL_LOG_INFO("estimated current count : %llu", (total.est_alloc_count-total.est_free_count) / MMWL_EST_SCALE);
+	}
+
+	// Print list of allocated blocks if list is not empty
+	if(total.alloc_count == total.free_count)
+	{
+		MMWL_LOG_INFO("list of allocations is empty");
+	}
+	else if (MMWL_LEVEL < MMWL_LEVEL_LIST)
+	{
+		MMWL_LOG_INFO("list of allocations is not kept at this MMWL_LEVEL");
+	}
+	else if ((set = mmwl_live_capture()) == NULL)
+	{
+		MMWL_LOG_ERROR("no memory to capture the list of allocations");
+	}
+	else
+	{
+		// The set is a copy, printing it does not hold any lock
+		MMWL_LOG_INFO("list of allocations     :");
+		for (n = 0 ; n < set->count ; n++)
+		{
+			struct mmwl_block_info * info = &set->blocks[n];
+			if(info->corrupted)
+			{
+				MMWL_LOG_ERROR("\taddr:%p size:%lu stack:%u block origin @%s:%u in %s <signature mismatch>"
+						, info->addr
+						, info->size
+						, info->stack_id
+						, info->func_name
+						, info->line_num
+						, info->filename);
+			}
+			else
+			{
+				MMWL_LOG_INFO ("\taddr:%p size:%lu stack:%u block origin @%s:%u in %s"
+						, info->addr
+						, info->size
+						, info->stack_id
+						, info->func_name
+						, info->line_num
+						, info->filename);
+			}
+		}
+		if (set->missed)
+			MMWL_LOG_INFO("\t%lu blocks allocated during the capture not listed", set->missed);
+		mmwl_live_release(set);
+		print_stacks();
+	}
+	MMWL_LOG_INFO("*** mmwl statistics END ***");
+}
+
+
+
+
+/*
+ *	Fill top[] with the ids of the top_n sites holding the most memory, returns their number
+ *	Sites are read without lock, so allocating threads are not disturbed.
+ */
+static unsigned int top_sites (	unsigned int *		top,		// Site ids, by live size descending
+				unsigned int		top_n,		// Size of top[]
+				unsigned int		site_count )	// Sites registered
+{
+	unsigned int count = 0;
+	unsigned int id = 0;
+	unsigned int i = 0;
+
+	// Keep the top_n sites sorted by live size, descending
+	for (id = 0 ; id < site_count ; id++)
+	{
+		unsigned long long live = MMWL_COUNTER_READ(&mmwl_sites[id].live_size);
+		if (MMWL_COUNTER_READ(&mmwl_sites[id].live_count) == 0)
+			continue;
+		if (count == top_n && (count == 0 || live <= MMWL_COUNTER_READ(&mmwl_sites[top[count-1]].live_size)))
+			continue;
+		if (count < top_n)
+			count++;
+		for (i = count-1 ; i > 0 && MMWL_COUNTER_READ(&mmwl_sites[top[i-1]].live_size) < live ; i--)
+			top[i] = top[i-1];
+		top[i] = id;
+	}
+	return count;
+}
+
+
+
+
+/*
+ *	Print the call sites holding the most allocated memory
+ */
+void mmwl_status_sites (unsigned int top_n)
+{
+	unsigned int top[MMWL_MAX_TOP_SITES];
+	unsigned int count = 0;
+	unsigned int site_count = MMWL_LOAD_ACQUIRE(&mmwl_site_count);
+	unsigned int i = 0;
+
+	if (top_n > MMWL_MAX_TOP_SITES)
+		top_n = MMWL_MAX_TOP_SITES;
+	site_flush();								// Totals include the shard caches
+	count = top_sites(top, top_n, site_count);
+
+	MMWL_LOG_INFO("*** mmwl call sites START ***");
+	MMWL_LOG_INFO("call sites registered   : %u", site_count);
+	if (READ_SAMPLE_SHIFT() != 0)
+		MMWL_LOG_INFO("sizes are estimated, sample rate 1 in %lu bytes", 1UL << READ_SAMPLE_SHIFT());
+	if (count == 0)
+	{
+		MMWL_LOG_INFO("no call site holds allocated memory");
+	}
+	for (i = 0 ; i < count ; i++)
+	{
+		struct mmwl_site * site = &mmwl_sites[top[i]];
+		MMWL_LOG_INFO("\tlive size:%llu live count:%llu peak size:%llu allocs:%llu frees:%llu @%s:%u in %s"
+				, MMWL_COUNTER_READ(&site->live_size)
+				, MMWL_COUNTER_READ(&site->live_count)
+				, MMWL_COUNTER_READ(&site->peak_size)
+				, MMWL_COUNTER_READ(&site->alloc_count)
+				, MMWL_COUNTER_READ(&site->free_count)
+				, site->func_name
+				, site->line_num
+				, site->filename);
+	}
+	MMWL_LOG_INFO("*** mmwl call sites END ***");
+}
+
+
+
+
+/*
+ *	Returns the class holding the median of a histogram
+ */
+static unsigned int hist_median (unsigned long long * hist, unsigned int classes)
+{
+	unsigned long long total = 0, sum = 0;
+	unsigned int c = 0;
+
+	for (c = 0 ; c < classes ; c++)
+		total += hist[c];
+	for (c = 0 ; c < classes ; c++)
+		if ((sum += hist[c]) * 2 >= total)
+			break;
+	return c < classes ? c : classes - 1;
+}
+
+
+
+
+// Printf arguments of the bound of a histogram class: "<" and unit*2^c, or ">=" and unit*2^(c-1) for the last class
+#define CLASS_BOUND(c, classes, unit)	((c) == (classes)-1 ? ">=" : "<"), ((c) == (classes)-1 ? (unit) << ((c)-1) : (unit) << (c))
+
+/*
+ *	Print the non empty classes of a histogram, one per line
+ *	Class c holds the values in [2^(c-1), 2^c), class 0 the values below 1.
+ */
+static void print_histogram (		unsigned long long *	hist,		// Counts by log2 class
+					unsigned int		classes,	// Number of classes
+					unsigned long long	unit,		// Value of a class unit
+				const	char *			unit_name )	// Name of the printed unit
+{
+	unsigned int c = 0;
+
+	for (c = 0 ; c < classes ; c++)
+	{
+		if (hist[c] == 0)
+			continue;
+		MMWL_LOG_INFO("\t%-2s %-12llu %-5s : %llu", CLASS_BOUND(c, classes, unit), unit_name, hist[c]);
+	}
+}
+
+
+
+
+/*
+ *	Format the non empty classes of a histogram on one line as upper_bound:count
+ */
+static void format_histogram (		char *			buf,		// Output buffer
+					size_t			len,		// Size of buf
+					unsigned long long *	hist,		// Counts by log2 class
+					unsigned int		classes,	// Number of classes
+					unsigned long long	unit )		// Value of a class unit
+{
+	unsigned int c = 0;
+	size_t used = 0;
+
+	buf[0] = '\0';
+	for (c = 0 ; c < classes && used < len ; c++)
+	{
+		if (hist[c] == 0)
+			continue;
+		used += snprintf(buf + used, len - used, " %s%llu:%llu", CLASS_BOUND(c, classes, unit), hist[c]);
+	}
+}
+
+
+
+
+/*
+ *	Print the size class and lifetime histograms, globally and for the top_n sites with the most frees
+ *	Sites freeing many short lived small blocks are good candidates for a pool or an arena.
+ */
+void mmwl_histograms (unsigned int top_n)
+{
+	unsigned long long size_hist[MMWL_SIZE_CLASSES] = { 0 };
+	unsigned long long life_hist[MMWL_LIFE_CLASSES] = { 0 };
+	unsigned int top[MMWL_MAX_TOP_HIST];
+	unsigned int count = 0;
+	unsigned int site_count = MMWL_LOAD_ACQUIRE(&mmwl_site_count);
+	unsigned int id = 0;
+	unsigned int c = 0;
+	unsigned int i = 0;
+	unsigned int size_median = 0;
+	unsigned int life_median = 0;
+	unsigned long long life_unit = life_unit_ns();
+	char line[512];
+	unsigned long flags = 0;
+
+	site_flush();								// Totals include the shard caches
+	if (top_n > MMWL_MAX_TOP_HIST)
+		top_n = MMWL_MAX_TOP_HIST;
+
+	// Merge histograms of all the shards
+	for (i = 0 ; i < MMWL_SHARD_COUNT ; i++)
+	{
+		struct mmwl_instance * inst = &mmwl_gbl_inst[i];
+		MMWL_MUTEX_LOCK(&inst->lock, flags);
+		for (c = 0 ; c < MMWL_SIZE_CLASSES ; c++)
+			size_hist[c] += inst->size_hist[c];
+		for (c = 0 ; c < MMWL_LIFE_CLASSES ; c++)
+			life_hist[c] += inst->life_hist[c];
+		MMWL_MUTEX_UNLOCK(&inst->lock, flags);
+	}
+
+	// Keep the top_n sites sorted by free count, descending
+	for (id = 0 ; id < site_count ; id++)
+	{
+		unsigned long long frees = MMWL_COUNTER_READ(&mmwl_sites[id].free_count);
+		if (frees == 0)
+			continue;
+		if (count == top_n && (count == 0 || frees <= MMWL_COUNTER_READ(&mmwl_sites[top[count-1]].free_count)))
+			continue;
+		if (count < top_n)
+			count++;
+		for (i = count-1 ; i > 0 && MMWL_COUNTER_READ(&mmwl_sites[top[i-1]].free_count) < frees ; i--)
+			top[i] = top[i-1];
+		top[i] = id;
+	}
+
+	MMWL_LOG_INFO("*** mmwl histograms START ***");
+	if (READ_SAMPLE_SHIFT() != 0)
+		MMWL_LOG_INFO("histograms are of the sampled blocks, sample rate 1 in %lu bytes", 1UL << READ_SAMPLE_SHIFT());
+	MMWL_LOG_INFO("allocations by size     :");
+	print_histogram(size_hist, MMWL_SIZE_CLASSES, 1, "bytes");
+	if (MMWL_LEVEL < MMWL_LEVEL_LIST)
+	{
+		MMWL_LOG_INFO("lifetimes & call site histograms are not kept at this MMWL_LEVEL");
+		MMWL_LOG_INFO("*** mmwl histograms END ***");
+		return;
+	}
+	MMWL_LOG_INFO("frees by lifetime       :");
+	print_histogram(life_hist, MMWL_LIFE_CLASSES, life_unit, "ns");
+	if (count == 0)
+	{
+		MMWL_LOG_INFO("no call site has freed blocks");
+	}
+	for (i = 0 ; i < count ; i++)
+	{
+		struct mmwl_site * site = &mmwl_sites[top[i]];
+
+		// Site counters are updated lock free, take a copy
+		for (c = 0 ; c < MMWL_SIZE_CLASSES ; c++)
+			size_hist[c] = MMWL_COUNTER_READ(&site->size_hist[c]);
+		for (c = 0 ; c < MMWL_LIFE_CLASSES ; c++)
+			life_hist[c] = MMWL_COUNTER_READ(&site->life_hist[c]);
+		size_median = hist_median(size_hist, MMWL_SIZE_CLASSES);
+		life_median = hist_median(life_hist, MMWL_LIFE_CLASSES);
+		MMWL_LOG_INFO("\tallocs:%llu frees:%llu median size:%s%llu bytes median lifetime:%s%llu ns @%s:%u in %s"
+				, MMWL_COUNTER_READ(&site->alloc_count)
+				, MMWL_COUNTER_READ(&site->free_count)
+				, CLASS_BOUND(size_median, MMWL_SIZE_CLASSES, 1ULL)
+				, CLASS_BOUND(life_median, MMWL_LIFE_CLASSES, life_unit)
+				, site->func_name
+				, site->line_num
+				, site->filename);
+		format_histogram(line, sizeof(line), size_hist, MMWL_SIZE_CLASSES, 1);
+		MMWL_LOG_INFO("\t\tbytes   :%s", line);
+		format_histogram(line, sizeof(line), life_hist, MMWL_LIFE_CLASSES, life_unit);
+		MMWL_LOG_INFO("\t\tlifetime:%s", line);
+	}
+	MMWL_LOG_INFO("*** mmwl histograms END ***");
+}
+
+
+
+
+#ifndef __KERNEL__
+/*
+ *	Leak check
+ *	Live blocks are marked by a conservative scan: every aligned word of the roots (writable segments of
+ *	the loaded objects, stacks of the registered threads, registers of the caller) and of the marked
+ *	blocks which points inside a live block marks it. Unmarked blocks are leaked; a leaked block which
+ *	no other leaked block points to is a direct leak and owns the indirect leaks reachable from it.
+ */
+#define LEAK_UNMARKED		0			// Not reached yet
+#define LEAK_REACHABLE		1			// Reachable from the roots
+#define LEAK_REFERENCED		2			// Leaked, pointed to by another leaked block
+#define LEAK_INDIRECT		3			// Leaked, owned by a direct leak
+#define LEAK_DIRECT		4			// Leaked, owns the indirect leaks reachable from it
+
+struct leak_entry {
+	unsigned long		start;			// Address of the user block
+	unsigned long		end;			// End of the user block
+	size_t			size;			// Size of the user block
+	unsigned int		site_id;		// Call site of the block
+	unsigned int		stack_id;		// Allocation stack of the block
+	unsigned int		state;			// LEAK_*
+	unsigned int		count;			// Direct leaks grouped in this entry once reported
+	unsigned long long	indirect_size;		// Bytes of the indirect leaks owned by a direct leak
+	unsigned long long	indirect_count;		// Number of the indirect leaks owned by a direct leak
+};
+
+struct leak_range {
+	unsigned long		start;			// First byte of the range
+	unsigned long		end;			// End of the range
+};
+
+struct leak_check {
+	struct	leak_entry *	index;			// Live blocks sorted by address
+		size_t		count;			// Number of live blocks
+		size_t		capacity;		// Number of entries in index[] and work[]
+		unsigned long	lo;			// Lowest address of a live block
+		unsigned long	hi;			// End of the highest live block
+		size_t *	work;			// Marked blocks whose contents are not scanned yet
+		size_t		work_len;		// Number of entries in work[]
+	struct	leak_range	roots[MMWL_MAX_ROOTS];	// Segments and stacks to be scanned
+		unsigned int	nr_roots;		// Number of entries in roots[]
+		unsigned long long root_bytes;		// Bytes of the roots
+};
+
+
+
+
+/*
+ *	Adds a root range, the part of a stack below its lowest mapped page is left out
+ */
+static void leak_add_root (	struct	leak_check *	check,		// Leak check state
+					unsigned long	start,		// First byte of the range
+					unsigned long	end,		// End of the range
+					int		stack )		// Non zero for a stack, which may be partly mapped
+{
+	unsigned long page = (unsigned long)sysconf(_SC_PAGESIZE);
+	unsigned char vec = 0;
+
+	if (stack)
+	{
+		// The main thread stack grows on demand, mincore fails on its unmapped pages
+		start &= ~(page - 1);
+		while (start < end && mincore((void *)start, page, &vec) != 0)
+			start += page;
+	}
+	if (start >= end || check->nr_roots >= MMWL_MAX_ROOTS)
+		return;
+	check->roots[check->nr_roots].start = start;
+	check->roots[check->nr_roots].end = end;
+	check->nr_roots++;
+	check->root_bytes += end - start;
+}
+
+
+
+
+/*
+ *	dl_iterate_phdr callback, adds the writable segments of a loaded object
+ */
+static int leak_add_segments (struct dl_phdr_info * info, size_t size, void * arg)
+{
+	int i = 0;
+
+	(void)size;
+	for (i = 0 ; i < info->dlpi_phnum ; i++)
+	{
+		const ElfW(Phdr) * phdr = &info->dlpi_phdr[i];
+		if (phdr->p_type == PT_LOAD && (phdr->p_flags & PF_W))
+			leak_add_root(arg, info->dlpi_addr + phdr->p_vaddr,
+					info->dlpi_addr + phdr->p_vaddr + phdr->p_memsz, 0);
+	}
+	return 0;
+}
+
+
+
+
+/*
+ *	Returns the live block holding an address, NULL if none
+ */
+static inline struct leak_entry * leak_lookup (struct leak_check * check, unsigned long addr)
+{
+	size_t lo = 0, hi = check->count, mid = 0;
+	struct leak_entry * entry = NULL;
+
+	if (addr < check->lo || addr >= check->hi)
+		return NULL;
+	while (lo < hi)
+	{
+		mid = lo + (hi - lo) / 2;
+		if (check->index[mid].start <= addr)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	if (lo == 0)
+		return NULL;
+	entry = &check->index[lo - 1];
+	return (addr < entry->end || addr == entry->start) ? entry : NULL;
+}
+
+
+
+
+/*
+ *	Scan a range for pointers to live blocks, the blocks found in state 'from' move to state 'to'
+ *	and are queued for scanning. Indirect leaks are accounted to their owner.
+ */
+static void leak_scan (	struct	leak_check *	check,		// Leak check state
+				unsigned long	start,		// First byte of the range
+				unsigned long	end,		// End of the range
+				unsigned int	from,		// State of the blocks to be marked
+				unsigned int	to,		// New state of the marked blocks
+			struct	leak_entry *	owner )		// Direct leak owning the marked blocks, or NULL
+{
+	unsigned long addr = (start + sizeof(void *) - 1) & ~(sizeof(void *) - 1);
+
+	for ( ; addr + sizeof(void *) <= end ; addr += sizeof(void *))
+	{
+		struct leak_entry * entry = leak_lookup(check, *(unsigned long *)addr);
+		if (entry == NULL || entry->state != from || entry == owner)
+			continue;
+		entry->state = to;
+		check->work[check->work_len++] = entry - check->index;
+		if (owner != NULL)
+		{
+			owner->indirect_size += entry->size;
+			owner->indirect_count++;
+		}
+	}
+}
+
+
+
+
+/*
+ *	Scan the contents of the queued blocks until the queue is empty
+ */
+static void leak_drain (	struct	leak_check *	check,		// Leak check state
+				unsigned int	from,		// State of the blocks to be marked
+				unsigned int	to,		// New state of the marked blocks
+			struct	leak_entry *	owner )		// Direct leak owning the marked blocks, or NULL
+{
+	while (check->work_len != 0)
+	{
+		struct leak_entry * entry = &check->index[check->work[--check->work_len]];
+		leak_scan(check, entry->start, entry->end, from, to, owner);
+	}
+}
+
+
+
+
+/*
+ *	Scan the stack of the calling thread from the current frame, with the registers spilled on it
+ */
+static __attribute__((noinline)) void leak_scan_caller (	struct	leak_check *	check,	// Leak check state
+								unsigned long	top )	// End of the stack
+{
+	jmp_buf regs;
+
+	setjmp(regs);							// Spill the registers on the stack
+	leak_scan(check, (unsigned long)&regs, top, LEAK_UNMARKED, LEAK_REACHABLE, NULL);
+}
+
+
+
+
+/*
+ *	Sort the index by address, in place as nothing may be allocated while the shards are locked
+ *	Quicksort recursing into the smaller side, the blocks of a shard are mostly in address order.
+ */
+static void leak_sort (struct leak_entry * index, size_t count)
+{
+	struct leak_entry tmp;
+	size_t i = 0, j = 0;
+
+	while (count > 16)
+	{
+		// Median of the first, middle and last entries as pivot, moved to the end
+		size_t mid = count / 2, last = count - 1;
+		if (index[mid].start < index[0].start)
+			tmp = index[mid], index[mid] = index[0], index[0] = tmp;
+		if (index[last].start < index[0].start)
+			tmp = index[last], index[last] = index[0], index[0] = tmp;
+		if (index[mid].start < index[last].start)
+			tmp = index[mid], index[mid] = index[last], index[last] = tmp;
+		for (i = 0, j = 0 ; j < last ; j++)
+		{
+			if (index[j].start < index[last].start)
+			{
+				tmp = index[i], index[i] = index[j], index[j] = tmp;
+				i++;
+			}
+		}
+		tmp = index[i], index[i] = index[last], index[last] = tmp;
+		if (i < count - i - 1)
+		{
+			leak_sort(index, i);
+			index += i + 1;
+			count -= i + 1;
+		}
+		else
+		{
+			leak_sort(index + i + 1, count - i - 1);
+			count = i;
+		}
+	}
+	// Insertion sort of the small ranges
+	for (i = 1 ; i < count ; i++)
+	{
+		tmp = index[i];
+		for (j = i ; j > 0 && index[j-1].start > tmp.start ; j--)
+			index[j] = index[j-1];
+		index[j] = tmp;
+	}
+}
+
+
+
+
+/*
+ *	Fill the index with the blocks of the locked shards, returns non zero if the index is too small
+ */
+static int leak_fill_index (struct leak_check * check)
+{
+	struct list_head * iter = NULL;
+	int i = 0;
+
+	check->count = 0;
+	for (i = 0 ; i < MMWL_SHARD_COUNT ; i++)
+	{
+		struct mmwl_instance * inst = &mmwl_gbl_inst[i];
+		for (iter = inst->head.next ; iter != &inst->head ; iter = iter->next)
+		{
+			struct block_header * block = list_entry(iter, struct block_header, head);
+			struct leak_entry * entry = NULL;
+
+			if (IS_CURSOR(inst, iter))
+				continue;
+			if (check->count == check->capacity)
+				return -1;
+			entry = &check->index[check->count];
+			entry->start		= (unsigned long)USER_OF(block);
+			entry->end		= entry->start + block->size;
+			entry->size		= block->size;
+			entry->site_id		= block->site_id;
+			entry->stack_id		= block->stack_id;
+			entry->state		= LEAK_UNMARKED;
+			entry->count		= 1;
+			entry->indirect_size	= 0;
+			entry->indirect_count	= 0;
+			check->count++;
+		}
+	}
+	return 0;
+}
+
+
+
+
+/*
+ *	Mark & classify the live blocks, all the shards and the thread registry must be locked
+ */
+static void leak_mark (struct leak_check * check, unsigned long caller_top)
+{
+	size_t n = 0;
+	unsigned int r = 0;
+
+	leak_sort(check->index, check->count);
+	check->lo = check->count ? check->index[0].start : 0;
+	check->hi = check->count ? check->index[check->count-1].end + 1 : 0;
+
+	// Blocks reachable from the roots
+	for (r = 0 ; r < check->nr_roots ; r++)
+		leak_scan(check, check->roots[r].start, check->roots[r].end, LEAK_UNMARKED, LEAK_REACHABLE, NULL);
+	leak_scan_caller(check, caller_top);
+	leak_drain(check, LEAK_UNMARKED, LEAK_REACHABLE, NULL);
+
+	// Leaked blocks pointed to by other leaked blocks
+	for (n = 0 ; n < check->count ; n++)
+	{
+		struct leak_entry * entry = &check->index[n];
+		if (entry->state == LEAK_UNMARKED || entry->state == LEAK_REFERENCED)
+			leak_scan(check, entry->start, entry->end, LEAK_UNMARKED, LEAK_REFERENCED, entry);	// Not self
+		check->work_len = 0;						// Every leaked block is visited anyway
+		entry->indirect_size = entry->indirect_count = 0;
+	}
+
+	// Direct leaks take the leaked blocks reachable from them, then the cycles nobody points to
+	for (r = 0 ; r < 2 ; r++)
+	{
+		for (n = 0 ; n < check->count ; n++)
+		{
+			struct leak_entry * entry = &check->index[n];
+			if (entry->state != (r == 0 ? LEAK_UNMARKED : LEAK_REFERENCED))
+				continue;
+			entry->state = LEAK_DIRECT;
+			leak_scan(check, entry->start, entry->end, LEAK_REFERENCED, LEAK_INDIRECT, entry);
+			leak_drain(check, LEAK_REFERENCED, LEAK_INDIRECT, entry);
+		}
+	}
+}
+
+
+
+
+// Orders the direct leaks by call site & stack
+static int leak_cmp_origin (const void * a, const void * b)
+{
+	const struct leak_entry * x = a, * y = b;
+	if (x->site_id != y->site_id)
+		return x->site_id < y->site_id ? -1 : 1;
+	if (x->stack_id != y->stack_id)
+		return x->stack_id < y->stack_id ? -1 : 1;
+	return 0;
+}
+
+// Orders the grouped direct leaks by total size, descending
+static int leak_cmp_size (const void * a, const void * b)
+{
+	const struct leak_entry * x = a, * y = b;
+	unsigned long long sx = x->size + x->indirect_size, sy = y->size + y->indirect_size;
+	return sx == sy ? 0 : (sx < sy ? 1 : -1);
+}
+
+
+
+
+/*
+ *	Print the blocks unreachable from the roots, the direct leaks are grouped by call site and stack
+ *	Pointers held only in memory mmwl does not track (untracked blocks, thread local storage) are not
+ *	seen, the blocks they point to are reported. Best called when the other threads are idle.
+ *	Returns the number of leaked blocks, -1 if the check could not be done.
+ */
+long mmwl_leak_check (void)
+{
+	struct leak_check * check = NULL;
+	unsigned long long direct_size = 0, indirect_size = 0;
+	size_t direct_count = 0, indirect_count = 0;
+	size_t groups = 0;
+	size_t capacity = 0;
+	size_t n = 0;
+	unsigned long caller_top = 0;
+	pthread_attr_t attr;
+	void * stack_addr = NULL;
+	size_t stack_size = 0;
+	int i = 0;
+	unsigned long flags = 0;
+	unsigned long shard_flags = 0;						// Shared by the shard locks, user side only
+
+	if (MMWL_LEVEL < MMWL_LEVEL_LIST)
+	{
+		MMWL_LOG_ERROR("leak check needs the list of allocations, not kept at this MMWL_LEVEL");
+		return -1;
+	}
+	if ((check = MMWL_INTERNAL_ALLOC(sizeof(*check))) == NULL)
+		return -1;
+	check->index = NULL;
+	check->work = NULL;
+	check->nr_roots = 0;
+	check->root_bytes = 0;
+
+	// Segments of the loaded objects, taken before any lock as the loader lock may wait for an allocation
+	dl_iterate_phdr(leak_add_segments, check);
+
+	// Stack of the caller, scanned from the current frame. It may allocate, so before the registry lock
+	// which a thread allocating for the first time takes.
+	if (pthread_getattr_np(pthread_self(), &attr) == 0)
+	{
+		pthread_attr_getstack(&attr, &stack_addr, &stack_size);
+		pthread_attr_destroy(&attr);
+		caller_top = (unsigned long)stack_addr + stack_size;
+	}
+
+	// Stacks of the other registered threads, an exiting thread waits for the registry lock
+	MMWL_MUTEX_LOCK(&mmwl_thread_lock, flags);
+	for (i = 0 ; i < MMWL_MAX_THREADS ; i++)
+	{
+		if (!mmwl_thread_used[i] || pthread_equal(mmwl_threads[i], pthread_self())
+				|| pthread_getattr_np(mmwl_threads[i], &attr) != 0)
+			continue;
+		pthread_attr_getstack(&attr, &stack_addr, &stack_size);
+		pthread_attr_destroy(&attr);
+		leak_add_root(check, (unsigned long)stack_addr, (unsigned long)stack_addr + stack_size, 1);
+	}
+
+	// Size the index from the counters, retry if blocks were allocated meanwhile
+	for (i = 0 ; i < MMWL_SHARD_COUNT ; i++)
+		capacity += MMWL_LOAD_ACQUIRE(&mmwl_gbl_inst[i].alloc_count) - MMWL_LOAD_ACQUIRE(&mmwl_gbl_inst[i].free_count);
+	for (;;)
+	{
+		capacity += capacity / 8 + 64;
+		check->capacity = capacity;
+		check->index = MMWL_INTERNAL_ALLOC(capacity * sizeof(struct leak_entry));
+		check->work = MMWL_INTERNAL_ALLOC(capacity * sizeof(size_t));
+		if (check->index == NULL || check->work == NULL)
+			break;
+		for (i = 0 ; i < MMWL_SHARD_COUNT ; i++)
+			MMWL_MUTEX_LOCK(&mmwl_gbl_inst[i].lock, shard_flags);
+		if (leak_fill_index(check) == 0)
+			break;						// Shards are left locked
+		for (i = 0 ; i < MMWL_SHARD_COUNT ; i++)
+			MMWL_MUTEX_UNLOCK(&mmwl_gbl_inst[i].lock, shard_flags);
+		MMWL_INTERNAL_FREE(check->index);
+		MMWL_INTERNAL_FREE(check->work);
+	}
+	if (check->index == NULL || check->work == NULL)
+	{
+		MMWL_MUTEX_UNLOCK(&mmwl_thread_lock, flags);
+		MMWL_LOG_ERROR("no memory for the leak check of %lu blocks", (unsigned long)capacity);
+		if (check->index != NULL)
+			MMWL_INTERNAL_FREE(check->index);
+		if (check->work != NULL)
+			MMWL_INTERNAL_FREE(check->work);
+		MMWL_INTERNAL_FREE(check);
+		return -1;
+	}
+
+	// Nothing may allocate until the shards are unlocked
+	check->work_len = 0;
+	leak_mark(check, caller_top);
+	for (i = 0 ; i < MMWL_SHARD_COUNT ; i++)
+		MMWL_MUTEX_UNLOCK(&mmwl_gbl_inst[i].lock, shard_flags);
+	MMWL_MUTEX_UNLOCK(&mmwl_thread_lock, flags);
+
+	// Group the direct leaks by origin at the start of the index
+	for (n = 0 ; n < check->count ; n++)
+	{
+		struct leak_entry * entry = &check->index[n];
+		if (entry->state == LEAK_INDIRECT)
+		{
+			indirect_size += entry->size;
+			indirect_count++;
+		}
+		if (entry->state != LEAK_DIRECT)
+			continue;
+		direct_size += entry->size;
+		direct_count++;
+		check->index[groups++] = *entry;
+	}
+	qsort(check->index, groups, sizeof(struct leak_entry), leak_cmp_origin);
+	for (n = 0, i = 0 ; n < groups ; n++)
+	{
+		struct leak_entry * group = i > 0 ? &check->index[i-1] : NULL;
+		if (group != NULL && leak_cmp_origin(group, &check->index[n]) == 0)
+		{
+			group->size		+= check->index[n].size;
+			group->count		+= check->index[n].count;
+			group->indirect_size	+= check->index[n].indirect_size;
+			group->indirect_count	+= check->index[n].indirect_count;
+			continue;
+		}
+		check->index[i++] = check->index[n];
+	}
+	groups = i;
+	qsort(check->index, groups, sizeof(struct leak_entry), leak_cmp_size);
+
+	MMWL_LOG_INFO("*** mmwl leak check START ***");
+	MMWL_LOG_INFO("roots scanned           : %u ranges, %llu bytes", check->nr_roots, check->root_bytes);
+	MMWL_LOG_INFO("live blocks             : %lu", (unsigned long)check->count);
+	MMWL_LOG_INFO("reachable blocks        : %lu", (unsigned long)(check->count - direct_count - indirect_count));
+	if (READ_SAMPLE_SHIFT() != 0)
+		MMWL_LOG_INFO("untracked blocks are not scanned with sampling on, leaks may be false");
+	if (mmwl_threads_missed != 0)
+		MMWL_LOG_INFO("stacks of %u threads are not scanned, leaks may be false", mmwl_threads_missed);
+	for (n = 0 ; n < groups ; n++)
+	{
+		struct leak_entry * group = &check->index[n];
+		struct mmwl_site * site = &mmwl_sites[group->site_id & (MMWL_MAX_SITES-1)];
+		MMWL_LOG_ERROR("direct leak of %lu bytes in %u blocks @%s:%u in %s"
+				, (unsigned long)group->size
+				, group->count
+				, site->func_name
+				, site->line_num
+				, site->filename);
+		if (group->indirect_count != 0)
+			MMWL_LOG_ERROR("\tindirect leak of %llu bytes in %llu blocks"
+					, group->indirect_size
+					, group->indirect_count);
+		if (group->stack_id != MMWL_STACK_NONE)
+			print_stack_frames(group->stack_id);
+	}
+	MMWL_LOG_INFO("leaked                  : %llu bytes in %lu blocks, %llu bytes in %lu blocks indirectly"
+			, direct_size, (unsigned long)direct_count, indirect_size, (unsigned long)indirect_count);
+	MMWL_LOG_INFO("*** mmwl leak check END ***");
+
+	MMWL_INTERNAL_FREE(check->index);
+	MMWL_INTERNAL_FREE(check->work);
+	MMWL_INTERNAL_FREE(check);
+	return (long)(direct_count + indirect_count);
+}
+#endif
+
+
+
+
+/*
+ *	Set the sample rate, on average one allocation is tracked per 'rate' bytes allocated
+ *	The rate is rounded down to a power of two, 0 or 1 tracks every allocation.
+ */
+void mmwl_set_sample_rate (size_t rate)
+{
+	unsigned int shift = 0;
+
+	while (shift < 8*sizeof(size_t)-2 && ((size_t)2 << shift) <= rate)
+		shift++;
+	MMWL_STORE_RELEASE(&mmwl_sample_shift, shift);
+}
+
+
+
+
+/*
+ *	Set the number of stack frames saved for every tracked allocation, 0 disables capture
+ */
+void mmwl_set_stack_depth (unsigned int depth)
+{
+	if (depth > STACK_DUMP_DEPTH)
+		depth = STACK_DUMP_DEPTH;
+	MMWL_STORE_RELEASE(&mmwl_stack_depth, depth);
+}
+
+
+
+
+/*
+ *	Set the number of bytes of freed blocks held in quarantine, 0 disables the quarantine
+ *	Blocks over the new budget are released at once. Quarantine needs MMWL_LEVEL_CANARIES.
+ */
+void mmwl_set_quarantine (size_t bytes)
+{
+	struct list_head batch = LIST_HEAD_INIT(batch);
+	size_t batch_bytes = 0;
+	int i = 0;
+	unsigned long flags = 0;
+
+	MMWL_STORE_RELEASE(&mmwl_quarantine_budget, MMWL_LEVEL >= MMWL_LEVEL_CANARIES ? bytes : 0);
+	if (bytes == 0)
+	{
+		// Take the blocks still gathered by the shards
+		for (i = 0 ; i < MMWL_SHARD_COUNT ; i++)
+		{
+			struct mmwl_instance * inst = &mmwl_gbl_inst[i];
+			MMWL_MUTEX_LOCK(&inst->lock, flags);
+			list_splice_tail_init(&inst->qbatch, &batch);
+			batch_bytes += inst->qbatch_bytes;
+			inst->qbatch_bytes = 0;
+			inst->qbatch_count = 0;
+			MMWL_MUTEX_UNLOCK(&inst->lock, flags);
+		}
+	}
+	quarantine_push(&batch, batch_bytes);
+}
+
+
+
+
+/*
+ *	Set the head and foot redzone sizes of new blocks, rounded up to 16 bytes
+ *	Blocks keep the redzones they were allocated with. Redzones are not used below MMWL_LEVEL_CANARIES.
+ */
+void mmwl_set_redzones (size_t head, size_t foot)
+{
+#if MMWL_LEVEL >= MMWL_LEVEL_CANARIES
+	if (head > MMWL_MAX_REDZONE)
+		head = MMWL_MAX_REDZONE;
+	if (foot > MMWL_MAX_REDZONE)
+		foot = MMWL_MAX_REDZONE;
+	head = (head + 15) & ~(size_t)15;
+	foot = (foot + 15) & ~(size_t)15;
+	MMWL_STORE_RELEASE(&mmwl_redzones, (unsigned int)(head << 16 | foot));
+#else
+	(void)head;
+	(void)foot;
+#endif
+}
+
+
+
+
+#ifndef __KERNEL__
+/*
+ *	Place one in 'rate' blocks of min_size to max_size bytes against a guard page, rate 0 for none
+ *	mode is MMWL_GUARD_OVERFLOW for a guard page right after the user block, MMWL_GUARD_UNDERFLOW
+ *	for one before the block header. The mode applies to the guarded sites too.
+ */
+void mmwl_set_guard (size_t min_size, size_t max_size, unsigned int rate, unsigned int mode)
+{
+	unsigned long flags = 0;
+
+	MMWL_MUTEX_LOCK(&mmwl_site_lock, flags);
+	mmwl_page_size = sysconf(_SC_PAGESIZE);
+	mmwl_guard_min = min_size;
+	mmwl_guard_max = max_size;
+	MMWL_STORE_RELEASE(&mmwl_guard_mode, mode == MMWL_GUARD_UNDERFLOW ? MMWL_GUARD_UNDERFLOW : MMWL_GUARD_OVERFLOW);
+	MMWL_STORE_RELEASE(&mmwl_guard_rate, rate);
+	MMWL_STORE_RELEASE(&mmwl_guard_on, rate != 0 || mmwl_guard_spec_count != 0);
+	MMWL_MUTEX_UNLOCK(&mmwl_site_lock, flags);
+}
+
+
+
+
+/*
+ *	Place every block allocated from a call site against a guard page
+ *	filename matches the end of the __FILE__ of the site at a directory boundary, line_num 0
+ *	matches every line of the file. Returns 0, or -1 if MMWL_GUARD_SITES sites are already guarded.
+ */
+int mmwl_guard_site (const char * filename, unsigned int line_num)
+{
+	struct mmwl_guard_spec * spec = NULL;
+	unsigned int id = 0;
+	unsigned long flags = 0;
+
+	if (strlen(filename) >= MMWL_GUARD_NAME)
+		return -1;
+
+	MMWL_MUTEX_LOCK(&mmwl_site_lock, flags);
+	if (mmwl_guard_spec_count == MMWL_GUARD_SITES)
+	{
+		MMWL_MUTEX_UNLOCK(&mmwl_site_lock, flags);
+		return -1;
+	}
+	mmwl_page_size = sysconf(_SC_PAGESIZE);
+	spec = &mmwl_guard_specs[mmwl_guard_spec_count];
+	strcpy(spec->filename, filename);
+	spec->line_num = line_num;
+	MMWL_STORE_RELEASE(&mmwl_guard_spec_count, mmwl_guard_spec_count + 1);
+	// Sites interned from now on are matched by intern_site
+	for (id = 1 ; id < mmwl_site_count ; id++)
+		if (guard_site_match(mmwl_sites[id].filename, mmwl_sites[id].line_num))
+			MMWL_STORE_RELEASE(&mmwl_sites[id].guard, 1);
+	MMWL_STORE_RELEASE(&mmwl_guard_on, 1);
+	MMWL_MUTEX_UNLOCK(&mmwl_site_lock, flags);
+	return 0;
+}
+
+
+
+
+/*
+ *	Set the number of freed guarded blocks kept inaccessible, at most MMWL_GUARD_POOL_SLOTS
+ *	0 unmaps a guarded block as soon as it is freed.
+ */
+void mmwl_set_guard_pool (unsigned int blocks)
+{
+	unsigned long flags = 0;
+
+	if (blocks > MMWL_GUARD_POOL_SLOTS)
+		blocks = MMWL_GUARD_POOL_SLOTS;
+	MMWL_MUTEX_LOCK(&mmwl_guard_lock, flags);
+	MMWL_STORE_RELEASE(&mmwl_guard_pool_budget, blocks);
+	while (mmwl_guard_pool_count > blocks)
+	{
+		munmap(mmwl_guard_pool[mmwl_guard_pool_head].addr, mmwl_guard_pool[mmwl_guard_pool_head].len);
+		mmwl_guard_pool_head = (mmwl_guard_pool_head + 1) % MMWL_GUARD_POOL_SLOTS;
+		mmwl_guard_pool_count--;
+	}
+	MMWL_MUTEX_UNLOCK(&mmwl_guard_lock, flags);
+}
+
+
+
+
+/*
+ *	Returns the id of a tag, registering it on the first call, or 0 if MMWL_MAX_TAGS are registered
+ *	name must be a static string, tags are never unregistered.
+ */
+unsigned int mmwl_tag (const char * name)
+{
+	unsigned int count = MMWL_LOAD_ACQUIRE(&mmwl_tag_count);
+	unsigned int id = 0;
+	unsigned long flags = 0;
+
+	for (id = 1 ; id < count ; id++)
+		if (strcmp(mmwl_tags[id].name, name) == 0)
+			return id;
+
+	// Not found, search again under the lock as another thread may be adding it
+	MMWL_MUTEX_LOCK(&mmwl_tag_lock, flags);
+	for (id = 1 ; id < mmwl_tag_count && strcmp(mmwl_tags[id].name, name) != 0 ; id++)
+		;
+	if (id == mmwl_tag_count)
+	{
+		if (id < MMWL_MAX_TAGS)
+		{
+			mmwl_tags[id].name = name;
+			mmwl_tags[id].batch = MMWL_TAG_BATCH;
+			MMWL_STORE_RELEASE(&mmwl_tag_count, id + 1);	// Publish the filled entry
+		}
+		else
+		{
+			id = 0;
+		}
+	}
+	MMWL_MUTEX_UNLOCK(&mmwl_tag_lock, flags);
+	return id;
+}
+
+
+
+
+/*
+ *	Push a tag on the tag stack of the calling thread, returns the depth to give to mmwl_tag_restore
+ */
+unsigned int mmwl_tag_push (unsigned int tag)
+{
+	unsigned int depth = mmwl_tag_depth;
+
+	if (depth < MMWL_TAG_DEPTH)
+		mmwl_tag_stack[depth] = tag < MMWL_LOAD_ACQUIRE(&mmwl_tag_count) ? tag : 0;
+	mmwl_tag_depth = depth + 1;
+	return depth;
+}
+
+
+
+
+/*
+ *	Pop the last tag pushed by the calling thread
+ */
+void mmwl_tag_pop (void)
+{
+	if (mmwl_tag_depth != 0)
+		mmwl_tag_depth--;
+}
+
+
+
+
+/*
+ *	Restore the tag stack of the calling thread to a depth returned by mmwl_tag_push
+ */
+void mmwl_tag_restore (unsigned int depth)
+{
+	if (depth < mmwl_tag_depth)
+		mmwl_tag_depth = depth;
+}
+
+
+
+
+/*
+ *	Set the soft budget of a tag, 0 for none
+ *	callback is called, with no lock held, when the live bytes of the tag go over the budget; it
+ *	is called again only after they went back under it. Returns 0, or -1 for an unknown tag.
+ */
+int mmwl_tag_budget (unsigned int tag, unsigned long long bytes, mmwl_budget_fn callback)
+{
+	long long batch = MMWL_TAG_BATCH;
+
+	if (tag == 0 || tag >= MMWL_LOAD_ACQUIRE(&mmwl_tag_count))
+		return -1;
+	// The shards may hold up to a batch each, keep their total below the budget
+	if (bytes != 0 && bytes / MMWL_SHARD_COUNT < MMWL_TAG_BATCH)
+		batch = bytes / MMWL_SHARD_COUNT > 0 ? (long long)(bytes / MMWL_SHARD_COUNT) : 1;
+	MMWL_STORE_RELEASE(&mmwl_tags[tag].callback, callback);
+	MMWL_STORE_RELEASE(&mmwl_tags[tag].batch, batch);
+	MMWL_STORE_RELEASE(&mmwl_tags[tag].over, 0);
+	MMWL_STORE_RELEASE(&mmwl_tags[tag].budget, bytes);
+	return 0;
+}
+
+
+
+
+/*
+ *	Print the live and peak bytes of the tags
+ *	The live bytes include the bytes still gathered by the shards, read without their locks. The
+ *	peak is taken when the shards add their bytes to the tag, it misses the bytes they still hold.
+ */
+void mmwl_status_tags (void)
+{
+	unsigned int count = MMWL_LOAD_ACQUIRE(&mmwl_tag_count);
+	unsigned int id = 0;
+	unsigned int i = 0;
+
+	MMWL_LOG_INFO("*** mmwl tags START ***");
+	if (READ_SAMPLE_SHIFT() != 0)
+		MMWL_LOG_INFO("sizes are estimated, sample rate 1 in %lu bytes", 1UL << READ_SAMPLE_SHIFT());
+	for (id = 1 ; id < count ; id++)
+	{
+		struct mmwl_tag * entry = &mmwl_tags[id];
+		long long live = (long long)MMWL_COUNTER_READ(&entry->live_size);
+		long long peak = (long long)MMWL_COUNTER_READ(&entry->peak_size);
+
+		for (i = 0 ; i < MMWL_SHARD_COUNT ; i++)
+			live += __atomic_load_n(&mmwl_gbl_inst[i].tag_delta[id], __ATOMIC_RELAXED);
+		MMWL_LOG_INFO("\tlive size:%lld peak size:%lld budget:%llu%s tag %s"
+				, live > 0 ? live : 0
+				, live > peak ? live : peak
+				, MMWL_LOAD_ACQUIRE(&entry->budget)
+				, MMWL_LOAD_ACQUIRE(&entry->over) ? " (over)" : ""
+				, entry->name);
+	}
+	MMWL_LOG_INFO("*** mmwl tags END ***");
+}
+#endif
+
+
+
+
+#ifndef __KERNEL__
+/*
+ *	Start recording every allocation, reallocation and free into a binary trace file
+ *	Returns 0 on success, -1 if the file can not be created or tracing is already on.
+ */
+int mmwl_trace_start (const char * path)
+{
+	unsigned long flags = 0;
+
+	struct mmwl_trace_file_header header = {
+		.magic		= MMWL_TRACE_MAGIC,
+		.version	= MMWL_TRACE_VERSION,
+		.event_size	= sizeof(struct mmwl_trace_event),
+	};
+	int ret = -1;
+
+	MMWL_MUTEX_LOCK(&mmwl_trace_lock, flags);
+	if (mmwl_trace_file == NULL && (mmwl_trace_file = fopen(path, "wb")) != NULL)
+	{
+		struct trace_ring * ring = NULL;
+
+		fwrite(&header, sizeof(header), 1, mmwl_trace_file);
+		mmwl_trace_sites = 0;
+		mmwl_trace_dropped = 0;
+		for (ring = MMWL_LOAD_ACQUIRE(&mmwl_trace_rings) ; ring != NULL ; ring = ring->next)
+			ring->dropped_written = ring->dropped;		// Only report the drops of this trace
+		MMWL_STORE_RELEASE(&mmwl_trace_on, 1);
+		if (pthread_create(&mmwl_trace_writer, NULL, trace_writer, NULL) == 0)
+		{
+			ret = 0;
+		}
+		else
+		{
+			MMWL_STORE_RELEASE(&mmwl_trace_on, 0);
+			fclose(mmwl_trace_file);
+			mmwl_trace_file = NULL;
+		}
+	}
+	MMWL_MUTEX_UNLOCK(&mmwl_trace_lock, flags);
+	if (ret != 0)
+		MMWL_LOG_ERROR("trace: can not start tracing to %s", path);
+	return ret;
+}
+
+
+
+
+/*
+ *	Stop recording, write the pending events and close the trace file
+ */
+void mmwl_trace_stop (void)
+{
+	unsigned long flags = 0;
+
+	MMWL_MUTEX_LOCK(&mmwl_trace_lock, flags);
+	if (mmwl_trace_file != NULL)
+	{
+		MMWL_STORE_RELEASE(&mmwl_trace_on, 0);
+		pthread_join(mmwl_trace_writer, NULL);
+		if (mmwl_trace_dropped)
+			MMWL_LOG_ERROR("trace: %llu events dropped as rings were full", mmwl_trace_dropped);
+		fclose(mmwl_trace_file);
+		mmwl_trace_file = NULL;
+	}
+	MMWL_MUTEX_UNLOCK(&mmwl_trace_lock, flags);
+}
+
+
+
+
+/*
+ *	Output of mmwl_export
+ *	The profile is written through a fixed buffer, so exporting needs no memory whatever the number
+ *	of sites and stacks. A protobuf submessage is first built in its own export_out (fd is -1),
+ *	then copied with its length.
+ */
+struct export_out {
+	int			fd;			// Destination, -1 for a submessage
+	int			error;			// Non zero once a write failed or a submessage overflowed
+	unsigned long long	strings;		// Number of strings written to the pprof string table
+	size_t			len;			// Bytes used in data[]
+	unsigned char		data[MMWL_EXPORT_BUFFER];
+};
+
+// Protobuf wire types
+#define PB_VARINT		0
+#define PB_BYTES		2
+
+// Fields of the pprof Profile message and of its submessages, see profile.proto
+#define PPROF_SAMPLE_TYPE	1
+#define PPROF_SAMPLE		2
+#define PPROF_LOCATION		4
+#define PPROF_FUNCTION		5
+#define PPROF_STRING		6
+#define PPROF_TIME_NANOS	9
+#define PPROF_PERIOD_TYPE	11
+#define PPROF_PERIOD		12
+#define PPROF_DEFAULT_TYPE	14
+#define VALUE_TYPE_TYPE		1			// ValueType
+#define VALUE_TYPE_UNIT		2
+#define SAMPLE_LOCATION		1			// Sample
+#define SAMPLE_VALUE		2
+#define LOCATION_ID		1			// Location
+#define LOCATION_ADDRESS	3
+#define LOCATION_LINE		4
+#define LINE_FUNCTION		1			// Line
+#define LINE_LINE		2
+#define FUNCTION_ID		1			// Function
+#define FUNCTION_NAME		2
+#define FUNCTION_SYSTEM_NAME	3
+#define FUNCTION_FILENAME	4
+
+#define EXPORT_NO_STACK_ID	(MMWL_DEPOT_FRAMES + 1)	// Location of the blocks allocated without stack
+
+
+
+
+/*
+ *	Write the buffered bytes to the destination
+ */
+static void export_flush (struct export_out * out)
+{
+	size_t done = 0;
+
+	while (done < out->len && !out->error)
+	{
+		ssize_t ret = write(out->fd, out->data + done, out->len - done);
+		if (ret > 0)
+			done += ret;
+		else if (ret < 0 && errno != EINTR)
+			out->error = 1;
+	}
+	out->len = 0;
+}
+
+
+
+
+/*
+ *	Append bytes to the output, flushing the buffer as it fills up
+ */
+static void export_put (	struct	export_out *	out,		// Output
+			const	void *		data,		// Bytes to be appended
+				size_t		len )		// Number of bytes
+{
+	while (len != 0 && !out->error)
+	{
+		size_t count = len < MMWL_EXPORT_BUFFER - out->len ? len : MMWL_EXPORT_BUFFER - out->len;
+
+		if (count == 0)
+		{
+			if (out->fd < 0)
+				out->error = 1;				// Submessage is too large
+			else
+				export_flush(out);
+			continue;
+		}
+		memcpy(out->data + out->len, data, count);
+		out->len += count;
+		data = (const char *)data + count;
+		len -= count;
+	}
+}
+
+
+
+
+/*
+ *	Append a protobuf varint
+ */
+static void pb_varint (struct export_out * out, unsigned long long value)
+{
+	unsigned char bytes[10];
+	size_t len = 0;
+
+	do
+	{
+		bytes[len++] = (value & 0x7F) | (value > 0x7F ? 0x80 : 0);
+		value >>= 7;
+	} while (value != 0);
+	export_put(out, bytes, len);
+}
+
+
+
+
+/*
+ *	Append a varint field, and a length delimited field
+ */
+static void pb_uint (struct export_out * out, unsigned int field, unsigned long long value)
+{
+	pb_varint(out, field << 3 | PB_VARINT);
+	pb_varint(out, value);
+}
+
+static void pb_bytes (struct export_out * out, unsigned int field, const void * data, size_t len)
+{
+	pb_varint(out, field << 3 | PB_BYTES);
+	pb_varint(out, len);
+	export_put(out, data, len);
+}
+
+#define pb_message(out, field, msg)	pb_bytes(out, field, (msg)->data, (msg)->len)
+
+
+
+
+/*
+ *	Append a string to the pprof string table and return its index
+ */
+static unsigned long long pprof_string (struct export_out * out, const char * str)
+{
+	pb_bytes(out, PPROF_STRING, str, strlen(str));
+	return out->strings++;
+}
+
+
+
+
+/*
+ *	Append a pprof ValueType submessage
+ */
+static void pprof_value_type (struct export_out * out, unsigned int field, const char * type, const char * unit)
+{
+	struct export_out msg = { .fd = -1 };
+
+	pb_uint(&msg, VALUE_TYPE_TYPE, pprof_string(out, type));
+	pb_uint(&msg, VALUE_TYPE_UNIT, pprof_string(out, unit));
+	pb_message(out, field, &msg);
+}
+
+
+
+
+/*
+ *	Append a pprof Function and the Location of one of its lines, both with the given id
+ */
+static void pprof_location (	struct	export_out *	out,		// Profile
+				unsigned long long	id,		// Location & function id
+				unsigned long		address,	// Return address, 0 for a call site
+			const	char *			name,		// Function name
+			const	char *			filename,	// Source file or binary
+				unsigned int		line_num )	// Line number, 0 if unknown
+{
+	struct export_out msg = { .fd = -1 };
+	struct export_out line = { .fd = -1 };
+	unsigned long long name_id = pprof_string(out, name);
+	unsigned long long file_id = pprof_string(out, filename);
+
+	pb_uint(&msg, FUNCTION_ID, id);
+	pb_uint(&msg, FUNCTION_NAME, name_id);
+	pb_uint(&msg, FUNCTION_SYSTEM_NAME, name_id);
+	pb_uint(&msg, FUNCTION_FILENAME, file_id);
+	pb_message(out, PPROF_FUNCTION, &msg);
+
+	pb_uint(&line, LINE_FUNCTION, id);
+	if (line_num != 0)
+		pb_uint(&line, LINE_LINE, line_num);
+	msg.len = 0;
+	pb_uint(&msg, LOCATION_ID, id);
+	if (address != 0)
+		pb_uint(&msg, LOCATION_ADDRESS, address);
+	pb_message(&msg, LOCATION_LINE, &line);
+	pb_message(out, PPROF_LOCATION, &msg);
+}
+
+
+
+
+/*
+ *	Append a pprof Sample of 'count' blocks holding 'size' bytes
+ */
+static void pprof_sample (	struct	export_out *	out,		// Profile
+			const	unsigned long long *	ids,		// Locations, leaf first
+				unsigned int		nr_ids,		// Number of locations
+				unsigned long long	count,		// Live blocks
+				unsigned long long	size )		// Live bytes
+{
+	struct export_out msg = { .fd = -1 };
+	struct export_out packed = { .fd = -1 };
+	unsigned int i = 0;
+
+	for (i = 0 ; i < nr_ids ; i++)
+		pb_varint(&packed, ids[i]);
+	pb_message(&msg, SAMPLE_LOCATION, &packed);
+	packed.len = 0;
+	pb_varint(&packed, count);
+	pb_varint(&packed, size);
+	pb_message(&msg, SAMPLE_VALUE, &packed);
+	pb_message(out, PPROF_SAMPLE, &msg);
+}
+
+
+
+
+/*
+ *	Symbolize a return address for the export
+ *	An address without symbol is named by its binary and its offset in it, which do not change from
+ *	run to run unlike the address, or by the address in hex when the binary is unknown.
+ */
+static const char * export_symbol (	unsigned long		address,	// Return address
+					const	char **		filename,	// Set to the binary holding it
+						char *		hex,		// Buffer for the name of an address
+						size_t		hex_len )	// Size of hex
+{
+	Dl_info info;
+
+	*filename = "?";
+	if (dladdr((void *)address, &info) == 0 || info.dli_fname == NULL)
+	{
+		snprintf(hex, hex_len, "0x%lx", address);
+		return hex;
+	}
+	*filename = info.dli_fname;
+	if (info.dli_sname != NULL)
+		return info.dli_sname;
+	snprintf(hex, hex_len, "%s+0x%lx"
+			, strrchr(info.dli_fname, '/') ? strrchr(info.dli_fname, '/') + 1 : info.dli_fname
+			, address - (unsigned long)info.dli_fbase);
+	return hex;
+}
+
+
+
+
+/*
+ *	Export the live blocks to a file descriptor, aggregated by call site or by stack
+ *	MMWL_EXPORT_PPROF writes a pprof heap profile (uncompressed protobuf, inuse_objects and
+ *	inuse_space samples), MMWL_EXPORT_FOLDED one 'frame;frame;... bytes' line per stack, root
+ *	first, for flame graphs. With MMWL_EXPORT_STACKS samples are the allocation stacks of the depot,
+ *	blocks allocated without stack being gathered in a '[no stack]' sample; otherwise they are the
+ *	call sites. The counters of the sites and of the depot are read as they are, no block is walked
+ *	and no memory is allocated. Sizes are estimated when sampling. Returns 0, or -1 on error.
+ */
+int mmwl_export (int fd, unsigned int format)
+{
+	struct export_out out = { .fd = fd, .strings = 0 };
+	unsigned int site_count = MMWL_LOAD_ACQUIRE(&mmwl_site_count);
+	unsigned int stack_count = MMWL_LOAD_ACQUIRE(&mmwl_stack_count);
+	unsigned int pprof = (format & ~MMWL_EXPORT_STACKS) == MMWL_EXPORT_PPROF;
+	unsigned long long site_size = 0, site_live = 0;
+	unsigned long long stack_size = 0, stack_live = 0;
+	unsigned long long ids[STACK_DUMP_DEPTH];
+	struct timespec now;
+	char line[512];
+	unsigned int id = 0;
+	unsigned int i = 0;
+	int len = 0;
+
+	if ((format & ~MMWL_EXPORT_STACKS) > MMWL_EXPORT_FOLDED)
+	{
+		MMWL_LOG_ERROR("export: unknown format %u", format);
+		return -1;
+	}
+	site_flush();								// Totals include the shard caches
+
+	if (pprof)
+	{
+		pprof_string(&out, "");					// String 0 is always empty
+		pprof_value_type(&out, PPROF_SAMPLE_TYPE, "inuse_objects", "count");
+		pprof_value_type(&out, PPROF_SAMPLE_TYPE, "inuse_space", "bytes");
+		pprof_value_type(&out, PPROF_PERIOD_TYPE, "space", "bytes");
+		pb_uint(&out, PPROF_PERIOD, 1ULL << READ_SAMPLE_SHIFT());
+		pb_uint(&out, PPROF_DEFAULT_TYPE, 3);			// inuse_space
+		clock_gettime(CLOCK_REALTIME, &now);
+		pb_uint(&out, PPROF_TIME_NANOS, (unsigned long long)now.tv_sec * 1000000000ULL + now.tv_nsec);
+	}
+
+	for (id = 0 ; id < site_count ; id++)
+	{
+		struct mmwl_site * site = &mmwl_sites[id];
+		unsigned long long count = MMWL_COUNTER_READ(&site->live_count);
+		unsigned long long size = MMWL_COUNTER_READ(&site->live_size);
+
+		site_live += count;
+		site_size += size;
+		if (count == 0 || (format & MMWL_EXPORT_STACKS))
+			continue;
+		if (pprof)
+		{
+			ids[0] = id + 1;
+			pprof_location(&out, ids[0], 0, site->func_name, site->filename, site->line_num);
+			pprof_sample(&out, ids, 1, count, size);
+			continue;
+		}
+		len = snprintf(line, sizeof(line), "%s (%s:%u) %llu\n", site->func_name, site->filename, site->line_num, size);
+		export_put(&out, line, len < (int)sizeof(line) ? len : (int)sizeof(line) - 1);
+	}
+
+	for (id = 1 ; (format & MMWL_EXPORT_STACKS) && id < stack_count ; id++)
+	{
+		struct mmwl_stack * stack = &mmwl_stacks[id];
+		unsigned long * frames = &mmwl_depot_frames[stack->offset];
+		unsigned long long count = MMWL_COUNTER_READ(&stack->live_count);
+		unsigned long long size = MMWL_COUNTER_READ(&stack->live_size);
+		const char * filename = NULL;
+		char hex[256];
+
+		stack_live += count;
+		stack_size += size;
+		if (count == 0)
+			continue;
+		if (pprof)
+		{
+			// A location per depot frame, so that no table of the locations already written is needed
+			for (i = 0 ; i < stack->nr_frames ; i++)
+			{
+				const char * name = export_symbol(frames[i], &filename, hex, sizeof(hex));
+				ids[i] = stack->offset + i + 1;
+				pprof_location(&out, ids[i], frames[i], name, filename, 0);
+			}
+			pprof_sample(&out, ids, stack->nr_frames, count, size);
+			continue;
+		}
+		for (i = stack->nr_frames ; i > 0 ; i--)
+		{
+			const char * name = export_symbol(frames[i-1], &filename, hex, sizeof(hex));
+			export_put(&out, name, strlen(name));
+			export_put(&out, i > 1 ? ";" : " ", 1);
+		}
+		len = snprintf(line, sizeof(line), "%llu\n", size);
+		export_put(&out, line, len);
+	}
+
+	// Blocks of the sites not counted by any stack
+	if ((format & MMWL_EXPORT_STACKS) && site_live > stack_live && site_size > stack_size)
+	{
+		if (pprof)
+		{
+			ids[0] = EXPORT_NO_STACK_ID;
+			pprof_location(&out, ids[0], 0, "[no stack]", "?", 0);
+			pprof_sample(&out, ids, 1, site_live - stack_live, site_size - stack_size);
+		}
+		else
+		{
+			len = snprintf(line, sizeof(line), "[no stack] %llu\n", site_size - stack_size);
+			export_put(&out, line, len);
+		}
+	}
+
+	export_flush(&out);
+	if (out.error)
+	{
+		MMWL_LOG_ERROR("export: write failed");
+		return -1;
+	}
+	return 0;
+}
+#endif /* __KERNEL__ */
+
+
+
+
+/*
+ *	Corruption found by the scanner, reported once the shard is unlocked
+ */
+struct scan_report {
+	void *			addr;			// User block address
+	size_t			size;			// Size of the user block
+	unsigned int		site_id;		// Call site of the block
+	unsigned int		stack_id;		// Allocation stack of the block
+};
+
+#ifdef __KERNEL__
+static DEFINE_MUTEX(mmwl_scanner_lock);			// Serializes scanner start & stop
+static struct task_struct * mmwl_scanner_task = NULL;	// Scanner thread, NULL when stopped
+#else
+static pthread_mutex_t mmwl_scanner_lock = PTHREAD_MUTEX_INITIALIZER;	// Protects the scanner state
+static pthread_cond_t mmwl_scanner_cond = PTHREAD_COND_INITIALIZER;	// Wakes the scanner up when stopped
+static pthread_t mmwl_scanner_thread;			// Scanner thread
+static int mmwl_scanner_on = 0;				// Non zero while the scanner runs
+#endif
+static unsigned int mmwl_scan_interval = 0;		// Milliseconds between two passes
+static unsigned int mmwl_scan_batch = 0;		// Blocks verified per lock hold
+
+
+
+
+/*
+ *	Report a corrupted block found by the scanner
+ */
+static void scan_report (struct scan_report * report)
+{
+	struct mmwl_site * site = &mmwl_sites[report->site_id & (MMWL_MAX_SITES-1)];
+
+	MMWL_LOG_ERROR("scanner: signature mismatch, addr:%p size:%lu"
+			, report->addr
+			, (unsigned long)report->size);
+	MMWL_LOG_ERROR("\tblock origin @%s:%u in %s"
+			, site->func_name
+			, site->line_num
+			, site->filename);
+	if (report->stack_id != MMWL_STACK_NONE)
+		print_stack_frames(report->stack_id);
+}
+
+
+
+
+/*
+ *	Verify the signatures of the blocks of a shard
+ *	The shard is unlocked every 'batch' blocks, its scan cursor keeps the position meanwhile.
+ *	A corrupted block is reported once, the report is printed with the shard unlocked.
+ */
+static void scan_shard (	struct	mmwl_instance *		inst,		// Shard to be verified
+					unsigned int		batch )		// Blocks verified per lock hold
+{
+	struct scan_report reports[MMWL_SCAN_REPORTS];
+	unsigned int nr_reports = 0;
+	unsigned int n = 0;
+	unsigned long flags = 0;
+
+	MMWL_MUTEX_LOCK(&inst->lock, flags);
+	list_add(&inst->scan_cursor, &inst->head);
+	while (inst->scan_cursor.next != &inst->head)
+	{
+		nr_reports = 0;
+		for (n = 0 ; n < batch && nr_reports < MMWL_SCAN_REPORTS && inst->scan_cursor.next != &inst->head ; n++)
+		{
+			struct list_head * iter = inst->scan_cursor.next;
+			struct block_header * block = NULL;
+
+			list_del(&inst->scan_cursor);			// Move the cursor past the block
+			list_add(&inst->scan_cursor, iter);
+			if (IS_CURSOR(inst, iter))
+				continue;				// Capture cursor
+			block = list_entry(iter, struct block_header, head);
+			if ((block->flags & BLOCK_FLAG_REPORTED) || CHECK_SIGN(block))
+				continue;
+			block->flags |= BLOCK_FLAG_REPORTED;
+			reports[nr_reports].addr	= USER_OF(block);
+			reports[nr_reports].size	= block->size;
+			reports[nr_reports].site_id	= block->site_id;
+			reports[nr_reports].stack_id	= block->stack_id;
+			nr_reports++;
+		}
+		// Let the allocating threads in before the next batch
+		MMWL_MUTEX_UNLOCK(&inst->lock, flags);
+		for (n = 0 ; n < nr_reports ; n++)
+			scan_report(&reports[n]);
+		MMWL_YIELD();
+		MMWL_MUTEX_LOCK(&inst->lock, flags);
+	}
+	list_del(&inst->scan_cursor);
+	MMWL_MUTEX_UNLOCK(&inst->lock, flags);
+}
+
+
+
+
+/*
+ *	Verify every tracked block once
+ */
+static void scan_all (void)
+{
+	int i = 0;
+	for (i = 0 ; i < MMWL_SHARD_COUNT ; i++)
+		scan_shard(&mmwl_gbl_inst[i], mmwl_scan_batch);
+}
+
+
+
+
+#ifdef __KERNEL__
+/*
+ *	Scanner thread, one pass every mmwl_scan_interval ms
+ */
+static int scanner_thread (void * arg)
+{
+	while (!kthread_should_stop())
+	{
+		scan_all();
+		schedule_timeout_interruptible(msecs_to_jiffies(mmwl_scan_interval));
+	}
+	return 0;
+}
+#else
+/*
+ *	Scanner thread, one pass every mmwl_scan_interval ms
+ */
+static void * scanner_thread (void * arg)
+{
+	struct timespec deadline;
+
+	(void)arg;
+	MMWL_SLEEP_LOCK(&mmwl_scanner_lock);
+	while (mmwl_scanner_on)
+	{
+		MMWL_SLEEP_UNLOCK(&mmwl_scanner_lock);
+		scan_all();
+		MMWL_SLEEP_LOCK(&mmwl_scanner_lock);
+		clock_gettime(CLOCK_REALTIME, &deadline);
+		deadline.tv_sec += mmwl_scan_interval / 1000;
+		deadline.tv_nsec += (mmwl_scan_interval % 1000) * 1000000L;
+		if (deadline.tv_nsec >= 1000000000L)
+		{
+			deadline.tv_sec++;
+			deadline.tv_nsec -= 1000000000L;
+		}
+		if (mmwl_scanner_on)
+			pthread_cond_timedwait(&mmwl_scanner_cond, &mmwl_scanner_lock, &deadline);
+	}
+	MMWL_SLEEP_UNLOCK(&mmwl_scanner_lock);
+	return NULL;
+}
+#endif
+
+
+
+
+/*
+ *	Start verifying the signatures of the tracked blocks in the background
+ *	Every interval_ms the scanner walks all the blocks, holding a shard lock for 'batch' blocks
+ *	at most (0 for the default). Returns 0 on success, -1 if already running or not possible.
+ *	An interval of 0 is rejected, the scanner would never sleep.
+ */
+int mmwl_scanner_start (unsigned int interval_ms, unsigned int batch)
+{
+	int ret = -1;
+
+	if (MMWL_LEVEL < MMWL_LEVEL_LIST)
+	{
+		MMWL_LOG_ERROR("scanner: list of allocations is not kept at this MMWL_LEVEL");
+		return -1;
+	}
+	if (interval_ms == 0)
+	{
+		MMWL_LOG_ERROR("scanner: interval must be at least 1 ms");
+		return -1;
+	}
+
+	MMWL_SLEEP_LOCK(&mmwl_scanner_lock);
+	mmwl_scan_interval = interval_ms;
+	mmwl_scan_batch = batch ? batch : MMWL_SCAN_BATCH;
+#ifdef __KERNEL__
+	if (mmwl_scanner_task == NULL)
+	{
+		struct task_struct * task = kthread_run(scanner_thread, NULL, "mmwl_scanner");
+		if (!IS_ERR(task))
+		{
+			mmwl_scanner_task = task;
+			ret = 0;
+		}
+	}
+#else
+	if (!mmwl_scanner_on)
+	{
+		mmwl_scanner_on = 1;
+		if (pthread_create(&mmwl_scanner_thread, NULL, scanner_thread, NULL) == 0)
+			ret = 0;
+		else
+			mmwl_scanner_on = 0;
+	}
+#endif
+	MMWL_SLEEP_UNLOCK(&mmwl_scanner_lock);
+	if (ret != 0)
+		MMWL_LOG_ERROR("scanner: can not start");
+	return ret;
+}
+
+
+
+
+/*
+ *	Stop the background scanner, waits for the pass in progress
+ */
+void mmwl_scanner_stop (void)
+{
+	MMWL_SLEEP_LOCK(&mmwl_scanner_lock);
+#ifdef __KERNEL__
+	if (mmwl_scanner_task != NULL)
+	{
+		kthread_stop(mmwl_scanner_task);
+		mmwl_scanner_task = NULL;
+	}
+	MMWL_SLEEP_UNLOCK(&mmwl_scanner_lock);
+#else
+	if (mmwl_scanner_on)
+	{
+		mmwl_scanner_on = 0;
+		pthread_cond_signal(&mmwl_scanner_cond);
+		MMWL_SLEEP_UNLOCK(&mmwl_scanner_lock);
+		pthread_join(mmwl_scanner_thread, NULL);
+		return;
+	}
+	MMWL_SLEEP_UNLOCK(&mmwl_scanner_lock);
+#endif
+}
+
+
+
+
+#ifdef __KERNEL__
+/*
+ *	Live statistics in debugfs
+ *	/sys/kernel/debug/mmwl/status holds the counters and /sys/kernel/debug/mmwl/sites the table of
+ *	the call sites, streamed one site per record so that it is never built in a single buffer.
+ *	/sys/kernel/debug/mmwl/caches holds the counters of the tracked kernel caches.
+ */
+static struct dentry * mmwl_debugfs_dir = NULL;		// debugfs directory, NULL if not created
+
+
+
+
+/*
+ *	Show the counters, merged from the shards
+ */
+static int debugfs_status_show (struct seq_file * m, void * v)
+{
+	struct mmwl_instance total = { .alloc_count = 0 };
+
+	merge_shards(&total);
+	seq_printf(m, "alloc_count %llu\n", total.alloc_count);
+	seq_printf(m, "free_count %llu\n", total.free_count);
+	seq_printf(m, "alloc_size %llu\n", total.alloc_size);
+	seq_printf(m, "free_size %llu\n", total.free_size);
+	seq_printf(m, "live_size %llu\n", total.alloc_size - total.free_size);
+	seq_printf(m, "live_count %llu\n", total.alloc_count - total.free_count);
+	seq_printf(m, "est_live_size %llu\n", total.est_alloc_size - total.est_free_size);
+	seq_printf(m, "quarantine_size %lu\n", (unsigned long)MMWL_LOAD_ACQUIRE(&mmwl_quarantine_bytes));
+	seq_printf(m, "sample_rate %lu\n", 1UL << READ_SAMPLE_SHIFT());
+	seq_printf(m, "site_count %u\n", MMWL_LOAD_ACQUIRE(&mmwl_site_count));
+	return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(debugfs_status);
+
+
+
+
+/*
+ *	Site table iterator, the position is the site id
+ */
+static void * debugfs_sites_start (struct seq_file * m, loff_t * pos)
+{
+	if (*pos == 0)
+	{
+		site_flush();							// Totals include the shard caches
+		return SEQ_START_TOKEN;
+	}
+	return *pos <= MMWL_LOAD_ACQUIRE(&mmwl_site_count) ? &mmwl_sites[*pos - 1] : NULL;
+}
+
+static void * debugfs_sites_next (struct seq_file * m, void * v, loff_t * pos)
+{
+	++*pos;
+	return debugfs_sites_start(m, pos);
+}
+
+static void debugfs_sites_stop (struct seq_file * m, void * v)
+{
+}
+
+
+
+
+/*
+ *	Show one call site, or the column names
+ */
+static int debugfs_sites_show (struct seq_file * m, void * v)
+{
+	struct mmwl_site * site = v;
+
+	if (v == SEQ_START_TOKEN)
+	{
+		seq_puts(m, "live_size live_count peak_size allocs frees site\n");
+		return 0;
+	}
+	if (MMWL_COUNTER_READ(&site->alloc_count) == 0)
+		return 0;
+	seq_printf(m, "%llu %llu %llu %llu %llu %s:%u:%s\n"
+			, MMWL_COUNTER_READ(&site->live_size)
+			, MMWL_COUNTER_READ(&site->live_count)
+			, MMWL_COUNTER_READ(&site->peak_size)
+			, MMWL_COUNTER_READ(&site->alloc_count)
+			, MMWL_COUNTER_READ(&site->free_count)
+			, site->filename
+			, site->line_num
+			, site->func_name);
+	return 0;
+}
+
+static const struct seq_operations debugfs_sites_sops = {
+	.start	= debugfs_sites_start,
+	.next	= debugfs_sites_next,
+	.stop	= debugfs_sites_stop,
+	.show	= debugfs_sites_show,
+};
+DEFINE_SEQ_ATTRIBUTE(debugfs_sites);
+
+
+
+
+/*
+ *	Show the counters of the tracked caches
+ */
+static int debugfs_caches_show (struct seq_file * m, void * v)
+{
+	unsigned int id = 0;
+
+	seq_puts(m, "live_size live_count peak_size allocs frees object_size cache\n");
+	MMWL_SLEEP_LOCK(&mmwl_cache_lock);
+	for (id = 1 ; id < MMWL_MAX_CACHES ; id++)
+	{
+		struct mmwl_cache * entry = &mmwl_caches[id];
+		if (entry->cache == NULL)
+			continue;
+		seq_printf(m, "%llu %llu %llu %llu %llu %lu %s\n"
+				, MMWL_COUNTER_READ(&entry->live_size)
+				, MMWL_COUNTER_READ(&entry->live_count)
+				, MMWL_COUNTER_READ(&entry->peak_size)
+				, MMWL_COUNTER_READ(&entry->alloc_count)
+				, MMWL_COUNTER_READ(&entry->free_count)
+				, (unsigned long)entry->object_size
+				, entry->name);
+	}
+	MMWL_SLEEP_UNLOCK(&mmwl_cache_lock);
+	return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(debugfs_caches);
+
+
+
+
+/*
+ *	Create the debugfs files, returns 0 on success, -1 otherwise
+ */
+int mmwl_debugfs_create (void)
+{
+	struct dentry * dir = NULL;
+
+	if (mmwl_debugfs_dir != NULL)
+		return -1;
+	dir = debugfs_create_dir("mmwl", NULL);
+	if (IS_ERR_OR_NULL(dir))
+	{
+		MMWL_LOG_ERROR("debugfs: can not create the mmwl directory");
+		return -1;
+	}
+	debugfs_create_file("status", 0444, dir, NULL, &debugfs_status_fops);
+	debugfs_create_file("sites", 0444, dir, NULL, &debugfs_sites_fops);
+	debugfs_create_file("caches", 0444, dir, NULL, &debugfs_caches_fops);
+	mmwl_debugfs_dir = dir;
+	return 0;
+}
+
+
+
+
+/*
+ *	Remove the debugfs files, open files are drained first by debugfs
+ */
+void mmwl_debugfs_remove (void)
+{
+	debugfs_remove_recursive(mmwl_debugfs_dir);
+	mmwl_debugfs_dir = NULL;
+}
+#else
+/*
+ *	Live statistics in shared memory
+ *	A publisher thread copies the counters into a struct mmwl_stats_page (see mmwl_stats.h) every
+ *	interval. The shard counters are read without their locks, so the page may lag behind by a few
+ *	operations, but the allocating threads never wait for it.
+ */
+static pthread_mutex_t mmwl_stats_lock = PTHREAD_MUTEX_INITIALIZER;	// Protects the publisher state
+static pthread_cond_t mmwl_stats_cond = PTHREAD_COND_INITIALIZER;	// Wakes the publisher up when stopped
+static pthread_t mmwl_stats_thread;					// Publisher thread
+static int mmwl_stats_on = 0;						// Publisher is running
+static unsigned int mmwl_stats_interval = 0;				// Update period in ms
+static struct mmwl_stats_page * mmwl_stats_page = NULL;		// Mapped statistics page
+static char mmwl_stats_name[32];					// Name of the shared memory object
+
+
+
+
+/*
+ *	Copy a name into a page field, keeping its end if it is too long (the end of a path tells more)
+ */
+static void stats_copy_name (char * dst, const char * src, int keep_end)
+{
+	size_t len = strlen(src);
+
+	if (keep_end && len >= MMWL_STATS_NAME_LEN)
+		src += len - (MMWL_STATS_NAME_LEN - 1);
+	strncpy(dst, src, MMWL_STATS_NAME_LEN - 1);
+	dst[MMWL_STATS_NAME_LEN - 1] = '\0';
+}
+
+
+
+
+/*
+ *	Rewrite the statistics page
+ *	The new content is prepared in a copy, the page is odd only while the copy is written.
+ */
+static void stats_publish (struct mmwl_stats_page * page)
+{
+	struct mmwl_stats_page * next = NULL;
+	unsigned int top[MMWL_STATS_SITES];
+	unsigned long long seq = page->seq;
+	unsigned int i = 0;
+
+	if ((next = MMWL_INTERNAL_ALLOC(sizeof(*next))) == NULL)
+		return;
+	memcpy(next, page, offsetof(struct mmwl_stats_page, alloc_count));
+	memset(&next->alloc_count, 0, sizeof(*next) - offsetof(struct mmwl_stats_page, alloc_count));
+	site_flush();								// Site totals include the shard caches
+	for (i = 0 ; i < MMWL_SHARD_COUNT ; i++)
+	{
+		struct mmwl_instance * inst = &mmwl_gbl_inst[i];
+		next->alloc_count	+= MMWL_COUNTER_READ(&inst->alloc_count);
+		next->free_count	+= MMWL_COUNTER_READ(&inst->free_count);
+		next->alloc_size	+= MMWL_COUNTER_READ(&inst->alloc_size);
+		next->free_size		+= MMWL_COUNTER_READ(&inst->free_size);
+		next->est_alloc_size	+= MMWL_COUNTER_READ(&inst->est_alloc_size);
+		next->est_free_size	+= MMWL_COUNTER_READ(&inst->est_free_size);
+	}
+	next->timestamp		= mmwl_clock_ns();
+	next->quarantine_size	= MMWL_LOAD_ACQUIRE(&mmwl_quarantine_bytes);
+	next->sample_rate	= READ_SAMPLE_SHIFT();
+	next->site_count	= MMWL_LOAD_ACQUIRE(&mmwl_site_count);
+	next->nr_sites		= top_sites(top, MMWL_STATS_SITES, next->site_count);
+	for (i = 0 ; i < next->nr_sites ; i++)
+	{
+		struct mmwl_site * site = &mmwl_sites[top[i]];
+		struct mmwl_stats_site * out = &next->sites[i];
+		out->live_size		= MMWL_COUNTER_READ(&site->live_size);
+		out->live_count		= MMWL_COUNTER_READ(&site->live_count);
+		out->peak_size		= MMWL_COUNTER_READ(&site->peak_size);
+		out->alloc_count	= MMWL_COUNTER_READ(&site->alloc_count);
+		out->free_count		= MMWL_COUNTER_READ(&site->free_count);
+		out->line_num		= site->line_num;
+		stats_copy_name(out->filename, site->filename, 1);
+		stats_copy_name(out->func_name, site->func_name, 0);
+	}
+
+	// Odd sequence number while the page is rewritten
+	__atomic_store_n(&page->seq, seq + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	memcpy((char *)page + offsetof(struct mmwl_stats_page, timestamp), (char *)next + offsetof(struct mmwl_stats_page, timestamp),
+			sizeof(*page) - offsetof(struct mmwl_stats_page, timestamp));
+	MMWL_STORE_RELEASE(&page->seq, seq + 2);
+	MMWL_INTERNAL_FREE(next);
+}
+
+
+
+
+/*
+ *	Publisher thread, one update every mmwl_stats_interval ms
+ */
+static void * stats_thread (void * arg)
+{
+	struct timespec deadline;
+
+	(void)arg;
+	MMWL_SLEEP_LOCK(&mmwl_stats_lock);
+	while (mmwl_stats_on)
+	{
+		clock_gettime(CLOCK_REALTIME, &deadline);
+		deadline.tv_sec += mmwl_stats_interval / 1000;
+		deadline.tv_nsec += (mmwl_stats_interval % 1000) * 1000000L;
+		if (deadline.tv_nsec >= 1000000000L)
+		{
+			deadline.tv_sec++;
+			deadline.tv_nsec -= 1000000000L;
+		}
+		pthread_cond_timedwait(&mmwl_stats_cond, &mmwl_stats_lock, &deadline);
+		if (mmwl_stats_on)
+			stats_publish(mmwl_stats_page);
+	}
+	MMWL_SLEEP_UNLOCK(&mmwl_stats_lock);
+	return NULL;
+}
+
+
+
+
+/*
+ *	Start publishing the statistics in the shared memory object "/mmwl.<pid>" every interval_ms
+ *	Returns 0 on success, -1 if already running or not possible.
+ */
+int mmwl_stats_start (unsigned int interval_ms)
+{
+	struct mmwl_stats_page * page = NULL;
+	int fd = -1;
+	int ret = -1;
+
+	MMWL_SLEEP_LOCK(&mmwl_stats_lock);
+	if (mmwl_stats_on)
+		goto out;
+	snprintf(mmwl_stats_name, sizeof(mmwl_stats_name), MMWL_STATS_NAME, (int)getpid());
+	if ((fd = shm_open(mmwl_stats_name, O_CREAT | O_TRUNC | O_RDWR, 0644)) < 0)
+		goto out;
+	if (ftruncate(fd, sizeof(*page)) == 0)
+		page = mmap(NULL, sizeof(*page), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (page == NULL || page == MAP_FAILED)
+	{
+		shm_unlink(mmwl_stats_name);
+		goto out;
+	}
+
+	memcpy(page->magic, MMWL_STATS_MAGIC, sizeof(page->magic));
+	page->version		= MMWL_STATS_VERSION;
+	page->page_size		= sizeof(*page);
+	page->pid		= getpid();
+	page->interval_ms	= interval_ms ? interval_ms : 1000;
+	stats_publish(page);
+
+	mmwl_stats_page = page;
+	mmwl_stats_interval = page->interval_ms;
+	mmwl_stats_on = 1;
+	if (pthread_create(&mmwl_stats_thread, NULL, stats_thread, NULL) == 0)
+	{
+		ret = 0;
+		goto out;
+	}
+	mmwl_stats_on = 0;
+	mmwl_stats_page = NULL;
+	munmap(page, sizeof(*page));
+	shm_unlink(mmwl_stats_name);
+out:
+	MMWL_SLEEP_UNLOCK(&mmwl_stats_lock);
+	if (ret != 0)
+		MMWL_LOG_ERROR("stats: can not publish the statistics page");
+	return ret;
+}
+
+
+
+
+/*
+ *	Stop publishing the statistics and remove the shared memory object
+ */
+void mmwl_stats_stop (void)
+{
+	MMWL_SLEEP_LOCK(&mmwl_stats_lock);
+	if (!mmwl_stats_on)
+	{
+		MMWL_SLEEP_UNLOCK(&mmwl_stats_lock);
+		return;
+	}
+	mmwl_stats_on = 0;
+	pthread_cond_signal(&mmwl_stats_cond);
+	MMWL_SLEEP_UNLOCK(&mmwl_stats_lock);
+	pthread_join(mmwl_stats_thread, NULL);
+	munmap(mmwl_stats_page, sizeof(*mmwl_stats_page));
+	shm_unlink(mmwl_stats_name);
+	mmwl_stats_page = NULL;
+}
+#endif
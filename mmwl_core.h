@@ -24,6 +24,7 @@
 
 #ifdef __KERNEL__
 #include <linux/kernel.h>
+#include <linux/slab.h>
 #define MMWL_LOG_INFO(log, args...)	printk(KERN_INFO "mmwl:inf: " log "\n", ## args)
 #define MMWL_LOG_ERROR(log, args...)	printk(KERN_ERR  "mmwl:err: " log "\n", ## args)
 #else
@@ -32,6 +33,51 @@
 #define MMWL_LOG_ERROR(log, args...)	fprintf(stderr, "mmwl:err: " log "\n", ## args)
 #endif
 
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+
+/*
+ *	Checking levels, selected at compile time with -DMMWL_LEVEL=<level>
+ *	Every level adds to the previous one, disabled features are compiled out of the wrappers.
+ */
+#define MMWL_LEVEL_COUNTERS	0		// Allocation counters, call site and stack statistics
+#define MMWL_LEVEL_LIST		1		// List of allocated blocks, for status and live capture
+#define MMWL_LEVEL_CANARIES	2		// Header & footer signatures, checked on free
+#define MMWL_LEVEL_ASSERTS	3		// Consistency asserts after every operation
+
+#ifndef MMWL_LEVEL
+#ifdef DEBUG
+#define MMWL_LEVEL		MMWL_LEVEL_ASSERTS
+#else
+#define MMWL_LEVEL		MMWL_LEVEL_CANARIES
+#endif
+#endif
+
+
+/*
+ *	Information about a tracked block
+ */
+struct mmwl_block_info {
+		void *		addr;			// Address of the user block
+		size_t		size;			// Size of the user block
+	const	char *		filename;		// Name of the source file from where block was allocated
+	const	char *		func_name;		// Name of the function from which block was allocated
+		unsigned int	line_num;		// Line number in source file where block was allocated
+		unsigned int	stack_id;		// Allocation stack in the stack depot, 0 if not captured
+		int		corrupted;		// Non zero if the block signature does not match
+};
+
+/*
+ *	Copy of the list of allocated blocks
+ */
+struct mmwl_live_set {
+		size_t		count;			// Number of blocks in the set
+		size_t		missed;			// Blocks left out as the list grew during the capture
+	struct	mmwl_block_info	blocks[];		// Captured blocks
+};
+
 
 void * mmwl_malloc (	size_t		size,
 	#ifdef __KERNEL__
@@ -42,6 +88,25 @@ void * mmwl_malloc (	size_t		size,
 		const	unsigned int	line_num
 );
 
+void * mmwl_calloc (	size_t		blocks,
+			size_t		size,
+	#ifdef __KERNEL__
+			gfp_t		flags,
+	#endif
+		const	char *		filename,
+		const	char *		func_name,
+		const	unsigned int	line_num
+);
+
+#ifndef __KERNEL__
+void * mmwl_memalign (	size_t		alignment,
+			size_t		size,
+		const	char *		filename,
+		const	char *		func_name,
+		const	unsigned int	line_num
+);
+#endif
+
 void * mmwl_realloc (	void *		ptr,
 			size_t		size,
 	#ifdef __KERNEL__
@@ -58,6 +123,147 @@ void mmwl_free (	void *		ptr,
 		const	unsigned int	line_num
 );
 
+#ifndef __KERNEL__
+void mmwl_free_sized (	void *		ptr,
+			size_t		size,
+		const	char *		filename,
+		const	char *		func_name,
+		const	unsigned int	line_num
+);
+#endif
+
+#ifdef __KERNEL__
+void * mmwl_vmalloc (	size_t		size,
+			gfp_t		flags,
+		const	char *		filename,
+		const	char *		func_name,
+		const	unsigned int	line_num
+);
+
+void * mmwl_kvmalloc (	size_t		size,
+			gfp_t		flags,
+		const	char *		filename,
+		const	char *		func_name,
+		const	unsigned int	line_num
+);
+
+void mmwl_vfree (	void *		ptr,
+		const	char *		filename,
+		const	char *		func_name,
+		const	unsigned int	line_num
+);
+
+void mmwl_kvfree (	void *		ptr,
+		const	char *		filename,
+		const	char *		func_name,
+		const	unsigned int	line_num
+);
+
+struct kmem_cache * mmwl_cache_create (	const	char *		name,
+						unsigned int	size,
+						unsigned int	align,
+						slab_flags_t	flags,
+						void		(*ctor)(void *)
+);
+
+void mmwl_cache_destroy (struct kmem_cache * cache);
+
+void * mmwl_cache_alloc (	struct	kmem_cache *	cache,
+					gfp_t		flags,
+				const	char *		filename,
+				const	char *		func_name,
+				const	unsigned int	line_num
+);
+
+void mmwl_cache_free (	struct	kmem_cache *	cache,
+				void *		ptr,
+			const	char *		filename,
+			const	char *		func_name,
+			const	unsigned int	line_num
+);
+
+void mmwl_status_caches (void);
+#endif
+
+size_t mmwl_block_size (void * ptr);
+size_t mmwl_block_overhead (void * ptr);
+
 void mmwl_status (void);
 
+struct mmwl_live_set * mmwl_live_capture (void);
+
+void mmwl_live_release (struct mmwl_live_set * set);
+
+int mmwl_lookup (void * ptr, struct mmwl_block_info * info);
+
+unsigned int mmwl_snapshot (void);
+long mmwl_diff (unsigned int a, unsigned int b);
+
+void mmwl_status_sites (unsigned int top_n);
+
+void mmwl_histograms (unsigned int top_n);
+
+void mmwl_set_sample_rate (size_t rate);
+
+void mmwl_set_stack_depth (unsigned int depth);
+void mmwl_set_redzones (size_t head, size_t foot);
+void mmwl_set_quarantine (size_t bytes);
+int mmwl_scanner_start (unsigned int interval_ms, unsigned int batch);
+void mmwl_scanner_stop (void);
+
+#ifndef __KERNEL__
+#define MMWL_GUARD_OVERFLOW	0		// Guard page right after the user block
+#define MMWL_GUARD_UNDERFLOW	1		// Guard page before the block header
+void mmwl_set_guard (size_t min_size, size_t max_size, unsigned int rate, unsigned int mode);
+int mmwl_guard_site (const char * filename, unsigned int line_num);
+void mmwl_set_guard_pool (unsigned int blocks);
+
+typedef void (*mmwl_budget_fn) (const char * tag, long long live_size, unsigned long long budget);
+unsigned int mmwl_tag (const char * name);
+unsigned int mmwl_tag_push (unsigned int tag);
+void mmwl_tag_pop (void);
+void mmwl_tag_restore (unsigned int depth);
+int mmwl_tag_budget (unsigned int tag, unsigned long long bytes, mmwl_budget_fn callback);
+void mmwl_status_tags (void);
+
+/*
+ *	Charge the blocks allocated by the thread to the tag 'name' until the end of the enclosing scope
+ *	The tag id is looked up once per scope site.
+ */
+static inline void mmwl_tag_scope_end (unsigned int * depth)
+{
+	mmwl_tag_restore(*depth);
+}
+
+#define MMWL_TAG_CONCAT_(a, b)	a ## b
+#define MMWL_TAG_CONCAT(a, b)	MMWL_TAG_CONCAT_(a, b)
+#define MMWL_TAG_SCOPE(name)									\
+	unsigned int MMWL_TAG_CONCAT(mmwl_tag_depth_, __LINE__)					\
+		__attribute__((cleanup(mmwl_tag_scope_end), unused)) =				\
+		mmwl_tag_push(({ static unsigned int __mmwl_tag = 0;				\
+				 if (__mmwl_tag == 0) __mmwl_tag = mmwl_tag(name);		\
+				 __mmwl_tag; }))
+
+long mmwl_leak_check (void);
+
+int mmwl_trace_start (const char * path);
+
+void mmwl_trace_stop (void);
+
+int mmwl_stats_start (unsigned int interval_ms);
+void mmwl_stats_stop (void);
+
+#define MMWL_EXPORT_PPROF	0		// pprof heap profile, uncompressed protobuf
+#define MMWL_EXPORT_FOLDED	1		// Folded stacks text, for flame graphs
+#define MMWL_EXPORT_STACKS	0x100		// Aggregate by allocation stack instead of call site
+int mmwl_export (int fd, unsigned int format);
+#else
+int mmwl_debugfs_create (void);
+void mmwl_debugfs_remove (void);
+#endif
+
+#ifdef __cplusplus
+}
+#endif
+
 #endif //MMWL_CORE_H_
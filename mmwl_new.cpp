@@ -0,0 +1,191 @@
+/* SPDX-License-Identifier: GPL-2.0 OR MIT */
+/* * Copyright (C) 2019 Abhishek Ghogare <abhishek.ghogare@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of
+ * this software and associated documentation files (the "Software"), to deal in
+ * the Software without restriction, including without limitation the rights to
+ * use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of
+ * the Software, and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+ * FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+ * COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+ * IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+
+/*
+ *	Replacement of the global operator new & delete, user side only
+ *
+ *	Linking this file into a program routes every new and delete expression, the standard
+ *	containers included, to the library. Each operator is a call site of its own, the allocating
+ *	code is found from the captured stacks. Sized deletes are checked against the allocated size.
+ */
+
+#include <new>
+#include "mmwl_core.h"
+
+
+/*
+ *	Allocates a block for operator new, calling the new handler until it succeeds
+ *	Always inlined, so that every operator has the same number of frames on a captured stack.
+ */
+static inline __attribute__((always_inline)) void * new_block (
+				std::size_t	size,				// Size of the object
+				std::size_t	alignment,			// Alignment of the object, 0 for the default
+				bool		nothrow,			// Returns NULL instead of throwing std::bad_alloc
+			const	char *		func_name,			// Operator called
+			const	unsigned int	line_num )			// Line number in the operator
+{
+	void * ptr = NULL;
+
+	for (;;)
+	{
+		if (alignment != 0)
+			ptr = mmwl_memalign(alignment, size, __FILE__, func_name, line_num);
+		else
+			ptr = mmwl_malloc(size, __FILE__, func_name, line_num);
+		if (ptr != NULL)
+			return ptr;
+
+		std::new_handler handler = std::get_new_handler();
+		if (handler == NULL)
+		{
+			if (nothrow)
+				return NULL;
+			throw std::bad_alloc();
+		}
+		if (!nothrow)
+		{
+			handler();
+			continue;
+		}
+		try
+		{
+			handler();
+		}
+		catch (const std::bad_alloc &)
+		{
+			return NULL;
+		}
+	}
+}
+
+
+
+
+void * operator new (std::size_t size)
+{
+	return new_block(size, 0, false, "operator new", __LINE__);
+}
+
+void * operator new[] (std::size_t size)
+{
+	return new_block(size, 0, false, "operator new[]", __LINE__);
+}
+
+void * operator new (std::size_t size, const std::nothrow_t &) noexcept
+{
+	return new_block(size, 0, true, "operator new", __LINE__);
+}
+
+void * operator new[] (std::size_t size, const std::nothrow_t &) noexcept
+{
+	return new_block(size, 0, true, "operator new[]", __LINE__);
+}
+
+void operator delete (void * ptr) noexcept
+{
+	mmwl_free(ptr, __FILE__, "operator delete", __LINE__);
+}
+
+void operator delete[] (void * ptr) noexcept
+{
+	mmwl_free(ptr, __FILE__, "operator delete[]", __LINE__);
+}
+
+void operator delete (void * ptr, const std::nothrow_t &) noexcept
+{
+	mmwl_free(ptr, __FILE__, "operator delete", __LINE__);
+}
+
+void operator delete[] (void * ptr, const std::nothrow_t &) noexcept
+{
+	mmwl_free(ptr, __FILE__, "operator delete[]", __LINE__);
+}
+
+
+
+
+#if __cpp_sized_deallocation
+void operator delete (void * ptr, std::size_t size) noexcept
+{
+	mmwl_free_sized(ptr, size, __FILE__, "operator delete", __LINE__);
+}
+
+void operator delete[] (void * ptr, std::size_t size) noexcept
+{
+	mmwl_free_sized(ptr, size, __FILE__, "operator delete[]", __LINE__);
+}
+#endif
+
+
+
+
+#if __cpp_aligned_new
+void * operator new (std::size_t size, std::align_val_t alignment)
+{
+	return new_block(size, static_cast<std::size_t>(alignment), false, "operator new", __LINE__);
+}
+
+void * operator new[] (std::size_t size, std::align_val_t alignment)
+{
+	return new_block(size, static_cast<std::size_t>(alignment), false, "operator new[]", __LINE__);
+}
+
+void * operator new (std::size_t size, std::align_val_t alignment, const std::nothrow_t &) noexcept
+{
+	return new_block(size, static_cast<std::size_t>(alignment), true, "operator new", __LINE__);
+}
+
+void * operator new[] (std::size_t size, std::align_val_t alignment, const std::nothrow_t &) noexcept
+{
+	return new_block(size, static_cast<std::size_t>(alignment), true, "operator new[]", __LINE__);
+}
+
+void operator delete (void * ptr, std::align_val_t) noexcept
+{
+	mmwl_free(ptr, __FILE__, "operator delete", __LINE__);
+}
+
+void operator delete[] (void * ptr, std::align_val_t) noexcept
+{
+	mmwl_free(ptr, __FILE__, "operator delete[]", __LINE__);
+}
+
+void operator delete (void * ptr, std::align_val_t, const std::nothrow_t &) noexcept
+{
+	mmwl_free(ptr, __FILE__, "operator delete", __LINE__);
+}
+
+void operator delete[] (void * ptr, std::align_val_t, const std::nothrow_t &) noexcept
+{
+	mmwl_free(ptr, __FILE__, "operator delete[]", __LINE__);
+}
+
+void operator delete (void * ptr, std::size_t size, std::align_val_t) noexcept
+{
+	mmwl_free_sized(ptr, size, __FILE__, "operator delete", __LINE__);
+}
+
+void operator delete[] (void * ptr, std::size_t size, std::align_val_t) noexcept
+{
+	mmwl_free_sized(ptr, size, __FILE__, "operator delete[]", __LINE__);
+}
+#endif
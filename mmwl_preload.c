@@ -0,0 +1,369 @@
+/* SPDX-License-Identifier: GPL-2.0 OR MIT */
+/* * Copyright (C) 2019 Abhishek Ghogare <abhishek.ghogare@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of
+ * this software and associated documentation files (the "Software"), to deal in
+ * the Software without restriction, including without limitation the rights to
+ * use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of
+ * the Software, and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+ * FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+ * COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+ * IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+
+
+/*
+ *	LD_PRELOAD interposition of the C allocator, for tracking unmodified binaries
+ *
+ *	usage: LD_PRELOAD=./libmmwl.so program [args]
+ *
+ *	Environment:
+ *		MMWL_SAMPLE_RATE	mean bytes between sampled allocations, 0 tracks every block
+ *		MMWL_STACK_DEPTH	frames of the allocation backtraces (default 16, 0 disables)
+ *		MMWL_TRACE		path of a binary event trace (see mmwl_analyze & mmwl_replay)
+ *		MMWL_SCAN_INTERVAL	period in ms of the background redzone scanner, unset disables it
+ *		MMWL_QUARANTINE		bytes of freed blocks held in quarantine, unset disables it
+ *		MMWL_GUARD		<min>:<max>[:<rate>[:under]], guard pages for one in rate blocks of min to max bytes
+ *		MMWL_GUARD_POOL		freed guarded blocks kept inaccessible (default 1024)
+ *		MMWL_STATS		period in ms of the shared memory statistics page (see mmwl_stat), unset disables it
+ *		MMWL_REPORT		report printed at exit: status (default), sites, histograms, leaks or none
+ *		MMWL_EXPORT		[pprof:|folded:]<path>, profile of the blocks live at exit, by stack
+ *
+ *	Every block is attributed to a call site of this file, allocations are told apart
+ *	by their backtraces.
+ */
+
+#define _GNU_SOURCE
+#include <dlfcn.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "mmwl_core.h"
+
+
+#define BOOTSTRAP_SIZE		(64*1024)	// Arena serving allocations made by dlsym itself
+#define BOOTSTRAP_ALIGN		16		// Alignment of the arena blocks, also the size prefix length
+#define MMWL_SITE		__FILE__, __FUNCTION__, __LINE__
+
+// Keeps the call to mmwl out of tail position: the interposed function must have a frame of its own
+// on the captured stacks, MMWL_STACK_SKIP counts it
+#define NO_TAIL_CALL()		__asm__ __volatile__ ("" : : : "memory")
+
+void * (*mmwl_real_malloc) (size_t) = NULL;		// Wrapped functions, used by mmwl_core.c
+void * (*mmwl_real_realloc) (void *, size_t) = NULL;
+void (*mmwl_real_free) (void *) = NULL;
+
+static char bootstrap_arena[BOOTSTRAP_SIZE] __attribute__((aligned(BOOTSTRAP_ALIGN)));
+static size_t bootstrap_used = 0;			// Bytes of the arena handed out
+static int resolving = 0;				// Set while the wrapped functions are resolved
+
+#define IS_BOOTSTRAP(ptr)	((char *)(ptr) >= bootstrap_arena && (char *)(ptr) < bootstrap_arena + BOOTSTRAP_SIZE)
+#define BOOTSTRAP_SIZE_OF(ptr)	(*(size_t *)((char *)(ptr) - BOOTSTRAP_ALIGN))
+
+
+
+
+/*
+ *	Allocates from the bootstrap arena, its blocks are never freed
+ */
+static void * bootstrap_alloc (size_t size)
+{
+	void * ptr = NULL;
+	size_t need = BOOTSTRAP_ALIGN + ((size + BOOTSTRAP_ALIGN - 1) & ~(size_t)(BOOTSTRAP_ALIGN - 1));
+
+	if (need > BOOTSTRAP_SIZE - __atomic_load_n(&bootstrap_used, __ATOMIC_RELAXED))
+		return NULL;
+	ptr = bootstrap_arena + __atomic_fetch_add(&bootstrap_used, need, __ATOMIC_RELAXED) + BOOTSTRAP_ALIGN;
+	if ((char *)ptr + need - BOOTSTRAP_ALIGN > bootstrap_arena + BOOTSTRAP_SIZE)
+		return NULL;						// Lost a race for the last bytes
+	BOOTSTRAP_SIZE_OF(ptr) = size;
+	return ptr;
+}
+
+
+
+
+/*
+ *	Resolves the wrapped functions of the next library, normally the C library
+ */
+static int resolve (void)
+{
+	if (mmwl_real_free != NULL)
+		return 1;
+	if (resolving)
+		return 0;						// dlsym allocating, served by the arena
+
+	resolving = 1;
+	mmwl_real_malloc = dlsym(RTLD_NEXT, "malloc");
+	mmwl_real_realloc = dlsym(RTLD_NEXT, "realloc");
+	__atomic_store_n(&mmwl_real_free, dlsym(RTLD_NEXT, "free"), __ATOMIC_RELEASE);
+	resolving = 0;
+
+	if (mmwl_real_malloc == NULL || mmwl_real_realloc == NULL || mmwl_real_free == NULL)
+		abort();
+	return 1;
+}
+
+
+
+
+void * malloc (size_t size)
+{
+	void * ptr = NULL;
+
+	if (!resolve())
+		return bootstrap_alloc(size);
+	ptr = mmwl_malloc(size, MMWL_SITE);
+	NO_TAIL_CALL();
+	return ptr;
+}
+
+
+
+
+void * calloc (size_t blocks, size_t size)
+{
+	void * ptr = NULL;
+
+	if (!resolve())
+	{
+		if (size != 0 && blocks > (size_t)-1 / size)
+			return NULL;
+		return bootstrap_alloc(blocks * size);			// Arena is zero initialized
+	}
+	ptr = mmwl_calloc(blocks, size, MMWL_SITE);
+	NO_TAIL_CALL();
+	return ptr;
+}
+
+
+
+
+void * realloc (void * ptr, size_t size)
+{
+	if (IS_BOOTSTRAP(ptr))
+	{
+		// Move out of the arena
+		void * new_ptr = malloc(size);
+		if (new_ptr != NULL)
+			memcpy(new_ptr, ptr, BOOTSTRAP_SIZE_OF(ptr) < size ? BOOTSTRAP_SIZE_OF(ptr) : size);
+		return new_ptr;
+	}
+	if (!resolve())
+		return bootstrap_alloc(size);
+	ptr = mmwl_realloc(ptr, size, MMWL_SITE);
+	NO_TAIL_CALL();
+	return ptr;
+}
+
+
+
+
+void free (void * ptr)
+{
+	if (ptr == NULL || IS_BOOTSTRAP(ptr))
+		return;
+	mmwl_free(ptr, MMWL_SITE);
+	NO_TAIL_CALL();
+}
+
+
+
+
+int posix_memalign (void ** memptr, size_t alignment, size_t size)
+{
+	void * ptr = NULL;
+
+	if (alignment % sizeof(void *) != 0 || (alignment & (alignment - 1)) != 0)
+		return EINVAL;
+	resolve();
+	ptr = mmwl_memalign(alignment, size, MMWL_SITE);
+	if (ptr == NULL)
+		return ENOMEM;
+	*memptr = ptr;
+	return 0;
+}
+
+
+
+
+/*
+ *	Aligned allocation of aligned_alloc, memalign, valloc & pvalloc
+ *	Always inlined, so that each of them is a single frame on a captured stack.
+ */
+static inline __attribute__((always_inline)) void * aligned_block (
+				size_t		alignment,			// Alignment of the user block
+				size_t		size,				// Size of the user block
+			const	char *		filename,			// Call site of the interposed function
+			const	char *		func_name,
+			const	unsigned int	line_num )
+{
+	void * ptr = NULL;
+
+	if (alignment == 0 || (alignment & (alignment - 1)) != 0)
+	{
+		errno = EINVAL;
+		return NULL;
+	}
+	resolve();
+	ptr = mmwl_memalign(alignment, size, filename, func_name, line_num);
+	if (ptr == NULL)
+		errno = ENOMEM;
+	return ptr;
+}
+
+
+
+
+void * aligned_alloc (size_t alignment, size_t size)
+{
+	return aligned_block(alignment, size, MMWL_SITE);
+}
+
+
+
+
+void * memalign (size_t alignment, size_t size)
+{
+	return aligned_block(alignment, size, MMWL_SITE);
+}
+
+
+
+
+void * valloc (size_t size)
+{
+	return aligned_block(sysconf(_SC_PAGESIZE), size, MMWL_SITE);
+}
+
+
+
+
+void * pvalloc (size_t size)
+{
+	size_t page = sysconf(_SC_PAGESIZE);
+	return aligned_block(page, (size + page - 1) & ~(page - 1), MMWL_SITE);
+}
+
+
+
+
+size_t malloc_usable_size (void * ptr)
+{
+	if (IS_BOOTSTRAP(ptr))
+		return BOOTSTRAP_SIZE_OF(ptr);
+	return mmwl_block_size(ptr);
+}
+
+
+
+
+/*
+ *	Configures guard page mode from MMWL_GUARD, <min>:<max>[:<rate>[:under]]
+ */
+static void preload_guard (const char * env)
+{
+	char * end = NULL;
+	size_t min_size = strtoul(env, &end, 0);
+	size_t max_size = (size_t)-1;
+	unsigned int rate = 1;
+
+	if (*end == ':')
+		max_size = strtoul(end + 1, &end, 0);
+	if (*end == ':')
+		rate = strtoul(end + 1, &end, 0);
+	mmwl_set_guard(min_size, max_size, rate, strcmp(end, ":under") == 0 ? MMWL_GUARD_UNDERFLOW : MMWL_GUARD_OVERFLOW);
+}
+
+
+
+
+/*
+ *	Configures mmwl from the environment before main
+ */
+__attribute__((constructor)) static void mmwl_preload_init (void)
+{
+	const char * env = NULL;
+
+	resolve();
+	mmwl_set_stack_depth((env = getenv("MMWL_STACK_DEPTH")) != NULL ? (unsigned int)atoi(env) : 16);
+	if ((env = getenv("MMWL_SAMPLE_RATE")) != NULL)
+		mmwl_set_sample_rate(strtoul(env, NULL, 0));
+	if ((env = getenv("MMWL_QUARANTINE")) != NULL)
+		mmwl_set_quarantine(strtoul(env, NULL, 0));
+	if ((env = getenv("MMWL_GUARD_POOL")) != NULL)
+		mmwl_set_guard_pool(strtoul(env, NULL, 0));
+	if ((env = getenv("MMWL_GUARD")) != NULL && *env != '\0')
+		preload_guard(env);
+	if ((env = getenv("MMWL_TRACE")) != NULL && *env != '\0')
+		mmwl_trace_start(env);
+	if ((env = getenv("MMWL_SCAN_INTERVAL")) != NULL)
+		mmwl_scanner_start(strtoul(env, NULL, 0), 0);
+	if ((env = getenv("MMWL_STATS")) != NULL)
+		mmwl_stats_start(strtoul(env, NULL, 0));
+}
+
+
+
+
+/*
+ *	Exports the live blocks by stack to the file given by MMWL_EXPORT, [pprof:|folded:]<path>
+ */
+static void preload_export (const char * env)
+{
+	unsigned int format = MMWL_EXPORT_PPROF;
+	int fd = -1;
+
+	if (strncmp(env, "pprof:", 6) == 0)
+		env += 6;
+	else if (strncmp(env, "folded:", 7) == 0)
+	{
+		format = MMWL_EXPORT_FOLDED;
+		env += 7;
+	}
+	if ((fd = open(env, O_WRONLY | O_CREAT | O_TRUNC, 0644)) < 0)
+	{
+		MMWL_LOG_ERROR("export: can not create %s", env);
+		return;
+	}
+	mmwl_export(fd, format | MMWL_EXPORT_STACKS);
+	close(fd);
+}
+
+
+
+
+/*
+ *	Prints the report selected by MMWL_REPORT at exit
+ */
+__attribute__((destructor)) static void mmwl_preload_exit (void)
+{
+	const char * env = getenv("MMWL_REPORT");
+	const char * export = getenv("MMWL_EXPORT");
+
+	mmwl_scanner_stop();
+	mmwl_stats_stop();
+	mmwl_trace_stop();
+	if (export != NULL && *export != '\0')
+		preload_export(export);
+	if (env == NULL || strcmp(env, "status") == 0)
+		mmwl_status();
+	else if (strcmp(env, "sites") == 0)
+		mmwl_status_sites(20);
+	else if (strcmp(env, "histograms") == 0)
+		mmwl_histograms(20);
+	else if (strcmp(env, "leaks") == 0)
+		mmwl_leak_check();
+}
@@ -0,0 +1,636 @@
+/* SPDX-License-Identifier: GPL-2.0 OR MIT */
+/* * Copyright (C) 2019 Abhishek Ghogare <abhishek.ghogare@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of
+ * this software and associated documentation files (the "Software"), to deal in
+ * the Software without restriction, including without limitation the rights to
+ * use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of
+ * the Software, and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+ * FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+ * COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+ * IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+
+/*
+ *	Replay benchmark of mmwl binary event traces (see mmwl_trace.h)
+ *
+ *	usage: mmwl_replay [-s] [-n] trace_file
+ *
+ *	Every malloc, realloc and free of the trace is executed again with the allocator of the process,
+ *	select the allocator under test with LD_PRELOAD. Each traced thread is replayed by a thread of
+ *	its own, in the order of the trace; an operation on a block allocated by another thread waits
+ *	for that allocation. Frees are matched to their allocations by address, in sequence order.
+ *	-s replays every operation in sequence order from a single thread, the run is then fully
+ *	deterministic. Blocks are written once per page unless -n is given, so that the resident size
+ *	reflects the heap layout.
+ *
+ *	Reports the replay time, the peak resident size above the size before the replay, and the ratio
+ *	of that peak to the peak of the requested bytes alive in the trace, as a fragmentation figure.
+ */
+
+#define _GNU_SOURCE				// mremap
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sched.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include "mmwl_trace.h"
+
+#define TOUCH_STRIDE		4096	// Blocks are written every TOUCH_STRIDE bytes
+#define SPIN_COUNT		64	// Checks of a pending block before yielding the cpu
+#define NO_OBJECT		(~0U)	// Object id of a realloc of NULL
+
+
+/*
+ *	Operation to replay, objects are the blocks of the trace numbered in allocation order
+ */
+struct replay_op {
+	unsigned long long	size;			// Size requested
+	unsigned int		obj;			// Object allocated, or freed by MMWL_TRACE_FREE
+	unsigned int		old_obj;		// Object reallocated, NO_OBJECT for a plain allocation
+	unsigned int		op;			// MMWL_TRACE_* operation
+	unsigned int		thread;			// Index of the replaying thread
+};
+
+/*
+ *	Replaying thread, one per traced thread
+ */
+struct replay_thread {
+	pthread_t		handle;			// Thread handle
+	unsigned int		tid;			// Thread id in the trace
+	size_t *		ops;			// Indexes of the operations of the thread, in order
+	size_t			count;			// Number of operations of the thread
+	size_t			capacity;		// Capacity of ops[]
+};
+
+/*
+ *	Address table entry, maps a live address of the trace to its object
+ */
+struct addr_entry {
+	unsigned long long	addr;			// Address of the block, 0 for an empty entry
+	unsigned int		obj;			// Object id
+};
+
+
+static struct mmwl_trace_event * events = NULL;		// Events of the trace
+static size_t event_count = 0;				// Number of events
+static size_t event_capacity = 0;			// Capacity of events[]
+
+static struct replay_op * ops = NULL;			// Operations in sequence order
+static size_t op_count = 0;				// Number of operations
+static unsigned int obj_count = 0;			// Number of objects
+
+static void ** ptrs = NULL;				// Replayed block of every object
+static unsigned char * ready = NULL;			// Non zero once ptrs[] of the object is set
+
+static struct replay_thread * threads = NULL;		// Replaying threads
+static unsigned int thread_count = 0;			// Number of threads
+static unsigned int thread_capacity = 0;		// Capacity of threads[]
+
+static struct addr_entry * table = NULL;		// Open addressing table of live addresses
+static size_t table_size = 0;				// Number of entries, power of two
+static size_t table_used = 0;				// Number of live addresses
+
+static pthread_barrier_t start_barrier;			// Threads start together
+static int touch = 1;					// Write the allocated blocks
+static unsigned long long dropped = 0;			// Events lost while tracing
+static unsigned long long unmatched = 0;		// Frees & reallocs of blocks allocated before the trace
+static unsigned long long peak_live = 0;		// Peak of the requested bytes alive in the trace
+static unsigned long long end_live = 0;			// Requested bytes alive at the end of the trace
+
+
+
+
+/*
+ *	Resizes a zero filled array of the replayer
+ *	The arrays are mapped outside of the allocator under test, so that they are not mixed with the
+ *	replayed blocks and that their pages are returned to the system when released.
+ */
+static void * map_resize (void * ptr, size_t old_size, size_t new_size)
+{
+	if (ptr == NULL)
+		ptr = mmap(NULL, new_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	else
+		ptr = mremap(ptr, old_size, new_size, MREMAP_MAYMOVE);
+	if (ptr == MAP_FAILED)
+	{
+		fprintf(stderr, "out of memory\n");
+		exit(1);
+	}
+	return ptr;
+}
+
+
+
+
+static inline size_t addr_hash (unsigned long long addr)
+{
+	addr ^= addr >> 29;
+	addr *= 0xBF58476D1CE4E5B9ULL;
+	addr ^= addr >> 32;
+	return (size_t)addr & (table_size - 1);
+}
+
+
+
+
+/*
+ *	Returns the slot of an address in the address table, or of the empty slot where it goes
+ */
+static size_t table_find (unsigned long long addr)
+{
+	size_t slot = addr_hash(addr);
+	while (table[slot].addr != 0 && table[slot].addr != addr)
+		slot = (slot + 1) & (table_size - 1);
+	return slot;
+}
+
+
+
+
+/*
+ *	Maps an address to an object, returns the object previously at this address or NO_OBJECT
+ */
+static unsigned int table_insert (unsigned long long addr, unsigned int obj)
+{
+	unsigned int stale = NO_OBJECT;
+	size_t slot = 0;
+
+	if (2 * (table_used + 1) > table_size)
+	{
+		// Grow the table to keep the load under a half
+		struct addr_entry * old = table;
+		size_t old_size = table_size;
+		size_t i = 0;
+
+		table_size = table_size ? 2 * table_size : 1024;
+		table = map_resize(NULL, 0, table_size * sizeof(struct addr_entry));
+		for (i = 0 ; i < old_size ; i++)
+			if (old[i].addr != 0)
+				table[table_find(old[i].addr)] = old[i];
+		if (old != NULL)
+			munmap(old, old_size * sizeof(struct addr_entry));
+	}
+
+	slot = table_find(addr);
+	if (table[slot].addr == 0)
+		table_used++;
+	else
+		stale = table[slot].obj;
+	table[slot].addr = addr;
+	table[slot].obj = obj;
+	return stale;
+}
+
+
+
+
+/*
+ *	Removes an address from the table, returns its object or NO_OBJECT if it is not in the table
+ */
+static unsigned int table_remove (unsigned long long addr)
+{
+	unsigned int obj = NO_OBJECT;
+	size_t slot = 0;
+	size_t next = 0;
+
+	if (addr == 0 || table_size == 0 || table[slot = table_find(addr)].addr == 0)
+		return NO_OBJECT;
+	obj = table[slot].obj;
+	table_used--;
+
+	// Shift back the following entries of the probe sequence
+	for (next = (slot + 1) & (table_size - 1) ; table[next].addr != 0 ; next = (next + 1) & (table_size - 1))
+	{
+		size_t home = addr_hash(table[next].addr);
+		if (((next - home) & (table_size - 1)) >= ((next - slot) & (table_size - 1)))
+		{
+			table[slot] = table[next];
+			slot = next;
+		}
+	}
+	table[slot].addr = 0;
+	return obj;
+}
+
+
+
+
+/*
+ *	Returns the index of the replaying thread of a traced thread, creating it when needed
+ */
+static unsigned int thread_of (unsigned int tid)
+{
+	static unsigned int last = 0;
+	unsigned int i = 0;
+
+	if (last < thread_count && threads[last].tid == tid)
+		return last;
+	for (i = 0 ; i < thread_count ; i++)
+		if (threads[i].tid == tid)
+			return last = i;
+
+	if (thread_count == thread_capacity)
+	{
+		threads = map_resize(threads, thread_capacity * sizeof(struct replay_thread)
+				, (thread_capacity + 64) * sizeof(struct replay_thread));
+		thread_capacity += 64;
+	}
+	threads[thread_count].tid = tid;
+	return last = thread_count++;
+}
+
+
+
+
+/*
+ *	Reads the allocation events of the trace into events[], returns 0 on success
+ */
+static int load_events (const char * path)
+{
+	struct mmwl_trace_file_header header;
+	struct mmwl_trace_event event;
+	FILE * file = fopen(path, "rb");
+
+	if (file == NULL)
+	{
+		perror(path);
+		return -1;
+	}
+	if (fread(&header, sizeof(header), 1, file) != 1
+			|| memcmp(header.magic, MMWL_TRACE_MAGIC, sizeof(MMWL_TRACE_MAGIC)) != 0
+			|| header.version != MMWL_TRACE_VERSION
+			|| header.event_size != sizeof(struct mmwl_trace_event))
+	{
+		fprintf(stderr, "%s: not a mmwl trace of version %u\n", path, MMWL_TRACE_VERSION);
+		fclose(file);
+		return -1;
+	}
+
+	while (fread(&event, sizeof(event), 1, file) == 1)
+	{
+		if (event.op == MMWL_TRACE_SITE)
+		{
+			// Call site names are not needed
+			if (fseek(file, (long)(event.addr + event.old_addr), SEEK_CUR) != 0)
+				break;
+		}
+		else if (event.op == MMWL_TRACE_DROP)
+		{
+			dropped += event.size;
+		}
+		else if (event.op >= MMWL_TRACE_MALLOC && event.op <= MMWL_TRACE_FREE)
+		{
+			if (event_count == event_capacity)
+			{
+				events = map_resize(events, event_capacity * sizeof(struct mmwl_trace_event)
+						, 2 * (event_capacity + 32768) * sizeof(struct mmwl_trace_event));
+				event_capacity = 2 * (event_capacity + 32768);
+			}
+			events[event_count++] = event;
+		}
+	}
+	fclose(file);
+	return 0;
+}
+
+
+
+
+static int by_seq (const void * a, const void * b)
+{
+	const struct mmwl_trace_event * x = a;
+	const struct mmwl_trace_event * y = b;
+	return x->seq < y->seq ? -1 : x->seq > y->seq;
+}
+
+
+
+
+/*
+ *	Turns the events, sorted by sequence number, into operations on objects
+ *	The requested bytes alive are followed on the way to find their peak.
+ */
+static void build_ops (void)
+{
+	unsigned long long * sizes = NULL;
+	unsigned long long live = 0;
+	size_t i = 0;
+
+	ops = map_resize(NULL, 0, (event_count + 1) * sizeof(struct replay_op));
+	sizes = map_resize(NULL, 0, (event_count + 1) * sizeof(unsigned long long));
+
+	for (i = 0 ; i < event_count ; i++)
+	{
+		struct mmwl_trace_event * event = &events[i];
+		struct replay_op * op = &ops[op_count];
+		struct replay_thread * thread = NULL;
+		unsigned int old_obj = NO_OBJECT;
+
+		if (event->op != MMWL_TRACE_MALLOC)
+		{
+			old_obj = table_remove(event->op == MMWL_TRACE_FREE ? event->addr : event->old_addr);
+			if (old_obj == NO_OBJECT && (event->op == MMWL_TRACE_FREE || event->old_addr != 0))
+			{
+				// Allocated before the trace started, a realloc becomes a malloc
+				unmatched++;
+				if (event->op == MMWL_TRACE_FREE)
+					continue;
+			}
+			if (old_obj != NO_OBJECT)
+				live -= sizes[old_obj];
+		}
+
+		op->op		= event->op;
+		op->size	= event->size;
+		op->old_obj	= old_obj;
+		op->thread	= thread_of(event->tid);
+		if (event->op == MMWL_TRACE_FREE)
+		{
+			op->obj = old_obj;
+		}
+		else
+		{
+			// The free of the block previously at this address was lost, it stays alive
+			op->obj = obj_count++;
+			sizes[op->obj] = event->size;
+			live += event->size;
+			table_insert(event->addr, op->obj);
+			if (live > peak_live)
+				peak_live = live;
+		}
+
+		thread = &threads[op->thread];
+		if (thread->count == thread->capacity)
+		{
+			thread->ops = map_resize(thread->ops, thread->capacity * sizeof(size_t)
+					, 2 * (thread->capacity + 512) * sizeof(size_t));
+			thread->capacity = 2 * (thread->capacity + 512);
+		}
+		thread->ops[thread->count++] = op_count++;
+	}
+	end_live = live;
+	munmap(sizes, (event_count + 1) * sizeof(unsigned long long));
+	if (events != NULL)
+		munmap(events, event_capacity * sizeof(struct mmwl_trace_event));
+	if (table != NULL)
+		munmap(table, table_size * sizeof(struct addr_entry));
+	events = NULL;
+	table = NULL;
+}
+
+
+
+
+/*
+ *	Waits until another thread has allocated an object
+ */
+static inline void wait_ready (unsigned int obj)
+{
+	unsigned int spins = 0;
+
+	while (!__atomic_load_n(&ready[obj], __ATOMIC_ACQUIRE))
+	{
+		if (++spins >= SPIN_COUNT)
+		{
+			sched_yield();
+			spins = 0;
+		}
+	}
+}
+
+
+
+
+static inline void touch_block (char * ptr, unsigned long long size)
+{
+	unsigned long long offset = 0;
+
+	if (!touch || ptr == NULL)
+		return;
+	for (offset = 0 ; offset < size ; offset += TOUCH_STRIDE)
+		ptr[offset] = (char)offset;
+	if (size)
+		ptr[size - 1] = 0;
+}
+
+
+
+
+/*
+ *	Executes an operation with the allocator of the process
+ */
+static inline void replay (struct replay_op * op)
+{
+	void * ptr = NULL;
+
+	if (op->old_obj != NO_OBJECT)
+		wait_ready(op->old_obj);
+
+	switch (op->op)
+	{
+	case MMWL_TRACE_MALLOC:
+		ptr = malloc(op->size);
+		break;
+	case MMWL_TRACE_REALLOC:
+		ptr = realloc(op->old_obj != NO_OBJECT ? ptrs[op->old_obj] : NULL, op->size);
+		break;
+	case MMWL_TRACE_FREE:
+		free(ptrs[op->obj]);
+		return;
+	}
+	if (ptr == NULL && op->size != 0)
+	{
+		fprintf(stderr, "out of memory replaying an allocation of %llu bytes\n", op->size);
+		exit(1);
+	}
+	touch_block(ptr, op->size);
+	ptrs[op->obj] = ptr;
+	__atomic_store_n(&ready[op->obj], 1, __ATOMIC_RELEASE);
+}
+
+
+
+
+static void * replay_thread (void * arg)
+{
+	struct replay_thread * thread = arg;
+	size_t i = 0;
+
+	pthread_barrier_wait(&start_barrier);
+	for (i = 0 ; i < thread->count ; i++)
+		replay(&ops[thread->ops[i]]);
+	return NULL;
+}
+
+
+
+
+/*
+ *	Returns a field of /proc/self/status in KiB, 0 if it is not found
+ */
+static unsigned long long proc_status_kb (const char * field)
+{
+	char line[256];
+	unsigned long long value = 0;
+	size_t length = strlen(field);
+	FILE * file = fopen("/proc/self/status", "r");
+
+	if (file == NULL)
+		return 0;
+	while (fgets(line, sizeof(line), file) != NULL)
+	{
+		if (strncmp(line, field, length) == 0 && line[length] == ':')
+		{
+			value = strtoull(line + length + 1, NULL, 10);
+			break;
+		}
+	}
+	fclose(file);
+	return value;
+}
+
+
+
+
+/*
+ *	Resets the peak resident size of the process, returns 0 on success
+ */
+static int reset_peak_rss (void)
+{
+	FILE * file = fopen("/proc/self/clear_refs", "w");
+	int ret = -1;
+
+	if (file != NULL)
+	{
+		ret = fputs("5", file) < 0 ? -1 : 0;
+		if (fclose(file) != 0)
+			ret = -1;
+	}
+	return ret;
+}
+
+
+
+
+int main (int argc, char ** argv)
+{
+	struct timespec start, end;
+	struct rusage usage;
+	unsigned long long base_rss = 0;
+	unsigned long long peak_rss = 0;
+	unsigned long long end_rss = 0;
+	double seconds = 0;
+	int serial = 0;
+	int peak_reset = 0;
+	int opt = 0;
+	size_t i = 0;
+
+	while ((opt = getopt(argc, argv, "sn")) != -1)
+	{
+		switch (opt)
+		{
+		case 's':
+			serial = 1;
+			break;
+		case 'n':
+			touch = 0;
+			break;
+		default:
+			fprintf(stderr, "usage: %s [-s] [-n] trace_file\n", argv[0]);
+			return 1;
+		}
+	}
+	if (optind + 1 != argc)
+	{
+		fprintf(stderr, "usage: %s [-s] [-n] trace_file\n", argv[0]);
+		return 1;
+	}
+
+	if (load_events(argv[optind]) != 0)
+		return 1;
+	qsort(events, event_count, sizeof(struct mmwl_trace_event), by_seq);
+	build_ops();
+
+	// Touch the bookkeeping before the baseline, only the replayed blocks count then
+	ptrs = map_resize(NULL, 0, (obj_count + 1) * sizeof(void *));
+	ready = map_resize(NULL, 0, obj_count + 1);
+	memset(ptrs, 0, (obj_count + 1) * sizeof(void *));
+	memset(ready, 0, obj_count + 1);
+
+	if (!serial)
+	{
+		if (pthread_barrier_init(&start_barrier, NULL, thread_count + 1) != 0)
+		{
+			fprintf(stderr, "can not create the start barrier\n");
+			return 1;
+		}
+		for (i = 0 ; i < thread_count ; i++)
+		{
+			if (pthread_create(&threads[i].handle, NULL, replay_thread, &threads[i]) != 0)
+			{
+				fprintf(stderr, "can not create replay thread %zu of %u\n", i, thread_count);
+				return 1;
+			}
+		}
+	}
+
+	base_rss = proc_status_kb("VmRSS");
+	peak_reset = reset_peak_rss() == 0;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	if (serial)
+	{
+		for (i = 0 ; i < op_count ; i++)
+			replay(&ops[i]);
+	}
+	else
+	{
+		pthread_barrier_wait(&start_barrier);
+		for (i = 0 ; i < thread_count ; i++)
+			pthread_join(threads[i].handle, NULL);
+	}
+	clock_gettime(CLOCK_MONOTONIC, &end);
+
+	end_rss = proc_status_kb("VmRSS");
+	if (peak_reset)
+	{
+		peak_rss = proc_status_kb("VmHWM");
+	}
+	else
+	{
+		// Peak of the whole run, loading the trace included
+		getrusage(RUSAGE_SELF, &usage);
+		peak_rss = usage.ru_maxrss;
+	}
+	peak_rss = peak_rss > base_rss ? peak_rss - base_rss : 0;
+	end_rss = end_rss > base_rss ? end_rss - base_rss : 0;
+	seconds = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+
+	printf("threads                 : %u%s\n", serial ? 1 : thread_count, serial ? " (serial)" : "");
+	printf("operations              : %zu\n", op_count);
+	printf("time                    : %.3f s\n", seconds);
+	printf("throughput              : %.0f ops/s\n", seconds > 0 ? op_count / seconds : 0);
+	printf("peak live size          : %llu KiB\n", peak_live / 1024);
+	printf("peak rss                : %llu KiB%s\n", peak_rss, peak_reset ? "" : ", includes loading the trace");
+	printf("fragmentation           : %.2f\n", peak_live ? peak_rss * 1024.0 / peak_live : 0);
+	printf("end live size           : %llu KiB\n", end_live / 1024);
+	printf("end rss                 : %llu KiB\n", end_rss);
+	if (unmatched)
+		printf("unmatched frees         : %llu, allocated before the trace started\n", unmatched);
+	if (dropped)
+		printf("dropped events          : %llu, the replay is not faithful\n", dropped);
+	return 0;
+}
@@ -0,0 +1,187 @@
+/* SPDX-License-Identifier: GPL-2.0 OR MIT */
+/* * Copyright (C) 2019 Abhishek Ghogare <abhishek.ghogare@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of
+ * this software and associated documentation files (the "Software"), to deal in
+ * the Software without restriction, including without limitation the rights to
+ * use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of
+ * the Software, and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+ * FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+ * COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+ * IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+
+
+/*
+ *	Reader of the mmwl shared memory statistics page (see mmwl_stats.h)
+ *
+ *	usage: mmwl_stat [-i interval_ms] [-c count] [-n top_n] pid
+ *
+ *	Prints one line of counters every interval, and the top_n call sites holding the most memory
+ *	when top_n is not 0. The page is mapped read only, the observed process is not disturbed.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <signal.h>
+#include <sched.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include "mmwl_stats.h"
+
+#define DEFAULT_INTERVAL_MS	1000	// Default period of the samples
+#define MAX_RETRIES		1000	// Copies tried before giving up on a page being rewritten
+
+
+/*
+ *	Copy a consistent snapshot of the page, returns 0 on success
+ */
+static int read_page (const struct mmwl_stats_page * page, struct mmwl_stats_page * copy)
+{
+	unsigned long long seq = 0;
+	int i = 0;
+
+	for (i = 0 ; i < MAX_RETRIES ; i++)
+	{
+		seq = __atomic_load_n(&page->seq, __ATOMIC_ACQUIRE);
+		if (seq & 1)
+		{
+			sched_yield();
+			continue;				// Being rewritten
+		}
+		memcpy(copy, page, sizeof(*copy));
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		if (__atomic_load_n(&page->seq, __ATOMIC_RELAXED) == seq)
+			return 0;
+	}
+	return -1;
+}
+
+
+
+
+/*
+ *	Print the call sites of a snapshot
+ */
+static void print_sites (const struct mmwl_stats_page * snap, unsigned int top_n)
+{
+	unsigned int i = 0;
+
+	for (i = 0 ; i < snap->nr_sites && i < top_n ; i++)
+	{
+		const struct mmwl_stats_site * site = &snap->sites[i];
+		printf("\t%12llu %10llu %12llu %10llu %10llu  %s:%u:%s\n"
+				, site->live_size
+				, site->live_count
+				, site->peak_size
+				, site->alloc_count
+				, site->free_count
+				, site->filename
+				, site->line_num
+				, site->func_name);
+	}
+}
+
+
+
+
+int main (int argc, char ** argv)
+{
+	struct mmwl_stats_page * page = NULL;
+	struct mmwl_stats_page snap, prev;
+	unsigned long long interval_ms = DEFAULT_INTERVAL_MS;
+	unsigned long long count = 0;
+	unsigned long long n = 0;
+	unsigned int top_n = 0;
+	char name[32];
+	int pid = 0;
+	int fd = -1;
+	int opt = 0;
+
+	while ((opt = getopt(argc, argv, "i:c:n:")) != -1)
+	{
+		switch (opt)
+		{
+		case 'i':
+			interval_ms = strtoull(optarg, NULL, 0);
+			break;
+		case 'c':
+			count = strtoull(optarg, NULL, 0);
+			break;
+		case 'n':
+			top_n = strtoul(optarg, NULL, 0);
+			break;
+		default:
+			fprintf(stderr, "usage: %s [-i interval_ms] [-c count] [-n top_n] pid\n", argv[0]);
+			return 1;
+		}
+	}
+	if (optind + 1 != argc || interval_ms == 0 || (pid = atoi(argv[optind])) <= 0)
+	{
+		fprintf(stderr, "usage: %s [-i interval_ms] [-c count] [-n top_n] pid\n", argv[0]);
+		return 1;
+	}
+
+	snprintf(name, sizeof(name), MMWL_STATS_NAME, pid);
+	if ((fd = shm_open(name, O_RDONLY, 0)) < 0)
+	{
+		fprintf(stderr, "%s: %s (is MMWL_STATS set or mmwl_stats_start called?)\n", name, strerror(errno));
+		return 1;
+	}
+	page = mmap(NULL, sizeof(*page), PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (page == MAP_FAILED || read_page(page, &snap) != 0
+			|| memcmp(snap.magic, MMWL_STATS_MAGIC, sizeof(MMWL_STATS_MAGIC)) != 0
+			|| snap.version != MMWL_STATS_VERSION
+			|| snap.page_size != sizeof(struct mmwl_stats_page))
+	{
+		fprintf(stderr, "%s: not a mmwl statistics page of version %u\n", name, MMWL_STATS_VERSION);
+		return 1;
+	}
+
+	printf("%10s %14s %12s %12s %12s %12s\n", "time_ms", "live_size", "live_count", "allocs/s", "frees/s", "quarantine");
+	prev = snap;
+	for (n = 0 ; count == 0 || n < count ; n++)
+	{
+		unsigned long long elapsed = 0;
+
+		if (n != 0)
+		{
+			usleep(interval_ms * 1000);
+			prev = snap;
+			if (read_page(page, &snap) != 0)
+			{
+				fprintf(stderr, "%s: page is not updated\n", name);
+				return 1;
+			}
+		}
+		elapsed = snap.timestamp - prev.timestamp;
+		printf("%10llu %14llu %12llu %12llu %12llu %12llu\n"
+				, snap.timestamp / 1000000ULL
+				, snap.alloc_size - snap.free_size
+				, snap.alloc_count - snap.free_count
+				, elapsed ? (snap.alloc_count - prev.alloc_count) * 1000000000ULL / elapsed : 0
+				, elapsed ? (snap.free_count - prev.free_count) * 1000000000ULL / elapsed : 0
+				, snap.quarantine_size);
+		if (snap.sample_rate != 0 && n == 0)
+			printf("sizes of sampled blocks, estimated live size %llu\n", snap.est_alloc_size - snap.est_free_size);
+		print_sites(&snap, top_n);
+		fflush(stdout);
+		if (kill(pid, 0) != 0 && errno == ESRCH)
+			break;					// Process is gone, the page is stale
+	}
+	munmap(page, sizeof(*page));
+	return 0;
+}
@@ -0,0 +1,82 @@
+/* SPDX-License-Identifier: GPL-2.0 OR MIT */
+/* * Copyright (C) 2019 Abhishek Ghogare <abhishek.ghogare@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of
+ * this software and associated documentation files (the "Software"), to deal in
+ * the Software without restriction, including without limitation the rights to
+ * use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of
+ * the Software, and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+ * FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+ * COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+ * IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+
+
+#ifndef MMWL_STATS_H_
+#define MMWL_STATS_H_
+
+/*
+ *	Shared memory statistics page (user side)
+ *
+ *	mmwl_stats_start publishes the counters of the process in the shared memory object
+ *	"/mmwl.<pid>" (/dev/shm/mmwl.<pid>), rewritten every interval by a publisher thread. The
+ *	allocating threads do not take part in it. A reader maps the object read only and copies it
+ *	under the sequence number: 'seq' is odd while the page is rewritten, a copy is consistent
+ *	if 'seq' was even and unchanged before and after it.
+ */
+
+#define MMWL_STATS_MAGIC	"MMWLSTA"		// Page magic, including the null character
+#define MMWL_STATS_VERSION	1			// Version of the format
+#define MMWL_STATS_NAME		"/mmwl.%d"		// Name of the shared memory object of a pid
+#define MMWL_STATS_SITES	32			// Call sites published, by live size
+#define MMWL_STATS_NAME_LEN	48			// Size of the file & function names, null terminated
+
+/*
+ *	Counters of a call site
+ */
+struct mmwl_stats_site {
+	unsigned long long	live_size;		// Size of the blocks currently allocated from the site
+	unsigned long long	live_count;		// Number of blocks currently allocated from the site
+	unsigned long long	peak_size;		// Highest live size seen
+	unsigned long long	alloc_count;		// Number of blocks ever allocated from the site
+	unsigned long long	free_count;		// Number of blocks allocated from the site and freed
+	unsigned int		line_num;		// Line number of the site
+	char			filename[MMWL_STATS_NAME_LEN];	// End of the source file name
+	char			func_name[MMWL_STATS_NAME_LEN];	// Function name, truncated
+};
+
+/*
+ *	Statistics page
+ */
+struct mmwl_stats_page {
+	char			magic[8];		// MMWL_STATS_MAGIC
+	unsigned int		version;		// MMWL_STATS_VERSION
+	unsigned int		page_size;		// sizeof(struct mmwl_stats_page)
+	unsigned long long	seq;			// Sequence number, odd while the page is rewritten
+	unsigned long long	timestamp;		// CLOCK_MONOTONIC time of the last update in nanoseconds
+	unsigned int		pid;			// Publishing process
+	unsigned int		interval_ms;		// Update period
+	unsigned long long	alloc_count;		// Tracked blocks allocated
+	unsigned long long	free_count;		// Tracked blocks freed
+	unsigned long long	alloc_size;		// Bytes of tracked blocks allocated
+	unsigned long long	free_size;		// Bytes of tracked blocks freed
+	unsigned long long	est_alloc_size;		// Estimated bytes of all the blocks allocated
+	unsigned long long	est_free_size;		// Estimated bytes of all the blocks freed
+	unsigned long long	quarantine_size;	// Bytes of freed blocks held in quarantine
+	unsigned int		sample_rate;		// log2 of the sample rate in bytes, 0 if every block is tracked
+	unsigned int		site_count;		// Call sites registered
+	unsigned int		nr_sites;		// Used entries of sites[]
+	unsigned int		reserved;
+	struct mmwl_stats_site	sites[MMWL_STATS_SITES];	// Call sites holding the most memory
+};
+
+#endif //MMWL_STATS_H_
@@ -0,0 +1,72 @@
+/* SPDX-License-Identifier: GPL-2.0 OR MIT */
+/* * Copyright (C) 2019 Abhishek Ghogare <abhishek.ghogare@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of
+ * this software and associated documentation files (the "Software"), to deal in
+ * the Software without restriction, including without limitation the rights to
+ * use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of
+ * the Software, and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+ * FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+ * COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+ * IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+
+#ifndef MMWL_TRACE_H_
+#define MMWL_TRACE_H_
+
+/*
+ *	Binary event trace file format
+ *
+ *	The file starts with a struct mmwl_trace_file_header followed by fixed size
+ *	struct mmwl_trace_event records. Records of different threads are written in batches, hence
+ *	they are ordered by timestamp only within a thread. 'seq' gives the global order of the
+ *	operations: a free or a reallocation is numbered before the block is released, an allocation
+ *	after the block is obtained, so the release of an address comes before its reuse by any thread.
+ *	A MMWL_TRACE_SITE record defines a call site: site_id is the id, line is the line number and
+ *	it is followed by 'addr' bytes of file name and 'old_addr' bytes of function name, without
+ *	terminating null characters. A site is defined before the first batch using it.
+ */
+
+#define MMWL_TRACE_MAGIC	"MMWLTRC"		// File magic, including the null character
+#define MMWL_TRACE_VERSION	2			// Version of the format
+
+#define MMWL_TRACE_MALLOC	1			// Block 'addr' of 'size' bytes allocated
+#define MMWL_TRACE_REALLOC	2			// Block 'old_addr' reallocated to 'addr' of 'size' bytes
+#define MMWL_TRACE_FREE		3			// Block 'addr' of 'size' bytes freed
+#define MMWL_TRACE_SITE		4			// Call site definition
+#define MMWL_TRACE_DROP		5			// 'size' events of thread 'tid' were lost
+
+/*
+ *	Header of the trace file
+ */
+struct mmwl_trace_file_header {
+	char			magic[8];		// MMWL_TRACE_MAGIC
+	unsigned int		version;		// MMWL_TRACE_VERSION
+	unsigned int		event_size;		// sizeof(struct mmwl_trace_event)
+};
+
+/*
+ *	Trace record
+ */
+struct mmwl_trace_event {
+	unsigned long long	timestamp;		// CLOCK_MONOTONIC time in nanoseconds
+	unsigned long long	seq;			// Global sequence number of the operation
+	unsigned long long	addr;			// Address of the user block
+	unsigned long long	old_addr;		// Previous address of a reallocated block
+	unsigned long long	size;			// Size of the user block
+	unsigned int		site_id;		// Call site of the operation
+	unsigned int		tid;			// Thread id
+	unsigned int		op;			// MMWL_TRACE_* operation
+	unsigned int		line;			// Line number of a MMWL_TRACE_SITE
+};
+
+#endif //MMWL_TRACE_H_
@@ -1,9 +1,18 @@
+#define _GNU_SOURCE
 #include <stdio.h>
+#include <errno.h>
+#include <stdint.h>
 #include <string.h>
 #include <stdlib.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
 #include "mmwl.h"
+#include "mmwl_stats.h"
+#include "test.h"
 
-int main () {
+static void test_status (void) {
 	char* str1 = (char *) malloc(60);
 	char* str2 = (char *) malloc(1200);
 	char* str3 = NULL;
@@ -22,7 +31,599 @@ int main () {
 	free(str1);
 
 	mmwl_status();
+	mmwl_status_sites(10);
 
 	free(str3);
-	return 0;
+}
+
+/* A pointer inside a block finds the block */
+static void test_lookup_interior (void) {
+	struct mmwl_block_info info;
+	char * block = malloc(100);
+
+	CHECK(mmwl_lookup(block + 37, &info) == 0);
+	CHECK(info.addr == block && info.size == 100);
+	CHECK(strcmp(info.func_name, "test_lookup_interior") == 0);
+	CHECK(mmwl_lookup(block + 100, &info) == -1);
+	free(block);
+	CHECK(mmwl_lookup(block + 37, &info) == -1);
+}
+
+/* A size which would overflow with the header & redzones fails, a reallocated block is left alone */
+static void test_huge_size (void) {
+	volatile size_t huge = SIZE_MAX - 8;
+	char * block = malloc(100);
+
+	errno = 0;
+	CHECK(malloc(huge) == NULL && errno == ENOMEM);
+	errno = 0;
+	CHECK(calloc(2, SIZE_MAX / 2 + 1) == NULL && errno == ENOMEM);
+	errno = 0;
+	CHECK(mmwl_memalign(64, huge, __FILE__, __FUNCTION__, __LINE__) == NULL && errno == ENOMEM);
+	errno = 0;
+	CHECK(realloc(block, huge) == NULL && errno == ENOMEM);
+	CHECK(mmwl_block_size(block) == 100);
+	free(block);
+}
+
+/* The scanner does not accept an interval it would spin on */
+static void test_scanner_interval (void) {
+	capture_start();
+	CHECK(mmwl_scanner_start(0, 0) == -1);
+	CHECK(capture_end("interval must be at least 1 ms"));
+}
+
+/* Live bytes of the call sites of func, read back from the folded export by site */
+static unsigned long long site_bytes (const char * func) {
+	FILE * out = tmpfile();
+	char line[512];
+	size_t len = strlen(func);
+	unsigned long long total = 0;
+	char * space;
+
+	mmwl_export(fileno(out), MMWL_EXPORT_FOLDED);
+	rewind(out);
+	while (fgets(line, sizeof(line), out) != NULL) {
+		space = strrchr(line, ' ');
+		if (space != NULL && strncmp(line, func, len) == 0 && line[len] == ' ')
+			total += strtoull(space + 1, NULL, 10);
+	}
+	fclose(out);
+	return total;
+}
+
+#ifndef MMWL_META_OOL
+/* With sampling the estimated live bytes of a site stay close to the real ones */
+static void test_sampling (void) {
+	static char * blocks[20000];
+	unsigned long long live;
+	int i;
+
+	mmwl_set_sample_rate(4096);
+	for (i = 0; i < 20000; i++)
+		blocks[i] = malloc(64);
+	live = site_bytes("test_sampling");
+	CHECK(live > 20000 * 64 * 8 / 10 && live < 20000 * 64 * 12 / 10);
+	for (i = 0; i < 20000; i++)
+		free(blocks[i]);
+	memset(blocks, 0, sizeof(blocks));	/* stale pointers would root later blocks */
+	CHECK(site_bytes("test_sampling") == 0);
+	mmwl_set_sample_rate(0);
+}
+#endif
+
+static __attribute__((noinline)) char * depot_alloc (void) {
+	return malloc(100);
+}
+
+static __attribute__((noinline)) char * depot_alloc_other (void) {
+	return depot_alloc();
+}
+
+/* Blocks allocated through the same path share their depot stack, another path gets its own */
+static void test_depot_dedup (void) {
+	struct mmwl_block_info info;
+	char * blocks[3];
+	unsigned int ids[3];
+	int i;
+
+	for (i = 0; i < 2; i++)
+		blocks[i] = depot_alloc();
+	blocks[2] = depot_alloc_other();
+	for (i = 0; i < 3; i++) {
+		CHECK(mmwl_lookup(blocks[i], &info) == 0);
+		ids[i] = info.stack_id;
+	}
+	CHECK(ids[0] != 0 && ids[0] == ids[1]);
+	CHECK(ids[2] != 0 && ids[2] != ids[0]);
+	for (i = 0; i < 3; i++)
+		free(blocks[i]);
+}
+
+/* A live capture lists every block allocated, a block freed afterwards is left out of the next */
+static void test_live_capture (void) {
+	struct mmwl_live_set * set;
+	char * blocks[2] = { malloc(123), malloc(456) };
+	size_t count, i;
+	int found = 0;
+
+	set = mmwl_live_capture();
+	CHECK(set != NULL && set->missed == 0);
+	if (set == NULL)
+		return;
+	count = set->count;
+	for (i = 0; i < set->count; i++) {
+		if (set->blocks[i].addr == blocks[0])
+			found += set->blocks[i].size == 123 && strcmp(set->blocks[i].func_name, "test_live_capture") == 0;
+		if (set->blocks[i].addr == blocks[1])
+			found += set->blocks[i].size == 456;
+	}
+	CHECK(found == 2);
+	mmwl_live_release(set);
+
+	free(blocks[1]);
+	set = mmwl_live_capture();
+	CHECK(set != NULL && set->count == count - 1);
+	for (i = 0; set != NULL && i < set->count; i++)
+		CHECK(set->blocks[i].addr != blocks[1]);
+	mmwl_live_release(set);
+	free(blocks[0]);
+}
+
+/* Runs a command, returns non zero if its output contains text */
+static int command_output (const char * command, const char * text) {
+	FILE * out = popen(command, "r");
+	size_t len;
+
+	if (out == NULL)
+		return 0;
+	len = fread(captured, 1, sizeof(captured) - 1, out);
+	captured[len] = '\0';
+	pclose(out);
+	fputs(captured, stdout);
+	return strstr(captured, text) != NULL;
+}
+
+/* Traces two allocations and a free into a new temporary file */
+static void trace_some (char * path) {
+	int fd = mkstemp(path);
+	char * blocks[2];
+
+	close(fd);
+	CHECK(mmwl_trace_start(path) == 0);
+	blocks[0] = malloc(1000);
+	blocks[1] = malloc(2000);
+	free(blocks[0]);
+	mmwl_trace_stop();
+	free(blocks[1]);
+}
+
+/* The analyzer reads back the events of a trace */
+static void test_trace_analyze (void) {
+	char path[] = "/tmp/mmwl_test_XXXXXX";
+	char command[64];
+
+	trace_some(path);
+	snprintf(command, sizeof(command), "./mmwl_analyze %s", path);
+	CHECK(command_output(command, "mallocs                 : 2\n"));
+	CHECK(reported("frees                   : 1\n"));
+	CHECK(reported("leaked size             : 2000\n"));
+	CHECK(reported("@trace_some:"));
+	unlink(path);
+}
+
+/* The overhead of a block is its header and redzones, it grows with the redzones */
+static void test_block_overhead (void) {
+	char * small = malloc(10);
+	char * large = malloc(10000);
+	char * wide;
+
+	CHECK(mmwl_block_overhead(NULL) == 0);
+	CHECK(mmwl_block_overhead(small) >= 64 + 64);
+	CHECK(mmwl_block_overhead(large) == mmwl_block_overhead(small));
+	mmwl_set_redzones(256, 128);
+	wide = malloc(10);
+	CHECK(mmwl_block_overhead(wide) == mmwl_block_overhead(small) + 192 + 64);
+	mmwl_set_redzones(64, 64);
+	free(wide);
+	free(large);
+	free(small);
+}
+
+/* A write to the first or the last byte of the foot redzone is found on free, whatever its width */
+static void test_redzone_widths (void) {
+	static const size_t widths[] = { 16, 64, 256, 4096 };
+	char * block;
+	size_t i;
+
+	for (i = 0; i < sizeof(widths) / sizeof(widths[0]); i++) {
+		mmwl_set_redzones(widths[i], widths[i]);
+		block = malloc(100);
+		block[100] = 'X';
+		capture_start();
+		free(block);
+		CHECK(capture_end("signature mismatch"));
+		block = malloc(100);
+		block[100 + widths[i] - 1] = 'X';
+		capture_start();
+		free(block);
+		CHECK(capture_end("signature mismatch"));
+		block = malloc(100);
+		capture_start();
+		free(block);
+		CHECK(!capture_end("signature mismatch"));
+	}
+	mmwl_set_redzones(64, 64);
+}
+
+/* The scanner reports a block overflowed while it is still allocated */
+static void test_scanner_report (void) {
+	char * block = malloc(100);
+	char saved = block[100];
+	char text[64];
+
+	snprintf(text, sizeof(text), "scanner: signature mismatch, addr:%p", (void *)block);
+	block[100] = 'X';
+	capture_start();
+	CHECK(mmwl_scanner_start(1, 0) == 0);
+	usleep(200 * 1000);
+	mmwl_scanner_stop();
+	CHECK(capture_end(text));
+	CHECK(reported("block origin @test_scanner_report:"));
+	block[100] = saved;
+	free(block);
+}
+
+/* The sizes of the blocks freed at a site land in their power of two buckets */
+static void test_histograms (void) {
+	int i;
+
+	for (i = 0; i < 1010; i++)
+		free(malloc(i < 1000 ? 300 : 5000));
+	capture_info_start();
+	mmwl_histograms(32);
+	capture_end("");
+	CHECK(reported("allocs:1010 frees:1010 median size:<512 bytes median lifetime:"));
+	CHECK(reported("@test_histograms:"));
+	CHECK(reported("\t\tbytes   : <512:1000 <8192:10\n"));
+}
+
+/* The statistics page of the process holds its counters and its largest call site */
+static void test_stats_page (void) {
+	volatile struct mmwl_stats_page * page;
+	struct mmwl_stats_page copy;
+	unsigned long long seq;
+	char name[32];
+	char * block = malloc(1 << 20);
+	int found = 0;
+	int fd;
+	unsigned int i;
+
+	CHECK(mmwl_stats_start(10) == 0);
+	usleep(100 * 1000);
+	snprintf(name, sizeof(name), MMWL_STATS_NAME, (int)getpid());
+	fd = shm_open(name, O_RDONLY, 0);
+	CHECK(fd >= 0);
+	if (fd < 0) {
+		mmwl_stats_stop();
+		free(block);
+		return;
+	}
+	page = mmap(NULL, sizeof(*page), PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	do {
+		while ((seq = page->seq) & 1)
+			usleep(1000);
+		__sync_synchronize();
+		memcpy(&copy, (void *)page, sizeof(copy));
+		__sync_synchronize();
+	} while (page->seq != seq);
+	munmap((void *)page, sizeof(*page));
+	mmwl_stats_stop();
+
+	CHECK(strcmp(copy.magic, MMWL_STATS_MAGIC) == 0 && copy.version == MMWL_STATS_VERSION);
+	CHECK(copy.pid == (unsigned int)getpid() && copy.interval_ms == 10);
+	CHECK(copy.alloc_count > copy.free_count && copy.alloc_size - copy.free_size >= 1 << 20);
+	for (i = 0; i < copy.nr_sites && i < MMWL_STATS_SITES; i++)
+		found += strcmp(copy.sites[i].func_name, "test_stats_page") == 0
+			&& copy.sites[i].live_size == 1 << 20 && copy.sites[i].live_count == 1;
+	CHECK(found == 1);
+	free(block);
+}
+
+/* A diff counts the blocks of its snapshot interval which are still allocated */
+static void test_snapshot_diff (void) {
+	unsigned int a = mmwl_snapshot();
+	char * kept = malloc(500);
+	char * freed = malloc(700);
+	unsigned int b = mmwl_snapshot();
+	char * later = malloc(900);
+
+	CHECK(b > a);
+	free(freed);
+	capture_info_start();
+	CHECK(mmwl_diff(a, b) == 1);
+	CHECK(capture_end("total size              : 500\n"));
+	CHECK(reported("\tsize:500 count:1 @test_snapshot_diff:"));
+	capture_info_start();
+	CHECK(mmwl_diff(b, 0) == 1);
+	CHECK(capture_end("total size              : 900\n"));
+	capture_info_start();
+	CHECK(mmwl_diff(a, 0) == 2);
+	CHECK(capture_end("total size              : 1400\n"));
+	free(kept);
+	free(later);
+}
+
+/* Exported, so that the stack export names it */
+__attribute__((noinline)) char * export_leaf (void) {
+	return malloc(4321);
+}
+
+/* Reads the output of an export into captured, returns its length */
+static size_t export_text (unsigned int format) {
+	FILE * out = tmpfile();
+	size_t len;
+
+	CHECK(mmwl_export(fileno(out), format) == 0);
+	rewind(out);
+	len = fread(captured, 1, sizeof(captured) - 1, out);
+	captured[len] = '\0';
+	fclose(out);
+	return len;
+}
+
+/* A block is found in each export format, by call site and by stack */
+static void test_export (void) {
+	char * block = export_leaf();
+	size_t len;
+
+	CHECK(site_bytes("export_leaf") == 4321);
+	export_text(MMWL_EXPORT_FOLDED | MMWL_EXPORT_STACKS);
+	CHECK(reported(";export_leaf 4321\n"));
+	CHECK(captured[0] != ';' && !reported("\n;"));
+	len = export_text(MMWL_EXPORT_PPROF);
+	CHECK(memmem(captured, len, "inuse_space", 11) != NULL);
+	CHECK(memmem(captured, len, "export_leaf", 11) != NULL);
+	capture_start();
+	CHECK(mmwl_export(1, 7) == -1);
+	CHECK(capture_end("unknown format"));
+	free(block);
+	CHECK(site_bytes("export_leaf") == 0);
+}
+
+/* Writes to addr in a child process, returns the signal which killed it, 0 if none */
+static int child_write (char * addr) {
+	pid_t pid = fork();
+	int status = 0;
+
+	if (pid == 0) {
+		*(volatile char *)addr = 'X';
+		_exit(0);
+	}
+	waitpid(pid, &status, 0);
+	return WIFSIGNALED(status) ? WTERMSIG(status) : 0;
+}
+
+/* A guarded block faults on the first byte past its end, or before its header in underflow mode */
+static void test_guard_pages (void) {
+	uintptr_t page = sysconf(_SC_PAGESIZE);
+	char * block;
+
+	mmwl_set_guard(256, 256, 1, MMWL_GUARD_OVERFLOW);
+	block = malloc(256);
+	CHECK(child_write(block + 255) == 0);
+	CHECK(child_write(block + 256) == SIGSEGV);
+	free(block);
+	CHECK(child_write(block) == SIGSEGV);
+
+	mmwl_set_guard(256, 256, 1, MMWL_GUARD_UNDERFLOW);
+	block = malloc(256);
+	CHECK(child_write(block + 255) == 0);
+	CHECK(child_write((char *)((uintptr_t)block & ~(page - 1)) - 1) == SIGSEGV);
+	free(block);
+	mmwl_set_guard(0, 0, 0, MMWL_GUARD_OVERFLOW);
+
+	block = malloc(256);
+	CHECK(child_write(block + 256) == 0);		/* foot redzone, found on free only */
+	free(block);
+}
+
+static int budget_calls = 0;
+static long long budget_live = 0;
+
+static void budget_over (const char * tag, long long live_size, unsigned long long budget) {
+	budget_calls += strcmp(tag, "test_budget") == 0 && budget == 10000;
+	budget_live = live_size;
+}
+
+/* Allocates 100 blocks of 1000 bytes under the budgeted tag */
+static void budget_fill (char ** blocks) {
+	MMWL_TAG_SCOPE("test_budget");
+	int i;
+
+	for (i = 0; i < 100; i++)
+		blocks[i] = malloc(1000);
+}
+
+/* The budget callback fires once when the tag goes over, and again only once it went back under */
+static void test_tag_budget (void) {
+	char * blocks[100];
+	int i;
+
+	CHECK(mmwl_tag_budget(0, 10000, budget_over) == -1);
+	CHECK(mmwl_tag_budget(mmwl_tag("test_budget"), 10000, budget_over) == 0);
+	budget_fill(blocks);
+	CHECK(budget_calls == 1 && budget_live > 10000);
+	for (i = 0; i < 100; i++)
+		free(blocks[i]);
+	CHECK(budget_calls == 1);
+	budget_fill(blocks);
+	CHECK(budget_calls == 2);
+	for (i = 0; i < 100; i++)
+		free(blocks[i]);
+	mmwl_tag_budget(mmwl_tag("test_budget"), 0, NULL);
+}
+
+/* The replay runs the operations of a trace again */
+static void test_trace_replay (void) {
+	char path[] = "/tmp/mmwl_test_XXXXXX";
+	char command[64];
+
+	trace_some(path);
+	snprintf(command, sizeof(command), "./mmwl_replay -s %s", path);
+	CHECK(command_output(command, "operations              : 3\n"));
+	CHECK(reported("threads                 : 1 (serial)\n"));
+	CHECK(reported("peak live size          : 2 KiB\n"));
+	snprintf(command, sizeof(command), "./mmwl_replay -n %s", path);
+	CHECK(command_output(command, "operations              : 3\n"));
+	unlink(path);
+}
+
+/* A pointer which is not a block is reported and left alone */
+static void test_wild_free (void) {
+	char * block = malloc(100);
+
+	memset(block, 0, 100);
+	capture_start();
+	free(block + 32);
+	CHECK(capture_end("not an allocated block"));
+	CHECK(mmwl_block_size(block) == 100);
+	free(block);
+}
+
+#ifdef MMWL_META_OOL
+/* Headers are out of line, a block freed twice is found unknown without reading it */
+static void test_double_free (void) {
+	char * block = malloc(100);
+
+	free(block);
+	capture_start();
+	free(block);
+	CHECK(capture_end("not an allocated block"));
+}
+#endif
+
+/* A block written after free is reported when it leaves the quarantine over budget */
+static void test_quarantine_eviction (void) {
+	char * block = malloc(100);
+	char * others[64];
+	int i;
+
+	mmwl_set_quarantine(4096);
+	free(block);
+	block[10] = 'X';
+	capture_start();
+	for (i = 0; i < 64; i++)
+		others[i] = malloc(100);
+	for (i = 0; i < 64; i++)
+		free(others[i]);
+	CHECK(capture_end("write after free"));
+	mmwl_set_quarantine(0);
+}
+
+/* A block freed again while in quarantine is reported and left alone */
+static void test_quarantine_double_free (void) {
+	char * block = malloc(100);
+
+	mmwl_set_quarantine(1 << 20);
+	free(block);
+	capture_start();
+	free(block);
+	CHECK(capture_end("block already freed"));
+	capture_start();
+	mmwl_set_quarantine(0);
+	CHECK(!capture_end("write after free"));
+}
+
+/* Disabling the quarantine releases the blocks still gathered by the shards */
+static void test_quarantine_flush (void) {
+	char * block = malloc(100);
+
+	mmwl_set_quarantine(1 << 20);
+	free(block);
+	block[99] = 'X';
+	capture_start();
+	mmwl_set_quarantine(0);
+	CHECK(capture_end("write after free"));
+}
+
+struct node {
+	struct node * next;
+	char pad[24];
+};
+
+static struct node * rooted = NULL;
+
+static __attribute__((noinline)) struct node * leak_root (void) {
+	return malloc(sizeof(struct node));
+}
+
+/* Leaves a direct leak with an indirect child and a leaked two block cycle */
+static __attribute__((noinline)) void leak_some (void) {
+	struct node * parent = malloc(sizeof(struct node));
+	struct node * a = malloc(sizeof(struct node));
+	struct node * b = malloc(sizeof(struct node));
+
+	parent->next = malloc(48);
+	a->next = b;
+	b->next = a;
+}
+
+/* Overwrites the dead frames below the caller, which may still hold the lost pointers */
+static __attribute__((noinline)) void clear_stack (void) {
+	volatile char buf[4096];
+	memset((char *)buf, 0, sizeof(buf));
+}
+
+/* Only the unreachable blocks are reported, a cycle included */
+static void test_leak_check (void) {
+	long before = mmwl_leak_check();
+
+	rooted = leak_root();
+	rooted->next = NULL;
+	leak_some();
+	clear_stack();
+	capture_start();
+	CHECK(mmwl_leak_check() == before + 4);
+	capture_end("");
+	CHECK(reported("in 1 blocks @leak_some"));
+	CHECK(reported("indirect leak of 48 bytes in 1 blocks"));
+	CHECK(!reported("@leak_root"));
+	free(rooted);
+}
+
+int main () {
+	mmwl_set_stack_depth(8);	/* save allocation stacks */
+
+	test_status();
+	test_lookup_interior();
+	test_huge_size();
+	test_scanner_interval();
+	test_scanner_report();
+#ifndef MMWL_META_OOL
+	test_sampling();
+#endif
+	test_depot_dedup();
+	test_live_capture();
+	test_trace_analyze();
+	test_block_overhead();
+	test_redzone_widths();
+	test_histograms();
+	test_stats_page();
+	test_snapshot_diff();
+	test_export();
+	test_guard_pages();
+	test_tag_budget();
+	test_trace_replay();
+	test_wild_free();
+#ifdef MMWL_META_OOL
+	test_double_free();
+#endif
+	test_quarantine_eviction();
+	test_quarantine_double_free();
+	test_quarantine_flush();
+	test_leak_check();
+
+	return test_result();
 }
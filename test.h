@@ -0,0 +1,67 @@
+#ifndef TEST_H_
+#define TEST_H_
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+static int failures = 0;
+static int saved_fd = -1;
+static FILE * captured_stream = NULL;
+static FILE * report = NULL;
+static char captured[16384];
+
+#define CHECK(cond)											\
+	do {												\
+		if (!(cond)) {										\
+			printf("FAIL %s:%d: %s\n", __FILE__, __LINE__, #cond);				\
+			failures++;									\
+		}											\
+	} while(0)
+
+/* Redirect a stream to a temporary file */
+static inline void capture_stream (FILE * stream) {
+	fflush(stream);
+	captured_stream = stream;
+	report = tmpfile();
+	saved_fd = dup(fileno(stream));
+	dup2(fileno(report), fileno(stream));
+}
+
+/* Redirect the mmwl error reports to a temporary file */
+static inline void capture_start (void) {
+	capture_stream(stderr);
+}
+
+/* Redirect the mmwl information output, on stdout, to a temporary file */
+static inline void capture_info_start (void) {
+	capture_stream(stdout);
+}
+
+/* Restore the stream, returns non zero if the output captured contains text */
+static inline int capture_end (const char * text) {
+	size_t len;
+
+	fflush(captured_stream);
+	dup2(saved_fd, fileno(captured_stream));
+	close(saved_fd);
+	rewind(report);
+	len = fread(captured, 1, sizeof(captured) - 1, report);
+	captured[len] = '\0';
+	fclose(report);
+	fputs(captured, captured_stream);
+	return strstr(captured, text) != NULL;
+}
+
+/* Non zero if the reports last captured contain text */
+static inline int reported (const char * text) {
+	return strstr(captured, text) != NULL;
+}
+
+/* Prints the result, the exit status of a test program */
+static inline int test_result (void) {
+	printf("%s, %d failures\n", failures ? "FAILED" : "passed", failures);
+	return failures != 0;
+}
+
+#endif /* TEST_H_ */
@@ -0,0 +1,109 @@
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cstdint>
+#include <map>
+#include <new>
+#include <vector>
+#include "mmwl.hpp"
+#include "test.h"
+
+struct Foo {
+	int a;
+	double b;
+};
+
+struct alignas(64) Line {
+	char bytes[64];
+};
+
+/* Blocks of mmwl::allocator<T> are charged to a call site named after T */
+static void test_allocator_site (void) {
+	struct mmwl_block_info info;
+	std::vector<Foo, mmwl::allocator<Foo> > foos(10);
+	std::map<int, double, std::less<int>, mmwl::allocator<std::pair<const int, double> > > m;
+
+	CHECK(mmwl_lookup(foos.data(), &info) == 0);
+	CHECK(info.size == 10 * sizeof(Foo));
+	CHECK(strcmp(info.func_name, "Foo") == 0);
+	CHECK(strcmp(info.filename, "mmwl::allocator") == 0);
+
+	m[1] = 2.0;
+	CHECK(mmwl_lookup(&*m.begin(), &info) == 0);
+	CHECK(strstr(info.func_name, "std::pair<const int, double>") != NULL);
+}
+
+/* Global operator new goes to the library, over aligned types included */
+static void test_new (void) {
+	struct mmwl_block_info info;
+	Foo * foo = new Foo();
+	Line * line = new Line();
+	Line * lines = new Line[3];
+	uintptr_t deleted = (uintptr_t)foo;
+
+	CHECK(mmwl_lookup(foo, &info) == 0);
+	CHECK(strcmp(info.func_name, "operator new") == 0);
+	CHECK((uintptr_t)line % 64 == 0);
+	CHECK(mmwl_lookup(line, &info) == 0 && info.addr == line);
+	CHECK((uintptr_t)lines % 64 == 0);
+	CHECK(mmwl_lookup(lines, &info) == 0);
+	CHECK(strcmp(info.func_name, "operator new[]") == 0);
+	delete foo;
+	delete line;
+	delete[] lines;
+	CHECK(mmwl_lookup((void *)deleted, &info) == -1);
+}
+
+/* A sized delete of the wrong size is reported, the block is freed all the same */
+static void test_sized_delete (void) {
+	struct mmwl_block_info info;
+	void * block = ::operator new(100);
+	uintptr_t deleted = (uintptr_t)block;
+
+	capture_start();
+	::operator delete(block, 99);
+	CHECK(capture_end("sized free of 99 bytes"));
+	CHECK(mmwl_lookup((void *)deleted, &info) == -1);
+
+	block = ::operator new(100);
+	capture_start();
+	::operator delete(block, 100);
+	CHECK(!capture_end("sized free"));
+}
+
+/* A size which can not be allocated throws std::bad_alloc, or returns NULL for nothrow */
+static void test_huge_new (void) {
+	volatile std::size_t huge = SIZE_MAX - 16;
+	bool thrown = false;
+
+	try {
+		void * block = ::operator new(huge);
+		::operator delete(block);
+	} catch (const std::bad_alloc &) {
+		thrown = true;
+	}
+	CHECK(thrown);
+
+	thrown = false;
+	try {
+		void * block = ::operator new(huge, std::align_val_t(64));
+		::operator delete(block, std::align_val_t(64));
+	} catch (const std::bad_alloc &) {
+		thrown = true;
+	}
+	CHECK(thrown);
+
+	CHECK(::operator new(huge, std::nothrow) == NULL);
+	CHECK(::operator new[](huge, std::nothrow) == NULL);
+}
+
+int main () {
+	mmwl_set_stack_depth(8);	/* save allocation stacks */
+
+	test_allocator_site();
+	test_new();
+	test_sized_delete();
+	test_huge_new();
+
+	return test_result();
+}
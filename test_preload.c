@@ -0,0 +1,102 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <stdint.h>
+#include <malloc.h>
+#include <dlfcn.h>
+#include "test.h"
+
+/* Run under LD_PRELOAD=./libmmwl.so, not built against mmwl.h */
+
+static void * blocks[5];
+
+/* Each allocates from a frame of its own, the leaf of the stack recorded for the block */
+__attribute__((noinline)) void preload_malloc (void) {
+	blocks[0] = malloc(1000);
+}
+
+__attribute__((noinline)) void preload_calloc (void) {
+	blocks[1] = calloc(10, 101);
+}
+
+__attribute__((noinline)) void preload_realloc (void) {
+	blocks[2] = realloc(NULL, 1020);
+}
+
+__attribute__((noinline)) void preload_memalign (void) {
+	blocks[3] = memalign(64, 1030);
+}
+
+__attribute__((noinline)) void preload_posix_memalign (void) {
+	posix_memalign(&blocks[4], 64, 1040);
+}
+
+/* The interposed functions keep the libc semantics, the usable size is the size asked */
+static void test_interposition (void) {
+	void * ptr = NULL;
+	char * block = malloc(4000);
+	size_t i;
+	int zero = 1;
+
+	CHECK(block != NULL && malloc_usable_size(block) == 4000);
+	memset(block, 0xAA, 4000);
+	free(block);
+	block = calloc(4000, 1);
+	for (i = 0; block != NULL && i < 4000; i++)
+		zero &= block[i] == 0;
+	CHECK(block != NULL && zero);
+	strcpy(block, "kept");
+	block = realloc(block, 10000);
+	CHECK(block != NULL && strcmp(block, "kept") == 0 && malloc_usable_size(block) == 10000);
+	free(block);
+
+	CHECK(posix_memalign(&ptr, 24, 100) == EINVAL && ptr == NULL);
+	CHECK(posix_memalign(&ptr, 256, 100) == 0 && ((uintptr_t)ptr & 255) == 0);
+	free(ptr);
+	errno = 0;
+	CHECK(aligned_alloc(3, 100) == NULL && errno == EINVAL);
+	ptr = valloc(100);
+	CHECK(ptr != NULL && ((uintptr_t)ptr & (sysconf(_SC_PAGESIZE) - 1)) == 0);
+	free(ptr);
+	free(NULL);
+}
+
+/* The first frame of a captured stack is the caller of the interposed function */
+static void test_first_frame (void) {
+	int (*export)(int, unsigned int) = (int (*)(int, unsigned int))dlsym(RTLD_DEFAULT, "mmwl_export");
+	FILE * folded = tmpfile();
+	static char text[65536];
+	size_t len = 0;
+	int i;
+
+	CHECK(export != NULL);
+	if (export == NULL)
+		return;
+	preload_malloc();
+	preload_calloc();
+	preload_realloc();
+	preload_memalign();
+	preload_posix_memalign();
+	CHECK(export(fileno(folded), 1 | 0x100) == 0);		/* MMWL_EXPORT_FOLDED | MMWL_EXPORT_STACKS */
+	rewind(folded);
+	len = fread(text, 1, sizeof(text) - 1, folded);
+	text[len] = '\0';
+	fclose(folded);
+
+	CHECK(strstr(text, ";preload_malloc 1000\n") != NULL);
+	CHECK(strstr(text, ";preload_calloc 1010\n") != NULL);
+	CHECK(strstr(text, ";preload_realloc 1020\n") != NULL);
+	CHECK(strstr(text, ";preload_memalign 1030\n") != NULL);
+	CHECK(strstr(text, ";preload_posix_memalign 1040\n") != NULL);
+	for (i = 0; i < 5; i++)
+		free(blocks[i]);
+}
+
+int main () {
+	test_interposition();
+	test_first_frame();
+
+	return test_result();
+}